@@ -8,5 +8,17 @@ gcc -g -o ./bin/broker ./src/broker.c
 gcc -g -o ./bin/subscriber ./src/subscriber.c
 gcc -g -o ./bin/stress ./src/stress.c
 
+# Client library
+gcc -g -c -o ./bin/akclient.o ./src/akclient.c
+# Only the ak_* API is exported, everything from common.h stays local to the library.
+objcopy -w --keep-global-symbol='ak_*' ./bin/akclient.o
+ar rcs ./bin/libakclient.a ./bin/akclient.o
+gcc -g -o ./bin/example_client ./src/example_client.c ./bin/libakclient.a
+
+# Benchmarks
+gcc -O2 -g -o ./bin/microbench ./src/microbench.c
+gcc -O2 -g -o ./bin/bench ./src/bench.c
+gcc -O2 -g -o ./bin/loadgen ./src/loadgen.c -lm
+
 # Testing
 gcc -g -o ./bin/tests ./src/tests.c && ./bin/tests
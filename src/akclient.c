@@ -0,0 +1,254 @@
+#include "common.h"
+#include "akclient.h"
+
+#define AK_DEFAULT_MAX_QUEUED_BYTES  (4 << 20)
+#define AK_DEFAULT_BATCH_BYTES       (16 << 10)
+#define AK_DEFAULT_FLUSH_INTERVAL_MS 100
+
+typedef struct {
+    Endpoint* endpoint;
+    String_Builder staging;   // Filled by ak_publish() while holding the client mutex.
+    size_t staged_messages;
+    String_Builder outgoing;  // Only touched by the I/O thread.
+    size_t outgoing_messages;
+} Ak_Broker;
+
+struct Ak_Client {
+    Ak_Broker* brokers;
+    size_t broker_count;
+    size_t max_queued_bytes;
+    size_t batch_bytes;
+    uint32_t flush_interval_ms;
+    Connection_Pool connections;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake_up; // Tells the I/O thread to send now.
+    pthread_cond_t drained; // Tells ak_client_flush() that queued_bytes went down.
+    size_t queued_bytes;    // Staged plus outgoing bytes.
+    size_t staged_bytes;
+    size_t next_broker;     // Round-robin for messages without a key.
+    bool flush_requested;
+    bool stopping;
+    Ak_Client_Stats stats;
+
+    pthread_t io_thread;
+    bool has_io_thread;
+};
+
+static void* ak_io_thread(void* arg)
+{
+    Ak_Client* client = (Ak_Client*)arg;
+
+    // Set when the last round couldn't send anything because every broker with a batch is down.
+    bool blocked = false;
+    uint64_t retry_at_ms = 0;
+
+    pthread_mutex_lock(&client->mutex);
+    for (;;) {
+        if (blocked && !client->stopping) {
+            // Flushes don't hurry the brokers that back off, that would only spin until the flush times out.
+            uint64_t const now = time_now_ms();
+            uint64_t const wait_ms = Min(retry_at_ms > now ? retry_at_ms - now : 0, client->flush_interval_ms);
+            if (wait_ms > 0) {
+                struct timespec deadline = timespec_after_ms(wait_ms);
+                pthread_cond_timedwait(&client->wake_up, &client->mutex, &deadline);
+            }
+        } else if (!client->stopping && !client->flush_requested && client->staged_bytes < client->batch_bytes) {
+            struct timespec deadline = timespec_after_ms(client->flush_interval_ms);
+            pthread_cond_timedwait(&client->wake_up, &client->mutex, &deadline);
+        }
+        bool const stopping = client->stopping;
+        client->flush_requested = false;
+
+        // Take everything staged so far, publishers can keep staging while we send.
+        for (size_t i = 0; i < client->broker_count; i++) {
+            Ak_Broker* broker = &client->brokers[i];
+            if (broker->staging.count == 0) continue;
+            if (broker->outgoing.count == 0) {
+                String_Builder empty = broker->outgoing;
+                broker->outgoing = broker->staging;
+                broker->staging = empty;
+            } else {
+                bytes_append(&broker->outgoing, broker->staging.data, broker->staging.count);
+                broker->staging.count = 0;
+            }
+            broker->outgoing_messages += broker->staged_messages;
+            broker->staged_messages = 0;
+        }
+        client->staged_bytes = 0;
+        pthread_mutex_unlock(&client->mutex);
+
+        // A broker that is down keeps its batch until it comes back, the endpoint backoff paces the retries.
+        size_t sent_bytes = 0;
+        size_t sent_messages = 0;
+        bool unsent = false;
+        retry_at_ms = UINT64_MAX;
+        for (size_t i = 0; i < client->broker_count; i++) {
+            Ak_Broker* broker = &client->brokers[i];
+            if (broker->outgoing.count == 0) continue;
+            if (endpoint_send(broker->endpoint, String_from_builder(broker->outgoing))) {
+                sent_bytes += broker->outgoing.count;
+                sent_messages += broker->outgoing_messages;
+                broker->outgoing.count = 0;
+                broker->outgoing_messages = 0;
+            } else {
+                unsent = true;
+                pthread_mutex_lock(&broker->endpoint->mutex);
+                retry_at_ms = Min(retry_at_ms, broker->endpoint->retry_at_ms);
+                pthread_mutex_unlock(&broker->endpoint->mutex);
+            }
+        }
+        blocked = unsent && sent_bytes == 0;
+
+        pthread_mutex_lock(&client->mutex);
+        if (sent_bytes > 0) {
+            client->queued_bytes -= sent_bytes;
+            client->stats.sent += sent_messages;
+            pthread_cond_broadcast(&client->drained);
+        }
+        if (stopping) break;
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    return NULL;
+}
+
+Ak_Client* ak_client_create(Ak_Client_Config const* config)
+{
+    if (config == NULL || config->broker_count == 0) {
+        eprintfln("ERROR: The client needs at least one broker");
+        return NULL;
+    }
+
+    Ak_Client* client = (Ak_Client*)calloc(1, sizeof(*client));
+    assert(client != NULL);
+    client->broker_count = config->broker_count;
+    client->max_queued_bytes = config->max_queued_bytes ? config->max_queued_bytes : AK_DEFAULT_MAX_QUEUED_BYTES;
+    client->batch_bytes = config->batch_bytes ? config->batch_bytes : AK_DEFAULT_BATCH_BYTES;
+    client->flush_interval_ms = config->flush_interval_ms ? config->flush_interval_ms : AK_DEFAULT_FLUSH_INTERVAL_MS;
+    client->connections = (Connection_Pool)CONNECTION_POOL_INITIALIZER;
+    pthread_mutex_init(&client->mutex, NULL);
+    pthread_cond_init(&client->wake_up, NULL);
+    pthread_cond_init(&client->drained, NULL);
+
+    client->brokers = (Ak_Broker*)calloc(config->broker_count, sizeof(*client->brokers));
+    assert(client->brokers != NULL);
+    for (size_t i = 0; i < config->broker_count; i++) {
+        String const address = String_from_cstr(config->brokers[i]);
+        ssize_t colon = -1;
+        for (size_t j = 0; j < address.length; j++) {
+            if (String_get(address, j) == ':') colon = j;
+        }
+        if (colon <= 0 || colon == (ssize_t)address.length - 1) {
+            eprintfln("ERROR: Broker address \"%s\" is not host:port", config->brokers[i]);
+            ak_client_destroy(client);
+            return NULL;
+        }
+        String host = string_clone((String){ .data = address.data, .length = colon });
+        client->brokers[i].endpoint = connection_pool_get(&client->connections, host.data, address.data + colon + 1);
+        string_destroy(&host);
+    }
+
+    if (pthread_create(&client->io_thread, NULL, ak_io_thread, client) != 0) {
+        eprintfln("ERROR: Failed to create the client I/O thread");
+        ak_client_destroy(client);
+        return NULL;
+    }
+    client->has_io_thread = true;
+
+    return client;
+}
+
+bool ak_publish(Ak_Client* client, const char* topic, const char* key, const char* value)
+{
+    String const topic_string = String_from_cstr(topic);
+    String const value_string = String_from_cstr(value);
+    bool const valid = topic_string.length > 0 &&
+        string_find_char(topic_string, '|') < 0 && string_find_char(topic_string, '\n') < 0 &&
+        string_find_char(value_string, '|') < 0 && string_find_char(value_string, '\n') < 0;
+    size_t const line_length = topic_string.length + 1 + value_string.length + 1;
+
+    pthread_mutex_lock(&client->mutex);
+    if (!valid || client->queued_bytes + line_length > client->max_queued_bytes) {
+        client->stats.dropped++;
+        pthread_mutex_unlock(&client->mutex);
+        return false;
+    }
+
+    Ak_Broker* broker;
+    if (key != NULL) {
+        broker = &client->brokers[hash_string(String_from_cstr(key)) % client->broker_count];
+    } else {
+        broker = &client->brokers[client->next_broker++ % client->broker_count];
+    }
+    bytes_append(&broker->staging, topic_string.data, topic_string.length);
+    list_append(&broker->staging, '|');
+    bytes_append(&broker->staging, value_string.data, value_string.length);
+    list_append(&broker->staging, '\n');
+    broker->staged_messages++;
+
+    client->queued_bytes += line_length;
+    client->staged_bytes += line_length;
+    client->stats.published++;
+    if (client->staged_bytes >= client->batch_bytes) {
+        pthread_cond_signal(&client->wake_up);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    return true;
+}
+
+bool ak_client_flush(Ak_Client* client, uint32_t timeout_ms)
+{
+    struct timespec deadline = timespec_after_ms(timeout_ms);
+
+    pthread_mutex_lock(&client->mutex);
+    while (client->queued_bytes > 0) {
+        client->flush_requested = true;
+        pthread_cond_signal(&client->wake_up);
+        if (pthread_cond_timedwait(&client->drained, &client->mutex, &deadline) == ETIMEDOUT) break;
+    }
+    bool const drained = client->queued_bytes == 0;
+    pthread_mutex_unlock(&client->mutex);
+
+    return drained;
+}
+
+Ak_Client_Stats ak_client_stats(Ak_Client* client)
+{
+    pthread_mutex_lock(&client->mutex);
+    Ak_Client_Stats stats = client->stats;
+    pthread_mutex_unlock(&client->mutex);
+    return stats;
+}
+
+Ak_Client_Stats ak_client_destroy(Ak_Client* client)
+{
+    if (client->has_io_thread) {
+        pthread_mutex_lock(&client->mutex);
+        client->stopping = true;
+        pthread_cond_signal(&client->wake_up);
+        pthread_mutex_unlock(&client->mutex);
+        pthread_join(client->io_thread, NULL);
+    }
+
+    // Whatever the last attempt couldn't send is lost.
+    uint64_t lost = 0;
+    for (size_t i = 0; i < client->broker_count; i++) {
+        lost += client->brokers[i].staged_messages + client->brokers[i].outgoing_messages;
+        list_destroy_safely(&client->brokers[i].staging);
+        list_destroy_safely(&client->brokers[i].outgoing);
+    }
+    if (lost > 0) {
+        eprintfln("WARNING: %llu messages could not be sent before the client was destroyed", (unsigned long long)lost);
+    }
+    Ak_Client_Stats stats = client->stats;
+    stats.dropped += lost;
+    free(client->brokers);
+    connection_pool_destroy(&client->connections);
+    pthread_cond_destroy(&client->drained);
+    pthread_cond_destroy(&client->wake_up);
+    pthread_mutex_destroy(&client->mutex);
+    free(client);
+    return stats;
+}
@@ -0,0 +1,52 @@
+#ifndef AKCLIENT_H
+#define AKCLIENT_H
+
+// AK Light publisher client library.
+//
+// Lets a program publish metrics in-process instead of running the `publisher` binary. ak_publish() only copies
+// the message into a staging buffer, a background thread batches the buffered messages and sends them to the
+// brokers over persistent connections.
+//
+// The key decides which broker of the cluster gets the message, the same key always goes to the same broker.
+// Messages without a key are spread over the brokers in round-robin.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Ak_Client Ak_Client;
+
+typedef struct {
+    const char* const* brokers;  // "host:port" of every broker in the cluster.
+    size_t broker_count;
+    size_t max_queued_bytes;     // Messages get dropped once this many bytes wait to be sent. Default 4 MB.
+    size_t batch_bytes;          // The I/O thread wakes up early when this many bytes are staged. Default 16 KB.
+    uint32_t flush_interval_ms;  // Longest time a message waits before being sent. Default 100 ms.
+} Ak_Client_Config;
+
+// Until the client is destroyed, the messages that are neither sent nor dropped are still queued. The stats
+// returned by ak_client_destroy() account for every message.
+typedef struct {
+    uint64_t published; // Accepted by ak_publish().
+    uint64_t sent;      // Written to a broker.
+    uint64_t dropped;   // Rejected because the queue was full or the message was invalid, or still queued when
+                        // the client was destroyed.
+} Ak_Client_Stats;
+
+// Returns NULL when the configuration is invalid.
+Ak_Client* ak_client_create(Ak_Client_Config const* config);
+
+// Never blocks on the network. Returns false when the message was dropped, either because it contains a
+// '|' or a newline, or because too many messages are waiting to be sent. `key` may be NULL.
+bool ak_publish(Ak_Client* client, const char* topic, const char* key, const char* value);
+
+// Waits until every queued message was sent or `timeout_ms` passed. Returns true when the queue is empty.
+bool ak_client_flush(Ak_Client* client, uint32_t timeout_ms);
+
+Ak_Client_Stats ak_client_stats(Ak_Client* client);
+
+// Tries to send what is still queued and frees the client. Returns the final stats, where the messages that
+// could not be sent count as dropped.
+Ak_Client_Stats ak_client_destroy(Ak_Client* client);
+
+#endif // AKCLIENT_H
@@ -0,0 +1,496 @@
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "common.h"
+
+// End to end benchmark of the broker. It starts the brokers from ./bin/broker, then synthetic publishers and
+// subscribers, each as its own process, and reports how many messages got in and out per second and how long
+// they took from publisher to subscriber.
+//
+// Publishers run open loop: message i is due at start + i / rate no matter how long the previous ones took,
+// and its latency is counted from when it was due, not from when it could be sent. Otherwise a stalled broker
+// would hold the publishers back and the stall would only show up in a few samples (coordinated omission).
+//
+// Every message carries the CLOCK_MONOTONIC time it was due at the start of its value, which works because all
+// the processes run on this machine. The topics are "bench/<n>/value", and the subscribers either take all of
+// them with "bench/+/value" or a single one. They are persistent, the others only get the latest message.
+
+#define BENCH_TOPIC_PREFIX "bench/"
+#define BENCH_RESULT_MAGIC 0x62656e6368ull
+
+typedef struct {
+    const char* broker_path;
+    int broker_count;
+    int publisher_count;
+    int subscriber_count;
+    int topic_count;
+    double wildcard_fraction; // Of the subscribers.
+    size_t message_size;      // Bytes of the value.
+    double rate;              // Messages per second of each publisher.
+    double duration;          // Seconds.
+    int base_port;
+} Bench_Config;
+
+static Bench_Config config = {
+    .broker_path = "./bin/broker",
+    .broker_count = 1,
+    .publisher_count = 4,
+    .subscriber_count = 4,
+    .topic_count = 100,
+    .wildcard_fraction = 0.5,
+    .message_size = 64,
+    .rate = 1000,
+    .duration = 5,
+    .base_port = 31000,
+};
+
+// What every publisher and subscriber process writes back to the parent through its pipe.
+typedef struct {
+    uint64_t magic;
+    uint64_t messages;
+    uint64_t late; // Messages a publisher sent after the next one was already due.
+    uint64_t first_ns, last_ns; // When the first and the last message went out or came in.
+    Histogram latency;
+} Bench_Result;
+
+#define subscriber_port_of(broker) (config.base_port + 2 * (broker))
+#define publisher_port_of(broker)  (config.base_port + 2 * (broker) + 1)
+#define listen_port_of(subscriber) (config.base_port + 2 * config.broker_count + (subscriber))
+
+bool is_wildcard_subscriber(int const subscriber)
+{
+    return subscriber < (int)(config.wildcard_fraction * config.subscriber_count + 0.5);
+}
+
+int connect_to_port(int const port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Retries for a while, the brokers may still be starting.
+int connect_with_retries(int const port)
+{
+    for (int attempt = 0; attempt < 50; attempt++) {
+        int fd = connect_to_port(port);
+        if (fd >= 0) return fd;
+        usleep(100 * 1000);
+    }
+    eprintfln("ERROR: Could not connect to port %d", port);
+    return -1;
+}
+
+void sleep_until_ns(uint64_t const deadline_ns)
+{
+    struct timespec ts = { .tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+void write_result(int const fd, Bench_Result const* result)
+{
+    char const* data = (char const*)result;
+    size_t written = 0;
+    while (written < sizeof(*result)) {
+        ssize_t n = write(fd, data + written, sizeof(*result) - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        written += n;
+    }
+}
+
+bool read_result(int const fd, Bench_Result* result)
+{
+    char* data = (char*)result;
+    size_t received = 0;
+    while (received < sizeof(*result)) {
+        ssize_t n = read(fd, data + received, sizeof(*result) - received);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        received += n;
+    }
+    return result->magic == BENCH_RESULT_MAGIC;
+}
+
+// Publishers
+// ------------------------------------------------------------------------------------------------------- //
+
+void run_publisher(int const publisher, Bench_Result* result)
+{
+    int broker_fd = connect_with_retries(publisher_port_of(publisher % config.broker_count));
+    if (broker_fd < 0) return;
+
+    uint64_t const interval_ns = (uint64_t)(1e9 / config.rate);
+    uint64_t const start_ns = time_now_ns();
+    uint64_t const end_ns = start_ns + (uint64_t)(config.duration * 1e9);
+    String_Builder message = {};
+    for (uint64_t i = 0;; i++) {
+        uint64_t const due_ns = start_ns + i * interval_ns;
+        if (due_ns >= end_ns) break;
+        uint64_t const now_ns = time_now_ns();
+        if (now_ns < due_ns) {
+            sleep_until_ns(due_ns);
+        } else if (now_ns >= due_ns + interval_ns) {
+            result->late++;
+        }
+
+        // Publishers go through the topics from different places so they don't all hit the same one at once.
+        int const topic = (publisher * 7919 + i) % config.topic_count;
+        message.count = 0;
+        // The value is the time it was due, padded with spaces to the message size.
+        string_builder_appendf(&message, BENCH_TOPIC_PREFIX "%d/value|%-*llu\n", topic, (int)config.message_size,
+                (unsigned long long)due_ns);
+
+        if (!send_all(broker_fd, String_from_builder(message))) {
+            perror("ERROR: Publisher send");
+            break;
+        }
+        if (result->messages++ == 0) result->first_ns = time_now_ns();
+        result->last_ns = time_now_ns();
+    }
+
+    string_builder_destroy(&message);
+    close(broker_fd);
+}
+
+// Subscribers
+// ------------------------------------------------------------------------------------------------------- //
+
+bool register_subscriber(int const subscriber, int const broker)
+{
+    char registration[256];
+    if (is_wildcard_subscriber(subscriber)) {
+        snprintf(registration, sizeof(registration), BENCH_TOPIC_PREFIX "+/value|127.0.0.1:%d|p|name=bench-%d\n",
+                listen_port_of(subscriber), subscriber);
+    } else {
+        snprintf(registration, sizeof(registration), BENCH_TOPIC_PREFIX "%d/value|127.0.0.1:%d|p|name=bench-%d\n",
+                subscriber % config.topic_count, listen_port_of(subscriber), subscriber);
+    }
+
+    int fd = connect_with_retries(subscriber_port_of(broker));
+    if (fd < 0) return false;
+    bool const sent = send_all(fd, String_from_cstr(registration));
+    close(fd);
+    return sent;
+}
+
+void handle_delivery(String const line, uint64_t const now_ns, Bench_Result* result)
+{
+    String topic, value;
+    if (!parse_delivery_line(line, &topic, &value)) return;
+    uint64_t due_ns = 0;
+    for (size_t i = 0; i < value.length && isdigit(String_get(value, i)); i++) {
+        due_ns = due_ns * 10 + (String_get(value, i) - '0');
+    }
+    if (result->messages++ == 0) result->first_ns = now_ns;
+    result->last_ns = now_ns;
+    histogram_record(&result->latency, now_ns > due_ns ? now_ns - due_ns : 0);
+}
+
+#define BENCH_DRAIN_NS  (1000 * 1000 * 1000ull)
+#define BENCH_LINGER_NS (10 * BENCH_DRAIN_NS)
+
+// Set by SIGUSR1, which the parent sends once every publisher is done.
+static volatile sig_atomic_t publishers_done = 0;
+
+void on_publishers_done(int signal)
+{
+    (void)signal;
+    publishers_done = 1;
+}
+
+// Listens until the publishers are done and nothing arrived for BENCH_DRAIN_NS, or for BENCH_LINGER_NS at most
+// after they are done when the broker keeps falling behind.
+void run_subscriber(int const subscriber, Bench_Result* result)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int const reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(listen_port_of(subscriber)),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("ERROR: Subscriber listen");
+        return;
+    }
+    for (int broker = 0; broker < config.broker_count; broker++) {
+        if (!register_subscriber(subscriber, broker)) return;
+    }
+
+    typedef struct {
+        int fd;
+        Receive_Buffer buffer;
+    } Delivery_Connection;
+    Delivery_Connection connections[64];
+    size_t connection_count = 0;
+    struct pollfd pollfds[1 + ArrayCount(connections)];
+
+    uint64_t last_delivery_ns = time_now_ns();
+    uint64_t done_ns = 0;
+    for (;;) {
+        uint64_t now_ns = time_now_ns();
+        if (publishers_done && done_ns == 0) done_ns = now_ns;
+        if (done_ns != 0 && (now_ns - Max(last_delivery_ns, done_ns) >= BENCH_DRAIN_NS || now_ns - done_ns >= BENCH_LINGER_NS)) {
+            break;
+        }
+
+        pollfds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        for (size_t i = 0; i < connection_count; i++) {
+            pollfds[1 + i] = (struct pollfd){ .fd = connections[i].fd, .events = POLLIN };
+        }
+        if (poll(pollfds, 1 + connection_count, 100) <= 0) continue;
+        now_ns = time_now_ns();
+        last_delivery_ns = now_ns;
+
+        for (size_t i = connection_count; i > 0; i--) {
+            Delivery_Connection* connection = &connections[i - 1];
+            if (pollfds[i].revents == 0) continue;
+            if (receive_buffer_read(&connection->buffer, connection->fd) <= 0) {
+                close(connection->fd);
+                receive_buffer_destroy(&connection->buffer);
+                *connection = connections[--connection_count];
+                continue;
+            }
+            String line;
+            while (receive_buffer_next_line(&connection->buffer, &line)) {
+                handle_delivery(line, now_ns, result);
+            }
+        }
+
+        if ((pollfds[0].revents & POLLIN) && connection_count < ArrayCount(connections)) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                connections[connection_count++] = (Delivery_Connection){
+                    .fd = fd,
+                    .buffer = receive_buffer_create(64 * 1024),
+                };
+            }
+        }
+    }
+
+    for (size_t i = 0; i < connection_count; i++) {
+        close(connections[i].fd);
+        receive_buffer_destroy(&connections[i].buffer);
+    }
+    close(listen_fd);
+}
+
+// Processes
+// ------------------------------------------------------------------------------------------------------- //
+
+typedef struct {
+    pid_t pid;
+    int result_fd; // -1 for the brokers, which report nothing.
+} Child;
+
+typedef struct {
+    Child* data;
+    size_t count, capacity;
+} Child_list;
+
+pid_t start_broker(int const broker)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        char subscriber_port[16], publisher_port[16];
+        snprintf(subscriber_port, sizeof(subscriber_port), "%d", subscriber_port_of(broker));
+        snprintf(publisher_port, sizeof(publisher_port), "%d", publisher_port_of(broker));
+        // What the broker logs would get mixed with the report.
+        freopen("/dev/null", "w", stdout);
+        execl(config.broker_path, config.broker_path, "session", subscriber_port, publisher_port, (char*)NULL);
+        perror("ERROR: Could not start the broker");
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// Runs `run` in a child process and keeps the end of the pipe its result comes through.
+void start_worker(Child_list* children, void (*run)(int, Bench_Result*), int const index)
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("ERROR: pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Bench_Result* result = (Bench_Result*)calloc(1, sizeof(*result));
+        assert(result != NULL);
+        result->magic = BENCH_RESULT_MAGIC;
+        run(index, result);
+        write_result(fds[1], result);
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    list_append(children, ((Child){ .pid = pid, .result_fd = fds[0] }));
+}
+
+double messages_per_second(Bench_Result const* result)
+{
+    if (result->messages < 2) return 0;
+    return (result->messages - 1) / ((result->last_ns - result->first_ns) / 1e9);
+}
+
+void print_latency(const char* name, Histogram const* latency)
+{
+    printfln("%-12s p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms", name,
+            histogram_percentile(latency, 50) / 1e6, histogram_percentile(latency, 90) / 1e6,
+            histogram_percentile(latency, 99) / 1e6, histogram_percentile(latency, 99.9) / 1e6,
+            latency->max / 1e6);
+}
+
+void usage(const char **argv)
+{
+    eprintfln("usage: %s [flags ...]", argv[0]);
+    eprintfln("\nflags:");
+    eprintfln("    -broker <path>: The broker binary. %s by default.", config.broker_path);
+    eprintfln("    -brokers <n>: Brokers to start, every publisher sends to one of them and every subscriber");
+    eprintfln("                  registers with all of them. %d by default.", config.broker_count);
+    eprintfln("    -publishers <n>: %d by default.", config.publisher_count);
+    eprintfln("    -subscribers <n>: %d by default.", config.subscriber_count);
+    eprintfln("    -topics <n>: How many different topics get published. %d by default.", config.topic_count);
+    eprintfln("    -wildcards <fraction>: Of the subscribers that take every topic, the rest take one. %g by default.", config.wildcard_fraction);
+    eprintfln("    -size <bytes>: Of the value of each message. %zu by default.", config.message_size);
+    eprintfln("    -rate <n>: Messages per second of each publisher. %g by default.", config.rate);
+    eprintfln("    -duration <seconds>: %g by default.", config.duration);
+    eprintfln("    -port <port>: The first of the ports to use, the brokers take two each and every subscriber one.");
+    eprintfln("                  %d by default.", config.base_port);
+    eprintfln();
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char** argv)
+{
+    for (const char **flag = &argv[1]; *flag != NULL; flag++) {
+        if (flag[1] == NULL) {
+            eprintfln("ERROR: Flag \"%s\" needs an argument.\n", *flag);
+            usage(argv);
+        }
+        const char* arg = *++flag;
+        if (strcmp(flag[-1], "-broker") == 0) {
+            config.broker_path = arg;
+        } else if (strcmp(flag[-1], "-brokers") == 0) {
+            config.broker_count = atoi(arg);
+        } else if (strcmp(flag[-1], "-publishers") == 0) {
+            config.publisher_count = atoi(arg);
+        } else if (strcmp(flag[-1], "-subscribers") == 0) {
+            config.subscriber_count = atoi(arg);
+        } else if (strcmp(flag[-1], "-topics") == 0) {
+            config.topic_count = atoi(arg);
+        } else if (strcmp(flag[-1], "-wildcards") == 0) {
+            config.wildcard_fraction = strtod(arg, NULL);
+        } else if (strcmp(flag[-1], "-size") == 0) {
+            config.message_size = strtoull(arg, NULL, 10);
+        } else if (strcmp(flag[-1], "-rate") == 0) {
+            config.rate = strtod(arg, NULL);
+        } else if (strcmp(flag[-1], "-duration") == 0) {
+            config.duration = strtod(arg, NULL);
+        } else if (strcmp(flag[-1], "-port") == 0) {
+            config.base_port = atoi(arg);
+        } else {
+            eprintfln("ERROR: Unrecognized flag \"%s\".\n", flag[-1]);
+            usage(argv);
+        }
+    }
+    if (config.broker_count < 1 || config.publisher_count < 1 || config.subscriber_count < 0 ||
+            config.topic_count < 1 || config.rate <= 0 || config.duration <= 0) {
+        eprintfln("ERROR: The counts, the rate and the duration must be positive.\n");
+        usage(argv);
+    }
+
+    int wildcard_count = 0;
+    for (int i = 0; i < config.subscriber_count; i++) {
+        wildcard_count += is_wildcard_subscriber(i);
+    }
+    printfln("INFO: %d brokers, %d publishers at %g msg/s, %d subscribers (%d wildcard), %d topics, %zu byte values, %g s",
+            config.broker_count, config.publisher_count, config.rate, config.subscriber_count, wildcard_count,
+            config.topic_count, config.message_size, config.duration);
+    fflush(stdout); // Or the children print it again.
+
+    Child_list brokers = {};
+    for (int i = 0; i < config.broker_count; i++) {
+        list_append(&brokers, ((Child){ .pid = start_broker(i), .result_fd = -1 }));
+    }
+
+    // The subscribers have to be registered before the first message, or they miss it. They inherit the
+    // handler, so the signal can't come before it is set.
+    signal(SIGUSR1, on_publishers_done);
+    Child_list subscribers = {};
+    for (int i = 0; i < config.subscriber_count; i++) {
+        start_worker(&subscribers, run_subscriber, i);
+    }
+    usleep(500 * 1000);
+    Child_list publishers = {};
+    for (int i = 0; i < config.publisher_count; i++) {
+        start_worker(&publishers, run_publisher, i);
+    }
+
+    Bench_Result* result = (Bench_Result*)calloc(1, sizeof(*result));
+    Bench_Result* total = (Bench_Result*)calloc(2, sizeof(*total)); // Publishers then subscribers.
+    uint64_t* topic_messages = (uint64_t*)calloc(config.topic_count, sizeof(*topic_messages));
+    assert(result != NULL && total != NULL && topic_messages != NULL);
+    total[0].first_ns = total[1].first_ns = UINT64_MAX;
+    Child_list* const workers[] = { &publishers, &subscribers };
+    for (size_t w = 0; w < ArrayCount(workers); w++) {
+        for (size_t i = 0; i < workers[w]->count; i++) {
+            Child const child = list_get(*workers[w], i);
+            if (read_result(child.result_fd, result)) {
+                total[w].messages += result->messages;
+                total[w].late += result->late;
+                if (result->messages > 0) {
+                    total[w].first_ns = Min(total[w].first_ns, result->first_ns);
+                    total[w].last_ns = Max(total[w].last_ns, result->last_ns);
+                }
+                histogram_merge(&total[w].latency, &result->latency);
+                for (uint64_t j = 0; w == 0 && j < result->messages; j++) {
+                    topic_messages[(i * 7919 + j) % config.topic_count]++;
+                }
+            } else {
+                eprintfln("ERROR: Process %d reported nothing", (int)child.pid);
+            }
+            close(child.result_fd);
+            waitpid(child.pid, NULL, 0);
+        }
+        if (w == 0) {
+            for (size_t i = 0; i < subscribers.count; i++) {
+                kill(list_get(subscribers, i).pid, SIGUSR1);
+            }
+        }
+    }
+    for (size_t i = 0; i < brokers.count; i++) {
+        kill(list_get(brokers, i).pid, SIGTERM);
+        waitpid(list_get(brokers, i).pid, NULL, 0);
+    }
+
+    // Every message reaches each subscriber whose pattern matches once, whichever broker it went through.
+    uint64_t expected = 0;
+    for (int i = 0; i < config.subscriber_count; i++) {
+        expected += is_wildcard_subscriber(i) ? total[0].messages : topic_messages[i % config.topic_count];
+    }
+
+    printfln("ingest:      %.0f msg/s (%llu messages, %llu sent late)", messages_per_second(&total[0]),
+            (unsigned long long)total[0].messages, (unsigned long long)total[0].late);
+    printfln("delivered:   %.0f msg/s (%llu of %llu messages)", messages_per_second(&total[1]),
+            (unsigned long long)total[1].messages, (unsigned long long)expected);
+    print_latency("latency:", &total[1].latency);
+
+    list_destroy_safely(&brokers);
+    list_destroy_safely(&subscribers);
+    list_destroy_safely(&publishers);
+    free(result);
+    free(total);
+    free(topic_messages);
+    return 0;
+}
@@ -1,155 +1,1182 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
 #include "common.h"
 
+// A subscription that outlives the registration that created it. Its thread delivers every message from
+// `offset` on, and only moves `offset` forward once the subscriber got them, so when a persistent subscriber
+// comes back after being unreachable it resumes where it was. Subscriptions that aren't persistent skip to the
+// latest message instead, and end when their subscriber goes away.
+typedef struct {
+    String key;                        // Owned, see subscription_key().
+    String registration_text;          // Owned, the registration line it was created from.
+    Subscriber_Message sub;            // Owned by the subscription thread.
+    Subscriber_Message* registration;  // A newer registration the thread hasn't picked up yet.
+    uint64_t offset;
+    uint64_t saved_offset;             // The offset in the registry.
+    uint64_t saved_at_ms;
+} Subscription;
+
+typedef struct {
+    Subscription** data;
+    size_t count, capacity;
+} Subscription_list;
+
+// The subscriptions are saved in a file so they survive restarts. Changes are appended to it as lines:
+//     sub <registration line>
+//     off <offset> <key>
+//     del <key>
+// and it gets rewritten with only the live subscriptions when it's loaded and when it grows too much. The lines
+// are queued under messages_mutex and its thread writes them, so the disk never holds up the messages.
+typedef struct {
+    const char* path;         // NULL when subscriptions aren't saved.
+    FILE* file;               // Only used by the registry thread once it runs.
+    size_t records;           // Lines appended since it was last rewritten, guarded by messages_mutex.
+    pthread_mutex_t mutex;    // Guards what follows.
+    pthread_cond_t queued;
+    String_Builder pending;   // Lines to append.
+    String_Builder rewrite;   // The whole file to replace it with, if it has to be rewritten.
+    bool has_rewrite;
+} Registry;
+
+#define REGISTRY_OFFSET_INTERVAL_MS 1000
+#define REGISTRY_MIN_RECORDS        1024
+
+typedef struct {
+    String topic; // Owned.
+    size_t level_count;
+    uint64_t messages_in, messages_out;
+    uint64_t published_in, published_out; // The counts when they were last published.
+} Topic_Stats;
+
+typedef struct {
+    Topic_Stats* data;
+    size_t count, capacity;
+} Topic_Stats_list;
+
+// What the broker counts about itself, see publish_stats().
+typedef struct {
+    uint64_t messages_in, bytes_in;
+    uint64_t messages_out, bytes_out;
+    uint64_t rejected;
+    uint64_t evicted;
+    uint64_t lock_wait_ns;
+    Topic_Stats_list topics;
+    Hash_Index topics_index;
+} Broker_Stats;
+
 typedef struct {
-    Publisher_Message_list messages;
+    Message_Log log;
+    Subscription_list subscriptions;
+    Registry registry;
+    Broker_Stats stats;
+    Log_Compactor compactor;
+    Rollup_Tier_list rollups;
+    // Guards the log, the compactor, the rollups, the subscriptions, the registry and the stats.
     pthread_mutex_t messages_mutex;
-    pthread_cond_t message_arrived;
+    pthread_cond_t message_arrived; // Also signaled when a subscription gets a new registration.
+    Connection_Pool subscriber_connections;
 } State;
 
 static State ctx = {
+    .registry = { .mutex = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER },
     .messages_mutex = PTHREAD_MUTEX_INITIALIZER,
     .message_arrived = PTHREAD_COND_INITIALIZER,
+    .subscriber_connections = CONNECTION_POOL_INITIALIZER,
 };
 
-void* publisher_connection(void* arg)
+#define PUBLISHER_BUFFER_SIZE (64 * 1024)
+
+// Takes messages_mutex, counting how long it waited for it.
+void lock_messages(void)
 {
-    assert(sizeof(void*) >= sizeof(int));
-    int publisher_port = (int)(size_t)arg;
+    uint64_t const start = time_now_ns();
+    pthread_mutex_lock(&ctx.messages_mutex);
+    ctx.stats.lock_wait_ns += time_now_ns() - start;
+}
 
-    // Create socket
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+// Must be called with messages_mutex held.
+Topic_Stats* topic_stats(String const topic)
+{
+    Broker_Stats* stats = &ctx.stats;
+    uint64_t const hash = hash_string(topic);
+    size_t probe = 0;
+    for (uint32_t i; (i = hash_index_next(&stats->topics_index, hash, &probe)) != HASH_INDEX_EMPTY;) {
+        if (string_equals(list_get(stats->topics, i).topic, topic)) {
+            return &list_get(stats->topics, i);
+        }
+    }
+
+    size_t level_count = 1;
+    for (size_t i = 0; i + 1 < topic.length; i++) {
+        level_count += String_get(topic, i) == '/';
+    }
+    list_append(&stats->topics, ((Topic_Stats){ .topic = string_clone(topic), .level_count = level_count }));
+    hash_index_insert(&stats->topics_index, hash, stats->topics.count - 1);
+    return &list_get_last(stats->topics);
+}
+
+// Publishers are served by -reactors threads. Each one listens on every publisher port with a socket of its own,
+// bound with SO_REUSEPORT so the kernel spreads the connections between them, and serves its connections from
+// its own loop. The messages a reactor parses in one round of its loop are appended to the log together, taking
+// the lock once for all of them.
+//
+// The loop waits with epoll and reads every connection that's ready with a read() of its own, or with -io uring
+// it keeps a multishot accept on every listening socket and a multishot receive on every connection, so a round
+// takes a single io_uring_enter() however many connections have data. Reactors fall back to epoll when the
+// kernel has no io_uring or is too old for it.
+
+#define REACTOR_EPOLL_EVENTS  256
+#define REACTOR_URING_ENTRIES 256
+#define REACTOR_URING_BUFFERS 256 // Of PUBLISHER_URING_BUFFER_SIZE bytes, shared by the reactor's connections.
+#define PUBLISHER_URING_BUFFER_SIZE (16 * 1024)
+
+// A listening socket or a publisher connection of a reactor.
+typedef struct {
+    int fd;
+    int port;
+    bool listening;
+    Receive_Buffer buffer; // Only complete lines are parsed, the rest waits here for the next read.
+} Publisher_Client;
+
+typedef struct {
+    Publisher_Client** data;
+    size_t count, capacity;
+} Publisher_Client_list;
+
+typedef struct {
+    int index;
+    int epoll_fd;
+    bool uring_ready;
+    Uring ring;
+    Publisher_Client** listeners;
+    int listener_count;
+    Publisher_Client_list uring_clients; // The connections io_uring accepted, in case it falls back to epoll.
+    // What the current round parsed, not appended yet. Until a message is appended its `appended_ns` is when it
+    // was parsed.
+    Publisher_Message_list batch;
+    uint64_t batch_bytes;
+    uint64_t rejected;
+} Reactor;
+
+// `received_ns` is when the read that got the line returned.
+void handle_publisher_line(Reactor* reactor, String line, uint64_t const received_ns)
+{
+    if (String_get_last(line) == '\r') { line.length -= 1; }
+    if (line.length == 0) return;
+
+    // The line is parsed where it was received, the copy into the log is its only allocation.
+    Publisher_Message_View view;
+    bool const parsed = parse_publisher_message_view(line, &view);
+    if (parsed && view.topic.data[0] == '$') {
+        log_error("ERROR: Topics that start with '$' are reserved for the broker: \"%.*s\"", fmt_String(view.topic));
+    } else if (parsed) {
+        Publisher_Message message = publisher_message_from_view(&view);
+        message.received_ns = received_ns;
+        message.appended_ns = time_now_ns();
+        latency_record_since(TRACE_PARSE, received_ns, message.appended_ns);
+        if (message.published_ns != 0) {
+            latency_record_since(TRACE_PUBLISH, message.published_ns, time_unix_ns() - (message.appended_ns - received_ns));
+        }
+        log_debug("Recieved message: " PRI_Publisher_Message, fmt_Publisher_Message(message));
+        list_append(&reactor->batch, message);
+        reactor->batch_bytes += line.length;
+        return;
+    }
+    reactor->rejected++;
+}
+
+void reactor_append_batch(Reactor* reactor)
+{
+    if (reactor->batch.count == 0 && reactor->rejected == 0) return;
+
+    lock_messages();
+    uint64_t const appended_ns = time_now_ns();
+    for (size_t i = 0; i < reactor->batch.count; i++) {
+        Publisher_Message* message = &list_get(reactor->batch, i);
+        latency_record_since(TRACE_APPEND, message->appended_ns, appended_ns);
+        message->appended_ns = appended_ns;
+        message_log_append(&ctx.log, *message);
+        topic_stats(message->topic.original)->messages_in++;
+        rollup_tiers_add_message(&ctx.rollups, message);
+    }
+    if (reactor->batch.count > 0) {
+        pthread_cond_broadcast(&ctx.message_arrived);
+    }
+    ctx.stats.messages_in += reactor->batch.count;
+    ctx.stats.bytes_in += reactor->batch_bytes;
+    ctx.stats.rejected += reactor->rejected;
+    pthread_mutex_unlock(&ctx.messages_mutex);
+
+    reactor->batch.count = 0;
+    reactor->batch_bytes = 0;
+    reactor->rejected = 0;
+}
+
+void reactor_close_client(Reactor* reactor, Publisher_Client* client)
+{
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    receive_buffer_destroy(&client->buffer);
+    free(client);
+}
+
+void reactor_accept(Reactor* reactor, Publisher_Client const* listener)
+{
+    for (;;) {
+        int client_fd = accept(listener->fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("ERROR: Accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+        Publisher_Client* client = (Publisher_Client*)malloc(sizeof(*client));
+        assert(client != NULL);
+        *client = (Publisher_Client){
+            .fd = client_fd,
+            .port = listener->port,
+            .buffer = receive_buffer_create(PUBLISHER_BUFFER_SIZE),
+        };
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            log_error("ERROR: Could not watch publisher connection: %s", strerror(errno));
+            close(client_fd);
+            receive_buffer_destroy(&client->buffer);
+            free(client);
+            continue;
+        }
+        log_info("Publisher connected to port %d.", listener->port);
+    }
+}
+
+void reactor_read(Reactor* reactor, Publisher_Client* client)
+{
+    ssize_t const bytes_read = receive_buffer_read(&client->buffer, client->fd);
+    if (bytes_read > 0) {
+        uint64_t const received_ns = time_now_ns();
+        String line;
+        while (receive_buffer_next_line(&client->buffer, &line)) {
+            handle_publisher_line(reactor, line, received_ns);
+        }
+        return;
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (bytes_read == 0) {
+        log_info("Publisher at port %d disconnected normally.", client->port);
+    } else {
+        log_error("ERROR: Reading publisher messages failed: %s", strerror(errno));
+    }
+    reactor_close_client(reactor, client);
+}
+
+void reactor_run_epoll(Reactor* reactor)
+{
+    struct epoll_event events[REACTOR_EPOLL_EVENTS];
+    for (;;) {
+        int const count = epoll_wait(reactor->epoll_fd, events, REACTOR_EPOLL_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            log_error("ERROR: Reactor %d stopped waiting: %s", reactor->index, strerror(errno));
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            Publisher_Client* client = (Publisher_Client*)events[i].data.ptr;
+            if (client->listening) {
+                reactor_accept(reactor, client);
+            } else {
+                reactor_read(reactor, client);
+            }
+        }
+        reactor_append_batch(reactor);
+    }
+}
+
+// Parses the bytes a receive completion got, they go through the buffer of the connection because lines can
+// straddle receives.
+void reactor_received(Reactor* reactor, Publisher_Client* client, char const* data, size_t length, uint64_t const received_ns)
+{
+    Receive_Buffer* buffer = &client->buffer;
+    while (length > 0) {
+        receive_buffer_make_room(buffer);
+        size_t const copied = Min(length, buffer->capacity - buffer->end);
+        memcpy(buffer->data + buffer->end, data, copied);
+        buffer->end += copied;
+        data += copied;
+        length -= copied;
+
+        String line;
+        while (receive_buffer_next_line(buffer, &line)) {
+            handle_publisher_line(reactor, line, received_ns);
+        }
+    }
+}
+
+void reactor_close_uring_client(Reactor* reactor, Publisher_Client* client)
+{
+    for (size_t i = 0; i < reactor->uring_clients.count; i++) {
+        if (list_get(reactor->uring_clients, i) == client) {
+            list_get(reactor->uring_clients, i) = list_get_last(reactor->uring_clients);
+            reactor->uring_clients.count--;
+            break;
+        }
+    }
+    close(client->fd);
+    receive_buffer_destroy(&client->buffer);
+    free(client);
+}
+
+// Watches the connections that io_uring accepted with epoll instead.
+void reactor_hand_over_to_epoll(Reactor* reactor)
+{
+    for (size_t i = 0; i < reactor->uring_clients.count; i++) {
+        Publisher_Client* client = list_get(reactor->uring_clients, i);
+        fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) < 0) {
+            log_error("ERROR: Could not watch publisher connection: %s", strerror(errno));
+            close(client->fd);
+            receive_buffer_destroy(&client->buffer);
+            free(client);
+        }
+    }
+    list_destroy(&reactor->uring_clients);
+}
+
+// Returns when io_uring stops working for the reactor, once the connections it accepted are watched by epoll.
+void reactor_run_uring(Reactor* reactor)
+{
+    Uring* ring = &reactor->ring;
+    for (int i = 0; i < reactor->listener_count; i++) {
+        uring_prepare_multishot_accept(ring, reactor->listeners[i]->fd, (uint64_t)(uintptr_t)reactor->listeners[i]);
+    }
+
+    for (;;) {
+        // The completions that are there still get handled when it fails. Running out of room for them is
+        // temporary, handling them makes some.
+        bool failed = uring_submit_and_wait(ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY;
+        if (failed) {
+            log_error("ERROR: Reactor %d stopped waiting on io_uring, it uses epoll: %s", reactor->index, strerror(errno));
+        }
+
+        uint64_t const received_ns = time_now_ns();
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_next_completion(ring)) != NULL) {
+            Publisher_Client* client = (Publisher_Client*)(uintptr_t)cqe->user_data;
+            int const result = cqe->res;
+            bool const more = cqe->flags & IORING_CQE_F_MORE;
+
+            if (client->listening) {
+                if (result >= 0) {
+                    Publisher_Client* accepted_client = (Publisher_Client*)malloc(sizeof(*accepted_client));
+                    assert(accepted_client != NULL);
+                    *accepted_client = (Publisher_Client){
+                        .fd = result,
+                        .port = client->port,
+                        .buffer = receive_buffer_create(PUBLISHER_BUFFER_SIZE),
+                    };
+                    list_append(&reactor->uring_clients, accepted_client);
+                    uring_prepare_multishot_recv(ring, result, (uint64_t)(uintptr_t)accepted_client);
+                    log_info("Publisher connected to port %d.", client->port);
+                } else if (result == -EINVAL) {
+                    if (!failed) {
+                        log_warning("WARNING: The kernel turned down multishot accepts, reactor %d uses epoll", reactor->index);
+                    }
+                    failed = true;
+                } else {
+                    log_error("ERROR: Accept failed: %s", strerror(-result));
+                }
+                if (!more) {
+                    uring_prepare_multishot_accept(ring, client->fd, (uint64_t)(uintptr_t)client);
+                }
+            } else if (result > 0) {
+                reactor_received(reactor, client, uring_completion_buffer(ring, cqe), result, received_ns);
+                uring_recycle_buffer(ring, cqe);
+                if (!more) {
+                    uring_prepare_multishot_recv(ring, client->fd, (uint64_t)(uintptr_t)client);
+                }
+            } else if (result == -ENOBUFS) {
+                // Every provided buffer is taken, they are back by the time this is submitted.
+                uring_prepare_multishot_recv(ring, client->fd, (uint64_t)(uintptr_t)client);
+            } else {
+                if (result == 0) {
+                    log_info("Publisher at port %d disconnected normally.", client->port);
+                } else {
+                    log_error("ERROR: Reading publisher messages failed: %s", strerror(-result));
+                }
+                reactor_close_uring_client(reactor, client);
+            }
+            uring_completion_seen(ring);
+        }
+        reactor_append_batch(reactor);
+
+        if (failed) {
+            reactor_hand_over_to_epoll(reactor);
+            return;
+        }
+    }
+}
+
+void* reactor_thread(void* arg)
+{
+    Reactor* reactor = (Reactor*)arg;
+    if (reactor->uring_ready) {
+        reactor_run_uring(reactor);
+        uring_destroy(&reactor->ring);
+    }
+    reactor_run_epoll(reactor);
+    latency_retire_thread();
+    log_retire_thread();
+    return NULL;
+}
+
+int listen_on_port(int const port)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd < 0) {
-        perror("ERROR: socket failed");
-        pthread_exit((void*)1);
+        log_error("ERROR: Socket failed: %s", strerror(errno));
+        return -1;
     }
 
-    // Setup server address
     struct sockaddr_in server_addr = {
         .sin_family = AF_INET,
         .sin_addr.s_addr = INADDR_ANY,
-        .sin_port = htons(publisher_port),
+        .sin_port = htons(port),
     };
 
-    // Bind socket
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("ERROR: bind failed");
-        pthread_exit((void*)1);
+    // A restarted broker can bind while the connections of the previous one are in TIME_WAIT, and every reactor
+    // binds the same port.
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    // Listen for connections, load generators open thousands at once.
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 || listen(server_fd, SOMAXCONN) < 0) {
+        log_error("ERROR: Could not listen on port %d: %s", port, strerror(errno));
+        close(server_fd);
+        return -1;
     }
+    return server_fd;
+}
 
-    // Listen for connections
-    if (listen(server_fd, 5) < 0) {
-        perror("ERROR: listen failed");
-        pthread_exit((void*)1);
+// Starts a reactor that listens on every one of `ports`.
+bool start_reactor(int const index, int const* ports, int const port_count, bool const io_uring, pthread_t* thread)
+{
+    Reactor* reactor = (Reactor*)calloc(1, sizeof(*reactor));
+    assert(reactor != NULL);
+    reactor->index = index;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        log_error("ERROR: Could not create the epoll of reactor %d: %s", index, strerror(errno));
+        return false;
+    }
+    if (io_uring) {
+        reactor->uring_ready = uring_init(&reactor->ring, REACTOR_URING_ENTRIES, REACTOR_URING_BUFFERS, PUBLISHER_URING_BUFFER_SIZE);
+        if (!reactor->uring_ready && index == 0) {
+            log_warning("WARNING: Could not set up io_uring, the reactors use epoll: %s", strerror(errno));
+        }
+    }
+    reactor->listeners = (Publisher_Client**)calloc(port_count, sizeof(*reactor->listeners));
+    assert(reactor->listeners != NULL);
+    reactor->listener_count = port_count;
+
+    for (int i = 0; i < port_count; i++) {
+        Publisher_Client* listener = (Publisher_Client*)calloc(1, sizeof(*listener));
+        assert(listener != NULL);
+        *listener = (Publisher_Client){ .fd = listen_on_port(ports[i]), .port = ports[i], .listening = true };
+        if (listener->fd < 0) return false;
+        reactor->listeners[i] = listener;
+        // Also with io_uring, in case the reactor falls back to epoll.
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = listener };
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listener->fd, &event);
+        if (index == 0) {
+            log_info("Listening publisher on port %d...", ports[i]);
+        }
+    }
+
+    if (pthread_create(thread, NULL, reactor_thread, reactor) != 0) {
+        log_error("ERROR: Failed to create reactor thread %d", index);
+        return false;
+    }
+    return true;
+}
+
+#define SUBSCRIPTION_READ_BATCH 256
+
+// Subscriptions are identified by the subscriber name and the topic, and by the address where the subscriber
+// listens when it didn't give a name.
+String subscription_key(Subscriber_Message const* sub)
+{
+    String_Builder key = {};
+    if (!is_string_null(sub->name)) {
+        string_builder_appendf(&key, PRI_String, fmt_String(sub->name));
+    } else {
+        string_builder_appendf(&key, PRI_String ":" PRI_String, fmt_String(sub->output_hostname), fmt_String(sub->output_port));
+    }
+    string_builder_appendf(&key, "|" PRI_Topic, fmt_Topic(sub->topic));
+    return String_from_builder(key);
+}
+
+Subscription* find_subscription(String const key)
+{
+    for (size_t i = 0; i < ctx.subscriptions.count; i++) {
+        if (string_equals(list_get(ctx.subscriptions, i)->key, key)) {
+            return list_get(ctx.subscriptions, i);
+        }
+    }
+    return NULL;
+}
+
+void remove_subscription(Subscription const* subscription)
+{
+    for (size_t i = 0; i < ctx.subscriptions.count; i++) {
+        if (list_get(ctx.subscriptions, i) == subscription) {
+            list_set(ctx.subscriptions, i, list_get_last(ctx.subscriptions));
+            ctx.subscriptions.count--;
+            return;
+        }
+    }
+}
+
+// The functions of the registry must be called with messages_mutex held, except for registry_write() and
+// registry_thread().
+
+// Writes the live subscriptions to `out`, as the file would have them after a rewrite.
+void registry_snapshot(String_Builder* out)
+{
+    for (size_t i = 0; i < ctx.subscriptions.count; i++) {
+        Subscription* subscription = list_get(ctx.subscriptions, i);
+        string_builder_appendf(out, "sub " PRI_String "\n", fmt_String(subscription->registration_text));
+        string_builder_appendf(out, "off %llu " PRI_String "\n",
+                (unsigned long long)subscription->offset, fmt_String(subscription->key));
+        subscription->saved_offset = subscription->offset;
+    }
+}
+
+// Replaces the file with `contents`. The new file is synced before the rename, so a crash leaves either the
+// old or the new one.
+bool registry_write(Registry* registry, String const contents)
+{
+    String_Builder temporary_path = {};
+    string_builder_appendf(&temporary_path, "%s.tmp", registry->path);
+    list_append(&temporary_path, '\0');
+
+    FILE* file = fopen(temporary_path.data, "w");
+    if (file == NULL) {
+        log_error("ERROR: Could not write the subscription registry %s: %s", temporary_path.data, strerror(errno));
+        goto had_error;
     }
+    bool const written = fwrite(contents.data, 1, contents.length, file) == contents.length
+            && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written || rename(temporary_path.data, registry->path) != 0) {
+        log_error("ERROR: Could not replace the subscription registry %s: %s", registry->path, strerror(errno));
+        goto had_error;
+    }
+
+    if (registry->file != NULL) {
+        fclose(registry->file);
+    }
+    registry->file = fopen(registry->path, "a");
+    list_destroy(&temporary_path);
+    return registry->file != NULL;
 
-    printf("Listening publisher on port %d...\n", publisher_port);
+had_error:
+    list_destroy(&temporary_path);
+    return false;
+}
 
+void* registry_thread(void* arg)
+{
+    Registry* registry = (Registry*)arg;
+    String_Builder pending = {};
+    String_Builder rewrite = {};
     while (true) {
-        // Accept incoming connection
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            perror("ERROR: accept failed");
-            continue;
+        pthread_mutex_lock(&registry->mutex);
+        while (registry->pending.count == 0 && !registry->has_rewrite) {
+            pthread_cond_wait(&registry->queued, &registry->mutex);
         }
+        String_Builder const queued = registry->pending;
+        registry->pending = pending;
+        pending = queued;
+        if (registry->has_rewrite) {
+            String_Builder const contents = registry->rewrite;
+            registry->rewrite = rewrite;
+            rewrite = contents;
+        }
+        bool const has_rewrite = registry->has_rewrite;
+        registry->has_rewrite = false;
+        pthread_mutex_unlock(&registry->mutex);
 
-        printf("\nPublisher connected to port %d.\n", publisher_port);
+        if (has_rewrite) {
+            registry_write(registry, (String){ .data = rewrite.data, .length = rewrite.count });
+            rewrite.count = 0;
+        }
+        if (registry->file == NULL) {
+            registry->file = fopen(registry->path, "a");
+        }
+        if (registry->file != NULL && pending.count > 0) {
+            fwrite(pending.data, 1, pending.count, registry->file);
+            fflush(registry->file);
+        }
+        pending.count = 0;
+    }
+    return NULL;
+}
 
-        // Read data
-        char buffer[BUFFER_SIZE] = {0};
-        ssize_t bytes_read, total_read = 0;
-        while ((bytes_read = read(client_fd, buffer, BUFFER_SIZE)) > 0) {
-            String text = (String){
-                .data = buffer + total_read,
-                .length = strlen(buffer + total_read),
-            };
-            String_list parts = string_split(text, '\n');
-            for (size_t i = 0; i < parts.count; i++) {
-                String part = list_get(parts, i);
-                if (part.length == 0) continue; 
-                if (String_get_last(part) == '\n') { part.length -= 1; }
-                if (part.length == 0) continue; 
-
-                Publisher_Message message = parse_publisher_message(part);
-                if (is_publisher_message_valid(message)) {
-                    pthread_mutex_lock(&ctx.messages_mutex);
-                    list_append(&ctx.messages, message);
-                    pthread_cond_broadcast(&ctx.message_arrived);
-                    pthread_mutex_unlock(&ctx.messages_mutex);
-
-                    printfln("Recieved message: " PRI_Publisher_Message, fmt_Publisher_Message(message));
+// Queues a rewrite with only the live subscriptions, which makes the lines still queued unnecessary.
+void registry_compact(void)
+{
+    Registry* registry = &ctx.registry;
+    String_Builder contents = {};
+    registry_snapshot(&contents);
+
+    pthread_mutex_lock(&registry->mutex);
+    list_destroy(&registry->rewrite);
+    registry->rewrite = contents;
+    registry->has_rewrite = true;
+    registry->pending.count = 0;
+    pthread_cond_signal(&registry->queued);
+    pthread_mutex_unlock(&registry->mutex);
+    registry->records = 0;
+}
+
+void registry_append(const char* fmt, ...)
+{
+    Registry* registry = &ctx.registry;
+    if (registry->path == NULL) return;
+
+    va_list args;
+    va_start(args, fmt);
+    int const length = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    pthread_mutex_lock(&registry->mutex);
+    string_builder_grow_if_needed(&registry->pending, length + 1);
+    va_start(args, fmt);
+    vsnprintf(registry->pending.data + registry->pending.count, length + 1, fmt, args);
+    va_end(args);
+    registry->pending.count += length;
+    pthread_cond_signal(&registry->queued);
+    pthread_mutex_unlock(&registry->mutex);
+
+    registry->records++;
+    if (registry->records > Max(REGISTRY_MIN_RECORDS, 4 * ctx.subscriptions.count)) {
+        registry_compact();
+    }
+}
+
+void registry_save_subscription(Subscription const* subscription)
+{
+    registry_append("sub " PRI_String "\n", fmt_String(subscription->registration_text));
+}
+
+// Offsets change with every batch, so they are saved at most every REGISTRY_OFFSET_INTERVAL_MS. A broker that
+// crashes sends again what was delivered since.
+void registry_save_offset(Subscription* subscription, bool const force)
+{
+    if (ctx.registry.path == NULL || subscription->offset == subscription->saved_offset) return;
+    uint64_t const now = time_now_ms();
+    if (!force && now - subscription->saved_at_ms < REGISTRY_OFFSET_INTERVAL_MS) return;
+
+    subscription->saved_offset = subscription->offset;
+    subscription->saved_at_ms = now;
+    registry_append("off %llu " PRI_String "\n", (unsigned long long)subscription->offset, fmt_String(subscription->key));
+}
+
+void registry_remove(Subscription const* subscription)
+{
+    registry_append("del " PRI_String "\n", fmt_String(subscription->key));
+}
+
+void subscription_destroy(Subscription* subscription)
+{
+    string_destroy(&subscription->key);
+    string_destroy(&subscription->registration_text);
+    subscriber_message_destroy(&subscription->sub);
+    if (subscription->registration != NULL) {
+        subscriber_message_destroy(subscription->registration);
+        free(subscription->registration);
+    }
+    free(subscription);
+}
+
+// Waits until there's something to deliver or a new registration.
+void subscription_wait_for_messages(Subscription* subscription)
+{
+    while (subscription->offset >= ctx.log.next_offset && subscription->registration == NULL) {
+        pthread_cond_wait(&ctx.message_arrived, &ctx.messages_mutex);
+    }
+    if (subscription->registration != NULL) {
+        subscriber_message_destroy(&subscription->sub);
+        subscription->sub = *subscription->registration;
+        free(subscription->registration);
+        subscription->registration = NULL;
+        log_info("Subscriber " PRI_Subscriber_Message " resumes from offset %llu",
+                fmt_Subscriber_Message(subscription->sub), (unsigned long long)subscription->offset);
+    }
+
+    if (!subscription->sub.persistent && subscription->offset + 1 < ctx.log.next_offset) {
+        subscription->offset = ctx.log.next_offset - 1;
+    }
+    if (subscription->offset < ctx.log.base_offset) {
+        log_warning("WARNING: Subscriber " PRI_Subscriber_Message " missed %llu messages that expired",
+                fmt_Subscriber_Message(subscription->sub), (unsigned long long)(ctx.log.base_offset - subscription->offset));
+        subscription->offset = ctx.log.base_offset;
+    }
+}
+
+// Streams the log to the subscriber in batches, holding the lock only to copy each batch.
+void* subscription_thread(void* arg)
+{
+    Subscription* subscription = (Subscription*)arg;
+    Publisher_Message* batch = (Publisher_Message*)malloc(SUBSCRIPTION_READ_BATCH * sizeof(*batch));
+    assert(batch != NULL);
+    uint64_t backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+
+    pthread_mutex_lock(&ctx.messages_mutex);
+    log_info("Added Subscriber: " PRI_Subscriber_Message " from offset %llu",
+            fmt_Subscriber_Message(subscription->sub), (unsigned long long)subscription->offset);
+    for (;;) {
+        subscription_wait_for_messages(subscription);
+
+        uint64_t next_offset;
+        size_t const count = message_log_read(&ctx.log, subscription->offset, batch, SUBSCRIPTION_READ_BATCH, &next_offset);
+        pthread_mutex_unlock(&ctx.messages_mutex);
+
+        // Only the matching messages stay in the batch.
+        uint64_t const read_ns = time_now_ns();
+        size_t accepted = 0;
+        for (size_t i = 0; i < count; i++) {
+            latency_record_since(TRACE_QUEUE, batch[i].appended_ns, read_ns);
+            if (subscriber_accepts(&subscription->sub, &batch[i])) {
+                batch[accepted++] = batch[i];
+            }
+        }
+        uint64_t const matched_ns = time_now_ns();
+
+        bool const delivered = subscriber_forward_messages(&ctx.subscriber_connections, subscription->sub, batch, accepted);
+        log_debug("Subscriber " PRI_Subscriber_Message " accepted %zu of %zu messages",
+                fmt_Subscriber_Message(subscription->sub), accepted, count);
+        if (delivered) {
+            uint64_t const sent_ns = time_now_ns();
+            uint64_t const sent_unix_ns = time_unix_ns();
+            for (size_t i = 0; i < accepted; i++) {
+                latency_record_since(TRACE_MATCH, read_ns, matched_ns);
+                latency_record_since(TRACE_SEND, matched_ns, sent_ns);
+                latency_record_since(TRACE_BROKER, batch[i].received_ns, sent_ns);
+                if (batch[i].published_ns != 0) {
+                    latency_record_since(TRACE_END_TO_END, batch[i].published_ns, sent_unix_ns);
                 }
             }
-            list_destroy(&parts);
-            total_read += bytes_read;
         }
 
-        if (bytes_read == 0) {
-            printf("Publisher at port %d disconnected normally.\n", publisher_port);
-        } else if (bytes_read < 0) {
-            perror("ERROR: Reading publisher messages failed");
+        lock_messages();
+        if (delivered) {
+            for (size_t i = 0; i < accepted; i++) {
+                // The broker's own messages don't count.
+                if (batch[i].topic.original.data[0] == '$') continue;
+                ctx.stats.messages_out++;
+                ctx.stats.bytes_out += batch[i].topic.original.length + batch[i].value.length;
+                topic_stats(batch[i].topic.original)->messages_out++;
+            }
+            subscription->offset = next_offset;
+            registry_save_offset(subscription, false);
+            backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+            continue;
         }
 
-        close(client_fd);
+        if (!subscription->sub.persistent && subscription->registration == NULL) {
+            // The session is over.
+            break;
+        }
+
+        // Keeps the messages until the subscriber is back, or registers again from somewhere else.
+        registry_save_offset(subscription, true);
+        struct timespec const deadline = timespec_after_ms(backoff_ms);
+        while (subscription->registration == NULL &&
+               pthread_cond_timedwait(&ctx.message_arrived, &ctx.messages_mutex, &deadline) != ETIMEDOUT) {}
+        backoff_ms = Min(backoff_ms * 2, RECONNECT_BACKOFF_MAX_MS);
     }
 
-    close(server_fd);
+    log_info("Removed Subscriber: " PRI_Subscriber_Message, fmt_Subscriber_Message(subscription->sub));
+    remove_subscription(subscription);
+    registry_remove(subscription);
+    pthread_mutex_unlock(&ctx.messages_mutex);
+
+    subscription_destroy(subscription);
+    free(batch);
+    latency_retire_thread();
+    log_retire_thread();
     return NULL;
 }
 
-void* subscriber_connection(void* arg)
+// Must be called with messages_mutex held.
+bool start_subscription_thread(Subscription* subscription)
 {
-    Subscriber_Message *sub_ptr = (Subscriber_Message*)arg;
-    Subscriber_Message const sub = *sub_ptr;
-    free(sub_ptr);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, subscription_thread, (void*)subscription) != 0) {
+        log_error("ERROR: Failed to create subscriber thread");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
 
-    printfln("Added Subscriber: " PRI_Subscriber_Message, fmt_Subscriber_Message(sub));
+// Registering again is idempotent: the registration goes to the thread of the existing subscription, which
+// delivers to the new endpoint from where it was. Takes ownership of `sub`.
+void register_subscription(Subscriber_Message* sub, String const registration_text)
+{
+    String key = subscription_key(sub);
 
-    // Forwarding messages already on the list
-    if (sub.persistent) {
-        Publisher_Message_list snapshot = get_messages_snapshot(ctx.messages, &ctx.messages_mutex);
-        if (snapshot.count > 0) {
-            for (size_t i = 0; i < snapshot.count; i++) {
-                Publisher_Message message = list_get(snapshot, i);
-                subscriber_forward_message(sub, message);
-            }
-            list_destroy(&snapshot);
+    pthread_mutex_lock(&ctx.messages_mutex);
+    Subscription* subscription = find_subscription(key);
+    if (subscription != NULL) {
+        if (subscription->registration != NULL) {
+            subscriber_message_destroy(subscription->registration);
+            free(subscription->registration);
+        }
+        subscription->registration = sub;
+        if (!string_equals(subscription->registration_text, registration_text)) {
+            string_destroy(&subscription->registration_text);
+            subscription->registration_text = string_clone(registration_text);
+            registry_save_subscription(subscription);
+        }
+        pthread_cond_broadcast(&ctx.message_arrived);
+        string_destroy(&key);
+    } else {
+        subscription = (Subscription*)malloc(sizeof(*subscription));
+        assert(subscription != NULL);
+        *subscription = (Subscription){
+            .key = key,
+            .registration_text = string_clone(registration_text),
+            .sub = *sub,
+            // Persistent subscriptions catch up with everything still in the log.
+            .offset = sub->persistent ? ctx.log.base_offset : ctx.log.next_offset,
+        };
+        free(sub);
+        if (start_subscription_thread(subscription)) {
+            list_append(&ctx.subscriptions, subscription);
+            registry_save_subscription(subscription);
+            registry_save_offset(subscription, true);
+        } else {
+            subscription_destroy(subscription);
         }
     }
+    pthread_mutex_unlock(&ctx.messages_mutex);
+}
 
-    while (true) {
-        pthread_mutex_lock(&ctx.messages_mutex);
-        size_t last_count = ctx.messages.count;
-        for (;;) {
-            printfln("Subscriber " PRI_Subscriber_Message " waiting on new messages...", fmt_Subscriber_Message(sub));
-            pthread_cond_wait(&ctx.message_arrived, &ctx.messages_mutex);
-            if (last_count != ctx.messages.count) {
-                printfln("Subscriber " PRI_Subscriber_Message " is about to inspect some messages...", fmt_Subscriber_Message(sub));
-                break;
+// Loads the subscriptions saved by a previous run and starts delivering to them. The messages of that run are
+// gone, so the log continues from the newest saved offset and subscriptions that were behind it skip the rest.
+bool registry_load(const char* path)
+{
+    ctx.registry.path = path;
+    String text = {};
+    if (access(path, F_OK) == 0 && !fs_read_entire_file(path, &text)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&ctx.messages_mutex);
+    String_list lines = string_split(text, '\n');
+    uint64_t newest_offset = 0;
+    for (size_t i = 0; i < lines.count; i++) {
+        // The last line keeps its newline.
+        String const line = string_trim(list_get(lines, i));
+        if (line.length < 4) continue;
+        String const rest = { .data = line.data + 4, .length = line.length - 4 };
+
+        if (string_equals((String){ .data = line.data, .length = 4 }, str8("sub "))) {
+            Subscriber_Message* sub = parse_subscriber_message(rest);
+            if (sub == NULL) continue;
+            String key = subscription_key(sub);
+            Subscription* subscription = find_subscription(key);
+            if (subscription == NULL) {
+                subscription = (Subscription*)malloc(sizeof(*subscription));
+                assert(subscription != NULL);
+                *subscription = (Subscription){ .key = key, .registration_text = string_clone(rest), .sub = *sub };
+                list_append(&ctx.subscriptions, subscription);
+            } else {
+                subscriber_message_destroy(&subscription->sub);
+                subscription->sub = *sub;
+                string_destroy(&subscription->registration_text);
+                subscription->registration_text = string_clone(rest);
+                string_destroy(&key);
             }
+            free(sub);
+        } else if (string_equals((String){ .data = line.data, .length = 4 }, str8("off "))) {
+            ssize_t const space = string_find_char(rest, ' ');
+            if (space < 0) continue;
+            Subscription* subscription = find_subscription((String){ .data = rest.data + space + 1, .length = rest.length - space - 1 });
+            if (subscription == NULL) continue;
+            subscription->offset = strtoull(rest.data, NULL, 10);
+            newest_offset = Max(newest_offset, subscription->offset);
+        } else if (string_equals((String){ .data = line.data, .length = 4 }, str8("del "))) {
+            Subscription* subscription = find_subscription(rest);
+            if (subscription == NULL) continue;
+            remove_subscription(subscription);
+            subscription_destroy(subscription);
+        } else {
+            log_error("ERROR: Unknown line in the subscription registry %s: \"" PRI_String "\"", path, fmt_String(line));
         }
-        size_t new_count = ctx.messages.count;
+    }
+    list_destroy_safely(&lines);
+    if (!is_string_null(text)) {
+        string_destroy(&text);
+    }
+
+    ctx.log.first_segment_offset = ctx.log.base_offset = ctx.log.next_offset = newest_offset;
 
-        if (sub.persistent) {
-            size_t count = new_count - last_count;
-            Publisher_Message* slice = (Publisher_Message*)malloc(count * sizeof(*slice));
-            assert(slice != NULL);
-            for (size_t i = 0; i < count; i++) {
-                slice[i] = list_get(ctx.messages, last_count + i);
+    String_Builder contents = {};
+    registry_snapshot(&contents);
+    bool ok = registry_write(&ctx.registry, (String){ .data = contents.data, .length = contents.count });
+    list_destroy(&contents);
+    pthread_t thread;
+    if (ok && pthread_create(&thread, NULL, registry_thread, &ctx.registry) != 0) {
+        log_error("ERROR: Could not start the subscription registry thread");
+        ok = false;
+    }
+    if (ok) {
+        pthread_detach(thread);
+    }
+    for (size_t i = 0; i < ctx.subscriptions.count;) {
+        Subscription* subscription = list_get(ctx.subscriptions, i);
+        subscription->saved_offset = subscription->offset;
+        if (start_subscription_thread(subscription)) {
+            i++;
+        } else {
+            remove_subscription(subscription);
+            subscription_destroy(subscription);
+        }
+    }
+    log_info("Loaded %zu subscriptions from %s, messages start at offset %llu",
+            ctx.subscriptions.count, path, (unsigned long long)newest_offset);
+    pthread_mutex_unlock(&ctx.messages_mutex);
+    return ok;
+}
+
+// Range queries (see Range Queries) are run by the query workers. The first worker to get a query pins the log
+// that answers it and takes the segments that have messages in the range, then every worker takes a segment to
+// scan. Whichever worker scanned the oldest segment not sent yet sends it, along with the segments after it that
+// are scanned already, so the answer streams out while the rest is scanned. The log stays pinned until the
+// answer was sent, since the messages share their strings with it, which is why sends time out.
+
+#define QUERY_ANSWER_BATCH_SIZE     (64 * 1024)
+#define QUERY_SEND_TIMEOUT_SECONDS  10
+
+typedef struct {
+    Range_Query query;
+    int fd;
+    uint64_t start_ns;
+    bool started;                    // A worker took the log and the ranges.
+    Message_Log* log;                // Pinned, NULL when no log answers the query.
+    Segment_Range_list ranges;
+    Publisher_Message_list* results; // One for each range.
+    bool* scanned;
+    size_t next_range;               // The next one a worker takes.
+    size_t scanning;                 // Those taken but not scanned yet.
+    size_t next_to_send;
+    bool sending;
+    bool stopped;                    // The limit was reached or the client is gone, nothing else gets scanned.
+    size_t sent;                     // Messages.
+} Query;
+
+typedef struct {
+    Query** data;
+    size_t count, capacity;
+} Query_list;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t query_added;
+    Query_list queries; // Those that weren't started or have ranges that no worker took yet.
+} query_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .query_added = PTHREAD_COND_INITIALIZER,
+};
+
+// Must be called with the query pool mutex held.
+void query_pool_remove(Query const* query)
+{
+    for (size_t i = 0; i < query_pool.queries.count; i++) {
+        if (list_get(query_pool.queries, i) == query) {
+            memmove(&query_pool.queries.data[i], &query_pool.queries.data[i + 1], (query_pool.queries.count - i - 1) * sizeof(*query_pool.queries.data));
+            query_pool.queries.count--;
+            return;
+        }
+    }
+}
+
+// Pins the log of the query and takes its ranges.
+void query_start(Query* query)
+{
+    lock_messages();
+    query->log = range_query_log(&query->query, &ctx.log, &ctx.rollups);
+    if (query->log != NULL) {
+        message_log_pin(query->log);
+        message_log_ranges(query->log, query->query.from, query->query.to, &query->ranges);
+    }
+    pthread_mutex_unlock(&ctx.messages_mutex);
+    if (query->log == NULL) {
+        log_warning("WARNING: No rollup tier has an interval of %u seconds", query->query.resolution);
+    }
+
+    query->results = (Publisher_Message_list*)calloc(Max(query->ranges.count, 1), sizeof(*query->results));
+    query->scanned = (bool*)calloc(Max(query->ranges.count, 1), sizeof(*query->scanned));
+    assert(query->results != NULL && query->scanned != NULL);
+}
+
+// Sends the ranges from `first` up to `end`, stopping at the limit. Returns false when the client is gone.
+bool query_send(Query* query, size_t const first, size_t const end)
+{
+    String_Builder lines = {};
+    bool ok = true;
+    for (size_t i = first; ok && i < end; i++) {
+        Publisher_Message_list* results = &query->results[i];
+        for (size_t j = 0; ok && j < results->count && (query->query.limit == 0 || query->sent < query->query.limit); j++) {
+            range_query_append_line(&lines, &list_get(*results, j));
+            query->sent++;
+            if (lines.count >= QUERY_ANSWER_BATCH_SIZE) {
+                ok = send_all(query->fd, String_from_builder(lines));
+                lines.count = 0;
             }
-            pthread_mutex_unlock(&ctx.messages_mutex);
+        }
+        list_destroy(results);
+    }
+    if (ok && lines.count > 0) {
+        ok = send_all(query->fd, String_from_builder(lines));
+    }
+    if (!ok) {
+        log_error("ERROR: Sending the answer to a query failed: %s", strerror(errno));
+    }
+    list_destroy(&lines);
+    return ok;
+}
 
-            for (size_t i = 0; i < count; i++) {
-                subscriber_forward_message(sub, slice[i]);
+void query_destroy(Query* query)
+{
+    if (query->log != NULL) {
+        lock_messages();
+        message_log_unpin(query->log);
+        pthread_mutex_unlock(&ctx.messages_mutex);
+    }
+    close(query->fd);
+    for (size_t i = 0; i < query->ranges.count; i++) {
+        list_destroy(&query->results[i]);
+    }
+    free(query->results);
+    free(query->scanned);
+    list_destroy(&query->ranges);
+    topic_destroy(&query->query.pattern);
+    free(query);
+}
+
+// Sends what's ready to be sent, unless another worker is at it, and finishes the query once it's all sent.
+// Must be called with the query pool mutex held, which it lets go of while sending.
+void query_progress(Query* query)
+{
+    while (!query->sending && query->next_to_send < query->ranges.count && query->scanned[query->next_to_send]) {
+        size_t end = query->next_to_send;
+        while (end < query->ranges.count && query->scanned[end]) end++;
+        size_t const first = query->next_to_send;
+        bool const send = !query->stopped;
+        query->sending = true;
+        pthread_mutex_unlock(&query_pool.mutex);
+
+        bool const ok = !send || query_send(query, first, end);
+
+        pthread_mutex_lock(&query_pool.mutex);
+        query->sending = false;
+        query->next_to_send = end;
+        if (!ok || (query->query.limit > 0 && query->sent == query->query.limit)) {
+            query->stopped = true;
+        }
+    }
+
+    if (query->stopped && query->next_range < query->ranges.count) {
+        // Nothing else gets scanned, the ranges not taken count as done.
+        for (size_t i = query->next_range; i < query->ranges.count; i++) {
+            query->scanned[i] = true;
+        }
+        query->next_range = query->ranges.count;
+        query_pool_remove(query);
+        query_progress(query);
+        return;
+    }
+
+    bool const finished = !query->sending && query->scanning == 0 && query->next_to_send == query->ranges.count;
+    if (!finished) return;
+    pthread_mutex_unlock(&query_pool.mutex);
+    log_info("Query for \"" PRI_String "\" answered with %zu messages from %zu segments in %.3f ms",
+            fmt_String(query->query.pattern.original), query->sent, query->ranges.count, (time_now_ns() - query->start_ns) / 1e6);
+    query_destroy(query);
+    pthread_mutex_lock(&query_pool.mutex);
+}
+
+void* query_worker(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&query_pool.mutex);
+    for (;;) {
+        while (query_pool.queries.count == 0) {
+            pthread_cond_wait(&query_pool.query_added, &query_pool.mutex);
+        }
+        Query* query = list_get(query_pool.queries, 0);
+
+        if (!query->started) {
+            query->started = true;
+            query_pool_remove(query);
+            pthread_mutex_unlock(&query_pool.mutex);
+            query_start(query);
+            pthread_mutex_lock(&query_pool.mutex);
+            if (query->ranges.count > 0) {
+                list_append(&query_pool.queries, query);
+                pthread_cond_broadcast(&query_pool.query_added);
+            } else {
+                query_progress(query);
             }
-            free(slice);
-        } else {
-            Publisher_Message message = list_get(ctx.messages, new_count - 1);
-            pthread_mutex_unlock(&ctx.messages_mutex);
-            subscriber_forward_message(sub, message);
+            continue;
         }
+
+        size_t const range = query->next_range++;
+        query->scanning++;
+        if (query->next_range == query->ranges.count) {
+            query_pool_remove(query);
+        }
+        pthread_mutex_unlock(&query_pool.mutex);
+
+        segment_range_scan(list_get(query->ranges, range), &query->query, &query->results[range]);
+
+        pthread_mutex_lock(&query_pool.mutex);
+        query->scanning--;
+        query->scanned[range] = true;
+        query_progress(query);
     }
+    return NULL;
+}
+
+// Takes the connection, which is closed once the query was answered.
+void start_query(String const text, int const fd)
+{
+    Query* query = (Query*)calloc(1, sizeof(*query));
+    assert(query != NULL);
+    query->fd = fd;
+    query->start_ns = time_now_ns();
+    if (!parse_range_query(text, time(NULL), &query->query)) {
+        log_error("ERROR: Invalid query: \"" PRI_String "\"", fmt_String(text));
+        close(fd);
+        free(query);
+        return;
+    }
+    struct timeval const timeout = { .tv_sec = QUERY_SEND_TIMEOUT_SECONDS };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&query_pool.mutex);
+    list_append(&query_pool.queries, query);
+    pthread_cond_broadcast(&query_pool.query_added);
+    pthread_mutex_unlock(&query_pool.mutex);
 }
 
 void* listen_incoming_subscribers(void* arg)
@@ -160,7 +1187,7 @@ void* listen_incoming_subscribers(void* arg)
     // Create socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
-        perror("socket failed");
+        log_error("ERROR: Socket failed: %s", strerror(errno));
         pthread_exit((void*)1);
     }
 
@@ -171,21 +1198,23 @@ void* listen_incoming_subscribers(void* arg)
         .sin_port = htons(listening_port),
     };
 
+    // A restarted broker can bind while the connections of the previous one are in TIME_WAIT.
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
     // Bind socket
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind failed");
+        log_error("ERROR: Bind failed: %s", strerror(errno));
         pthread_exit((void*)1);
     }
 
     // Listen for connections
     if (listen(server_fd, 5) < 0) {
-        perror("listen failed");
+        log_error("ERROR: Listen failed: %s", strerror(errno));
         pthread_exit((void*)1);
     }
 
-    printf("Listening to subscribers on port %d...\n", listening_port);
-
-    String_list existing_ports = {};
+    log_info("Listening to subscribers on port %d...", listening_port);
 
     while (true) {
         // Accept incoming connection
@@ -193,43 +1222,37 @@ void* listen_incoming_subscribers(void* arg)
         socklen_t client_len = sizeof(client_addr);
         int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
         if (client_fd < 0) {
-            perror("accept failed");
+            log_error("ERROR: Accept failed: %s", strerror(errno));
             continue;
         }
 
-        printf("\nSubscriber connected to listening port %d.\n", listening_port);
+        log_info("Subscriber connected to listening port %d.", listening_port);
 
         // Read data
         char buffer[BUFFER_SIZE] = {0};
         ssize_t bytes_read = read(client_fd, buffer, BUFFER_SIZE);
+        String const query_prefix = str8("query|");
         if (bytes_read > 0) {
             String text = (String){ .data = buffer, .length = bytes_read };
             if (text.data[text.length - 1] == '\n') {
                 text.length -= 1;
+                if (text.length >= query_prefix.length && string_equals((String){ .data = text.data, .length = query_prefix.length }, query_prefix)) {
+                    start_query((String){ .data = text.data + query_prefix.length, .length = text.length - query_prefix.length }, client_fd);
+                    continue;
+                }
                 Subscriber_Message* subscriber = parse_subscriber_message(text);
-
-                const bool create_thread = (subscriber != NULL) &&
-                    (subscriber->persistent || !is_port_in(existing_ports, subscriber->output_port));
-
-                if (create_thread) {
-                    pthread_t subscriber_thread;
-                    int result = pthread_create(&subscriber_thread, NULL, subscriber_connection, (void*)subscriber);
-                    if (result == 0) {
-                        list_append(&existing_ports, subscriber->output_port);
-                    } else {
-                        eprintfln("ERROR: Failed to create subscriber thread");
-                        free(subscriber);
-                    }
+                if (subscriber != NULL) {
+                    register_subscription(subscriber, text);
                 }
             } else {
-                eprintfln("ERROR: Message improperly terminated: \"%.*s\"", fmt_String(text));
+                log_error("ERROR: Message improperly terminated: \"%.*s\"", fmt_String(text));
             }
         }
 
         if (bytes_read == 0) {
-            printf("Subscriber at listening port %d disconnected normally.\n", listening_port);
+            log_info("Subscriber at listening port %d disconnected normally.", listening_port);
         } else if (bytes_read < 0) {
-            perror("ERROR: Reading publisher messages failed");
+            log_error("ERROR: Reading publisher messages failed: %s", strerror(errno));
         }
 
         close(client_fd);
@@ -239,15 +1262,173 @@ void* listen_incoming_subscribers(void* arg)
     return NULL;
 }
 
+// Prints the latency percentiles of every stage whenever the broker gets a SIGUSR1. Every other thread has it
+// blocked, so it only ever arrives here.
+void* latency_reporter(void* arg)
+{
+    sigset_t const* signals = (sigset_t const*)arg;
+    Histogram* stages = (Histogram*)malloc(TRACE_STAGE_COUNT * sizeof(*stages));
+    assert(stages != NULL);
+
+    for (;;) {
+        int signal;
+        if (sigwait(signals, &signal) != 0) continue;
+
+        latency_snapshot(stages);
+        printfln("Latencies in microseconds:");
+        printfln("    %-12s %10s %10s %10s %10s %10s %10s", "stage", "count", "p50", "p90", "p99", "p99.9", "max");
+        for (size_t i = 0; i < TRACE_STAGE_COUNT; i++) {
+            Histogram const* stage = &stages[i];
+            printfln("    %-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f", trace_stage_names[i],
+                    (unsigned long long)stage->total, histogram_percentile(stage, 50) / 1e3,
+                    histogram_percentile(stage, 90) / 1e3, histogram_percentile(stage, 99) / 1e3,
+                    histogram_percentile(stage, 99.9) / 1e3, stage->max / 1e3);
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+#define STATS_TOPIC_PREFIX "$SYS/broker/"
+
+// Every `interval` seconds the broker appends what it counted since it started to the log, as messages like
+// any other. Subscribe to "$SYS/#" to get them:
+//     $SYS/broker/messages/in|<count>                 also out and rejected, and bytes/in and bytes/out
+//     $SYS/broker/store/messages|<count>              messages in the log
+//     $SYS/broker/store/evicted|<count>               messages that expired
+//     $SYS/broker/store/compacted|<count>             messages replaced by a newer one, see -compact
+//     $SYS/broker/store/rollups/<interval>|<count>    buckets kept by the rollup tier, see -rollup
+//     $SYS/broker/lock/wait_us|<us>                   time spent waiting for messages_mutex
+//     $SYS/broker/subscriptions/count|<count>
+//     $SYS/broker/subscriptions/<name>/lag|<count>    messages the subscription has yet to go through
+//     $SYS/broker/topics/<topic>/messages/in|<count>  also out, only for the topics that changed
+//     $SYS/broker/latency/<stage>/p50|<us>            also p99, see Latency Tracing
+void* stats_publisher(void* arg)
+{
+    unsigned int const interval = (unsigned int)(size_t)arg;
+    Histogram* stages = (Histogram*)malloc(TRACE_STAGE_COUNT * sizeof(*stages));
+    assert(stages != NULL);
+    String_Builder lines = {};
+    Publisher_Message_list messages = {};
+
+    for (;;) {
+        sleep(interval);
+        lines.count = 0;
+        messages.count = 0;
+
+        pthread_mutex_lock(&ctx.messages_mutex);
+        Broker_Stats* stats = &ctx.stats;
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "messages/in|%llu\n", (unsigned long long)stats->messages_in);
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "messages/out|%llu\n", (unsigned long long)stats->messages_out);
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "messages/rejected|%llu\n", (unsigned long long)stats->rejected);
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "bytes/in|%llu\n", (unsigned long long)stats->bytes_in);
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "bytes/out|%llu\n", (unsigned long long)stats->bytes_out);
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "store/messages|%llu\n", (unsigned long long)(ctx.log.next_offset - ctx.log.base_offset));
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "store/evicted|%llu\n", (unsigned long long)stats->evicted);
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "store/compacted|%llu\n", (unsigned long long)ctx.compactor.compacted);
+        for (size_t i = 0; i < ctx.rollups.count; i++) {
+            Rollup_Tier const* tier = &list_get(ctx.rollups, i);
+            string_builder_appendf(&lines, STATS_TOPIC_PREFIX "store/rollups/%us|%llu\n", tier->interval,
+                    (unsigned long long)(tier->log.next_offset - tier->log.base_offset));
+        }
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "lock/wait_us|%llu\n", (unsigned long long)(stats->lock_wait_ns / 1000));
+        string_builder_appendf(&lines, STATS_TOPIC_PREFIX "subscriptions/count|%zu\n", ctx.subscriptions.count);
+        for (size_t i = 0; i < ctx.subscriptions.count; i++) {
+            Subscription const* subscription = list_get(ctx.subscriptions, i);
+            Subscriber_Message const* sub = &subscription->sub;
+            unsigned long long const lag = ctx.log.next_offset - Max(subscription->offset, ctx.log.base_offset);
+            if (!is_string_null(sub->name)) {
+                string_builder_appendf(&lines, STATS_TOPIC_PREFIX "subscriptions/" PRI_String "/lag|%llu\n", fmt_String(sub->name), lag);
+            } else {
+                string_builder_appendf(&lines, STATS_TOPIC_PREFIX "subscriptions/" PRI_String ":" PRI_String "/lag|%llu\n",
+                        fmt_String(sub->output_hostname), fmt_String(sub->output_port), lag);
+            }
+        }
+        for (size_t i = 0; i < stats->topics.count; i++) {
+            Topic_Stats* topic = &list_get(stats->topics, i);
+            // The topics too deep to fit under the prefix aren't published.
+            if (topic->level_count + 5 > TOPIC_MAX_LEVELS) continue;
+            if (topic->messages_in != topic->published_in) {
+                string_builder_appendf(&lines, STATS_TOPIC_PREFIX "topics/" PRI_String "/messages/in|%llu\n",
+                        fmt_String(topic->topic), (unsigned long long)topic->messages_in);
+                topic->published_in = topic->messages_in;
+            }
+            if (topic->messages_out != topic->published_out) {
+                string_builder_appendf(&lines, STATS_TOPIC_PREFIX "topics/" PRI_String "/messages/out|%llu\n",
+                        fmt_String(topic->topic), (unsigned long long)topic->messages_out);
+                topic->published_out = topic->messages_out;
+            }
+        }
+        pthread_mutex_unlock(&ctx.messages_mutex);
+
+        latency_snapshot(stages);
+        for (size_t i = 0; i < TRACE_STAGE_COUNT; i++) {
+            if (stages[i].total == 0) continue;
+            string_builder_appendf(&lines, STATS_TOPIC_PREFIX "latency/%s/p50|%.1f\n", trace_stage_names[i], histogram_percentile(&stages[i], 50) / 1e3);
+            string_builder_appendf(&lines, STATS_TOPIC_PREFIX "latency/%s/p99|%.1f\n", trace_stage_names[i], histogram_percentile(&stages[i], 99) / 1e3);
+        }
+
+        // Parsed outside of the lock, then appended all at once.
+        String rest = String_from_builder(lines);
+        for (ssize_t newline; (newline = string_find_char(rest, '\n')) >= 0;) {
+            Publisher_Message message = parse_publisher_message((String){ .data = rest.data, .length = newline });
+            if (message.topic.levels.data != NULL) {
+                list_append(&messages, message);
+            }
+            rest.data += newline + 1;
+            rest.length -= newline + 1;
+        }
+
+        pthread_mutex_lock(&ctx.messages_mutex);
+        uint64_t const now = time_now_ns();
+        for (size_t i = 0; i < messages.count; i++) {
+            Publisher_Message message = list_get(messages, i);
+            message.received_ns = message.appended_ns = now;
+            message_log_append(&ctx.log, message);
+        }
+        pthread_cond_broadcast(&ctx.message_arrived);
+        pthread_mutex_unlock(&ctx.messages_mutex);
+    }
+    return NULL;
+}
+
 void usage(const char **argv)
 {
-    eprintfln("usage: %s message_storage_time subscriber_port [publisher_port ...]", argv[0]);
+    eprintfln("usage: %s message_storage_time subscriber_port [publisher_port ...] [flags ...]", argv[0]);
     eprintfln("\nmessage_sorage_time:");
     eprintfln(" - session: The messages never get removed from the list.");
     eprintfln(" - <x>s: The messages get removed from the list after <x> seconds.");
+    eprintfln("\nflags:");
+    eprintfln("    -registry <file>: Saves the subscriptions in <file>, so they survive restarts.");
+    eprintfln("    -compact <topic>: Only keeps the newest message of each topic that matches <topic>, wildcards");
+    eprintfln("                      included, once they're old enough. Can be given more than once.");
+    eprintfln("    -rollup <interval>:<retention>: Also keeps the min, max, mean and count of every numeric topic");
+    eprintfln("                      over each <interval>, for <retention>. Each tier must have a longer interval");
+    eprintfln("                      than the one before it, like -rollup 1m:1d -rollup 1h:30d.");
+    eprintfln("    -stats <x>: Publishes the broker's stats under $SYS/broker/ every <x> seconds.");
+    eprintfln("    -reactors <n>: Threads that serve the publishers, one per core by default.");
+    eprintfln("    -io <epoll|uring>: How the reactors wait for the publishers, epoll by default. uring falls back");
+    eprintfln("                       to epoll when the kernel can't.");
+    eprintfln("    -log <level>: Logs error, warning, info (the default) or debug messages, debug logs every message.");
+    eprintfln("\nClients can also send the subscriber port a query for the messages of a time range, answered with");
+    eprintfln("a <topic>|<value>|<unix ns> line per message:");
+    eprintfln("    query|<topic pattern>|<from>|<to>|<limit>[|raw|<rollup interval>]");
+    eprintfln("where the times are unix seconds, now or a duration ago like -8h, and a limit of 0 means none.");
+    eprintfln("\nSend the broker a SIGUSR1 to print the latencies of the stages a message goes through.");
     exit(EXIT_FAILURE);
 }
 
+// The oldest offset of the log that a subscription may still hold a copy of. Subscriptions only use the
+// messages they copied until they move their offset past them. Must be called with messages_mutex held.
+uint64_t oldest_read_offset(void)
+{
+    uint64_t oldest_read = ctx.log.next_offset;
+    for (size_t i = 0; i < ctx.subscriptions.count; i++) {
+        oldest_read = Min(oldest_read, list_get(ctx.subscriptions, i)->offset);
+    }
+    return oldest_read;
+}
+
 void *old_messages_cleaner(void *arg) {
     unsigned int wait_time = (unsigned int)(size_t)arg;
 
@@ -256,18 +1437,70 @@ void *old_messages_cleaner(void *arg) {
         time_t now = time(NULL);
 
         pthread_mutex_lock(&ctx.messages_mutex);
-        if (ctx.messages.count > 0) {
-            Publisher_Message first = list_get(ctx.messages, 0);
-            time_t duration = now - first.timestamp;
-            if (duration > wait_time) {
-                printfln("Cleaned old message: " PRI_Publisher_Message, fmt_Publisher_Message(first));
-                ctx.messages.count--;
-                for (size_t i = 0; i < ctx.messages.count; i++) {
-                    list_set(ctx.messages, i, list_get(ctx.messages, i + 1));
-                }
-            }
+        uint64_t expired = ctx.log.base_offset;
+        uint64_t evicted = 0;
+        Publisher_Message oldest;
+        uint64_t next_offset;
+        // Compaction leaves gaps in the offsets, reading skips them.
+        while (message_log_read(&ctx.log, expired, &oldest, 1, &next_offset) == 1 && now - oldest.timestamp > wait_time) {
+            expired = next_offset;
+            evicted++;
+        }
+        if (evicted > 0) {
+            log_info("Cleaned %llu old messages", (unsigned long long)evicted);
+            ctx.stats.evicted += evicted;
+            message_log_trim(&ctx.log, expired);
         }
+        message_log_release(&ctx.log, oldest_read_offset());
+        pthread_mutex_unlock(&ctx.messages_mutex);
+    }
+    return NULL;
+}
+
+#define COMPACTION_ROUND_MESSAGES (4 * LOG_SEGMENT_SIZE)
+#define COMPACTION_ROUND_PAUSE_MS  10
+#define COMPACTION_IDLE_MS         1000
+
+// Compacts the topics of the -compact flags, see Log Compaction. Every round works through at most
+// COMPACTION_ROUND_MESSAGES messages under the lock, then lets the publishers and subscribers have it.
+void* log_compactor(void* arg)
+{
+    (void)arg;
+    Log_Compactor* compactor = &ctx.compactor;
+    for (;;) {
+        lock_messages();
+        size_t const scanned = log_compactor_scan(compactor, &ctx.log, COMPACTION_ROUND_MESSAGES);
+        size_t const dropped = scanned < COMPACTION_ROUND_MESSAGES
+            ? log_compactor_compact(compactor, &ctx.log, COMPACTION_ROUND_MESSAGES - scanned)
+            : 0;
+        log_compactor_release(compactor, &ctx.log, oldest_read_offset());
+        pthread_mutex_unlock(&ctx.messages_mutex);
+
+        if (dropped > 0) {
+            log_debug("Compacted %zu messages", dropped);
+        }
+        bool const busy = scanned == COMPACTION_ROUND_MESSAGES || dropped > 0;
+        usleep((busy ? COMPACTION_ROUND_PAUSE_MS : COMPACTION_IDLE_MS) * 1000);
+    }
+    return NULL;
+}
+
+#define ROLLUP_CLOSE_INTERVAL_SECONDS 1
+
+// Closes the buckets of the -rollup tiers that ended, and drops those that are past their retention.
+void* rollup_closer(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        sleep(ROLLUP_CLOSE_INTERVAL_SECONDS);
+        lock_messages();
+        time_t const now = time(NULL);
+        rollup_tiers_close(&ctx.rollups, now);
+        uint64_t const trimmed = rollup_tiers_trim(&ctx.rollups, now);
         pthread_mutex_unlock(&ctx.messages_mutex);
+        if (trimmed > 0) {
+            log_debug("Dropped %llu rollups", (unsigned long long)trimmed);
+        }
     }
     return NULL;
 }
@@ -275,12 +1508,106 @@ void *old_messages_cleaner(void *arg) {
 int main(int argc, const char** argv)
 {
     int const publisher_ports_offset = 3;
-    int const publisher_ports_count = argc - publisher_ports_offset;
+    int publisher_ports_count = 0;
 
     if (argc - 1 < publisher_ports_offset) {
         usage(argv);
     }
 
+    // Every publisher connection takes a file descriptor.
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    // Before any other thread starts, so they all inherit the mask.
+    static sigset_t report_signals;
+    sigemptyset(&report_signals);
+    sigaddset(&report_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &report_signals, NULL);
+    pthread_t reporter_thread;
+    if (pthread_create(&reporter_thread, NULL, latency_reporter, &report_signals) != 0) {
+        eprintfln("ERROR: Failed to create the latency reporter thread");
+        exit(EXIT_FAILURE);
+    }
+
+    while (publisher_ports_offset + publisher_ports_count < argc && argv[publisher_ports_offset + publisher_ports_count][0] != '-') {
+        publisher_ports_count++;
+    }
+    int stats_interval = 0;
+    int reactor_count = (int)Max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    bool io_uring = false;
+    Log_Level level = LOG_INFO;
+    const char* registry_path = NULL;
+    for (const char **flag = &argv[publisher_ports_offset + publisher_ports_count]; *flag != NULL; flag++) {
+        if (strcmp(*flag, "-registry") == 0) {
+            flag++;
+            if (*flag == NULL) {
+                eprintfln("ERROR: Must supply the path of the registry file.\n");
+                usage(argv);
+            }
+            registry_path = *flag;
+        } else if (strcmp(*flag, "-log") == 0) {
+            flag++;
+            if (*flag == NULL || !log_level_parse(*flag, &level)) {
+                eprintfln("ERROR: Must supply a log level: error, warning, info or debug.\n");
+                usage(argv);
+            }
+        } else if (strcmp(*flag, "-reactors") == 0) {
+            flag++;
+            reactor_count = *flag == NULL ? 0 : atoi(*flag);
+            if (reactor_count <= 0) {
+                eprintfln("ERROR: Must supply how many reactor threads serve the publishers.\n");
+                usage(argv);
+            }
+        } else if (strcmp(*flag, "-io") == 0) {
+            flag++;
+            if (*flag == NULL || (strcmp(*flag, "epoll") != 0 && strcmp(*flag, "uring") != 0)) {
+                eprintfln("ERROR: Must supply the I/O engine: epoll or uring.\n");
+                usage(argv);
+            }
+            io_uring = strcmp(*flag, "uring") == 0;
+        } else if (strcmp(*flag, "-compact") == 0) {
+            flag++;
+            Topic const pattern = *flag == NULL ? (Topic){} : parse_topic(String_from_cstr(*flag));
+            if (pattern.levels.count == 0) {
+                eprintfln("ERROR: Must supply the topics to compact.\n");
+                usage(argv);
+            }
+            list_append(&ctx.compactor.patterns, pattern);
+        } else if (strcmp(*flag, "-rollup") == 0) {
+            flag++;
+            Rollup_Tier tier;
+            if (*flag == NULL || !parse_rollup_tier(String_from_cstr(*flag), &tier)) {
+                eprintfln("ERROR: Must supply the interval and the retention of the rollup tier, like 1m:1d.\n");
+                usage(argv);
+            }
+            if (ctx.rollups.count > 0 && tier.interval <= list_get_last(ctx.rollups).interval) {
+                eprintfln("ERROR: Each rollup tier must have a longer interval than the one before it.\n");
+                usage(argv);
+            }
+            list_append(&ctx.rollups, tier);
+        } else if (strcmp(*flag, "-stats") == 0) {
+            flag++;
+            stats_interval = *flag == NULL ? 0 : atoi(*flag);
+            if (stats_interval <= 0) {
+                eprintfln("ERROR: Must supply how many seconds apart the stats get published.\n");
+                usage(argv);
+            }
+        } else {
+            eprintfln("ERROR: Unrecognized flag \"%s\".\n", *flag);
+            usage(argv);
+        }
+    }
+
+    if (!log_start(level)) {
+        exit(EXIT_FAILURE);
+    }
+    if (registry_path != NULL && !registry_load(registry_path)) {
+        exit(EXIT_FAILURE);
+    }
+
     pthread_t cleaner_thread;
     bool has_cleaner_thread = false;
     /* Setting up how long messages can be stored */ {
@@ -303,6 +1630,44 @@ int main(int argc, const char** argv)
         }
     }
 
+    if (ctx.compactor.patterns.count > 0) {
+        pthread_t compactor_thread;
+        if (pthread_create(&compactor_thread, NULL, log_compactor, NULL) != 0) {
+            eprintfln("ERROR: Failed to create the log compactor thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(compactor_thread);
+    }
+
+    if (ctx.rollups.count > 0) {
+        pthread_t rollup_thread;
+        if (pthread_create(&rollup_thread, NULL, rollup_closer, NULL) != 0) {
+            eprintfln("ERROR: Failed to create the rollup thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(rollup_thread);
+    }
+
+    // Range queries are scanned by a worker per core.
+    long const query_workers = Max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    for (long i = 0; i < query_workers; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, query_worker, NULL) != 0) {
+            eprintfln("ERROR: Failed to create a query worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(worker);
+    }
+
+    if (stats_interval > 0) {
+        pthread_t stats_thread;
+        if (pthread_create(&stats_thread, NULL, stats_publisher, (void*)(size_t)stats_interval) != 0) {
+            eprintfln("ERROR: Failed to create the stats publisher thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(stats_thread);
+    }
+
     pthread_t listening_thread;
     /* Launch thread to listen to subscribers */ {
         int listening_port = atoi(argv[2]);
@@ -313,19 +1678,20 @@ int main(int argc, const char** argv)
         }
     }
 
-    pthread_t* publisher_threads = malloc(publisher_ports_count * sizeof(pthread_t));
-
+    int* publisher_ports = malloc(publisher_ports_count * sizeof(int));
     for (int i = 0; i < publisher_ports_count; i++) {
-        int publisher_port = atoi(argv[i + publisher_ports_offset]);
-        int result = pthread_create(&publisher_threads[i], NULL, publisher_connection, (void*)(size_t)publisher_port);
-        if (result != 0) {
-            eprintfln("ERROR: Failed to create publisher listener thread[%d]", i);
+        publisher_ports[i] = atoi(argv[i + publisher_ports_offset]);
+    }
+    pthread_t* reactor_threads = malloc(reactor_count * sizeof(pthread_t));
+    for (int i = 0; i < reactor_count; i++) {
+        if (!start_reactor(i, publisher_ports, publisher_ports_count, io_uring, &reactor_threads[i])) {
             exit(EXIT_FAILURE);
         }
     }
-    
-    for (int i = 0; i < publisher_ports_count; i++) {
-        pthread_join(publisher_threads[i], NULL);
+    log_info("%d reactors serve the publishers with %s", reactor_count, io_uring ? "io_uring" : "epoll");
+
+    for (int i = 0; i < reactor_count; i++) {
+        pthread_join(reactor_threads[i], NULL);
     }
     pthread_join(listening_thread, NULL);
     pthread_join(listening_thread, NULL);
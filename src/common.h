@@ -1,7 +1,13 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <math.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -9,11 +15,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRING_SIMD
+#endif
+
 #define BUFFER_SIZE 1024
 
 // Arrays
@@ -47,6 +60,7 @@
     if ((list)->count + size > (list)->capacity) {\
         if ((list)->capacity == 0) {\
             (list)->capacity = 8;\
+            while ((list)->count + size > (list)->capacity) (list)->capacity *= 2;\
             (list)->data = malloc((list)->capacity * sizeof(*(list)->data));\
             assert((list)->data != NULL);\
         } else {\
@@ -119,25 +133,6 @@ typedef struct { String* data; size_t count, capacity; } String_list;
     (str)->data = (char*)malloc(size);\
 } while (0)
 
-String_list string_split(String const str, char delimiter)
-{
-    String_list parts = {0};
-
-    size_t start = 0;
-    for (size_t i = 0; i < str.length; i++) {
-        if (String_get(str, i) == delimiter || i == str.length - 1) {
-            String slice = { .data = str.data + start, .length = i - start };
-            if (i == str.length - 1) {
-                slice.length++;
-            }
-            list_append(&parts, slice);
-            start = i + 1;
-        }
-    }
-
-    return parts;
-}
-
 String string_clone(String const str)
 {
     String result = {
@@ -150,7 +145,20 @@ String string_clone(String const str)
     return result;
 }
 
-bool string_equals(String const a, String const b)
+bool string_is_only_whitespace(String const str)
+{
+    for (size_t i = 0; i < str.length; i++) {
+        if (!isspace(String_get(str, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Searching and comparing is on every hot path, so it goes 16 bytes at a time with SSE2, or 32 with AVX2 when
+// the CPU has it. The *_scalar versions are the reference the tests and the benchmarks compare them with.
+
+bool string_equals_scalar(String const a, String const b)
 {
     if (a.length != b.length) {
         return false;
@@ -163,33 +171,119 @@ bool string_equals(String const a, String const b)
     return true;
 }
 
-bool string_is_only_whitespace(String const str)
+ssize_t string_find_char_scalar(String const str, char c)
 {
     for (size_t i = 0; i < str.length; i++) {
-        if (!isspace(String_get(str, i))) {
-            return false;
+        if (String_get(str, i) == c) {
+            return i;
         }
     }
-    return true;
+    return -1;
 }
 
-ssize_t string_find_substr(String const str, String const substr)
+ssize_t string_find_substr_scalar(String const str, String const substr)
 {
     for (size_t i = 0; i < str.length; i++) {
         String slice = {
             .data = str.data + i,
             .length = Min(substr.length, str.length - i),
         };
-        if (string_equals(slice, substr)) {
+        if (string_equals_scalar(slice, substr)) {
             return i;
         }
     }
     return -1;
 }
 
-ssize_t string_find_char(String const str, char c)
+typedef enum {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+} Simd_Level;
+
+__attribute__((unused)) static const char* simd_level_names[] = {
+    [SIMD_NONE] = "scalar",
+    [SIMD_SSE2] = "sse2",
+    [SIMD_AVX2] = "avx2",
+};
+
+Simd_Level simd_level(void)
 {
-    for (size_t i = 0; i < str.length; i++) {
+    static int level = -1;
+    int cached = __atomic_load_n(&level, __ATOMIC_RELAXED);
+    if (cached < 0) {
+#ifdef STRING_SIMD
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#else
+        cached = SIMD_NONE;
+#endif
+        __atomic_store_n(&level, cached, __ATOMIC_RELAXED);
+    }
+    return cached;
+}
+
+#ifdef STRING_SIMD
+
+// The positions from `start` on that the vectorized loops didn't get to. Matches can't go past the end, unlike
+// in string_find_substr_scalar() where they're cut short and never equal.
+ssize_t string_find_substr_tail(String const str, String const substr, size_t start)
+{
+    for (size_t i = start; i + substr.length <= str.length; i++) {
+        if (String_get(str, i) == String_get(substr, 0) && memcmp(str.data + i, substr.data, substr.length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool string_equals_sse2(String const a, String const b)
+{
+    if (a.length != b.length) {
+        return false;
+    }
+    size_t i = 0;
+    for (; i + 16 <= a.length; i += 16) {
+        __m128i const x = _mm_loadu_si128((__m128i const*)(a.data + i));
+        __m128i const y = _mm_loadu_si128((__m128i const*)(b.data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) {
+            return false;
+        }
+    }
+    return memcmp(a.data + i, b.data + i, a.length - i) == 0;
+}
+
+__attribute__((target("avx2")))
+bool string_equals_avx2(String const a, String const b)
+{
+    if (a.length != b.length) {
+        return false;
+    }
+    size_t i = 0;
+    for (; i + 32 <= a.length; i += 32) {
+        __m256i const x = _mm256_loadu_si256((__m256i const*)(a.data + i));
+        __m256i const y = _mm256_loadu_si256((__m256i const*)(b.data + i));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xffffffffu) {
+            return false;
+        }
+    }
+    // Mixing dirty AVX registers with the SSE code of the tail stalls the CPU.
+    _mm256_zeroupper();
+    return string_equals_sse2((String){ .data = a.data + i, .length = a.length - i }, (String){ .data = b.data + i, .length = b.length - i });
+}
+
+ssize_t string_find_char_sse2(String const str, char c)
+{
+    __m128i const needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= str.length; i += 16) {
+        __m128i const chunk = _mm_loadu_si128((__m128i const*)(str.data + i));
+        int const mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < str.length; i++) {
         if (String_get(str, i) == c) {
             return i;
         }
@@ -197,6 +291,275 @@ ssize_t string_find_char(String const str, char c)
     return -1;
 }
 
+__attribute__((target("avx2")))
+ssize_t string_find_char_avx2(String const str, char c)
+{
+    __m256i const needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= str.length; i += 32) {
+        __m256i const chunk = _mm256_loadu_si256((__m256i const*)(str.data + i));
+        uint32_t const mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    _mm256_zeroupper();
+    ssize_t const found = string_find_char_sse2((String){ .data = str.data + i, .length = str.length - i }, c);
+    return found < 0 ? -1 : (ssize_t)i + found;
+}
+
+// Candidates are the positions where both the first and the last byte of `substr` match, which rules out
+// almost every position 16 at a time, and only those get compared in full.
+ssize_t string_find_substr_sse2(String const str, String const substr)
+{
+    if (substr.length < 2 || substr.length > str.length) {
+        return string_find_substr_scalar(str, substr);
+    }
+    __m128i const first = _mm_set1_epi8(String_get(substr, 0));
+    __m128i const last = _mm_set1_epi8(String_get_last(substr));
+    size_t i = 0;
+    for (; i + substr.length - 1 + 16 <= str.length; i += 16) {
+        __m128i const starts = _mm_loadu_si128((__m128i const*)(str.data + i));
+        __m128i const ends = _mm_loadu_si128((__m128i const*)(str.data + i + substr.length - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last)));
+        while (mask != 0) {
+            size_t const candidate = i + __builtin_ctz(mask);
+            if (memcmp(str.data + candidate + 1, substr.data + 1, substr.length - 2) == 0) {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return string_find_substr_tail(str, substr, i);
+}
+
+__attribute__((target("avx2")))
+ssize_t string_find_substr_avx2(String const str, String const substr)
+{
+    if (substr.length < 2 || substr.length > str.length) {
+        return string_find_substr_scalar(str, substr);
+    }
+    __m256i const first = _mm256_set1_epi8(String_get(substr, 0));
+    __m256i const last = _mm256_set1_epi8(String_get_last(substr));
+    size_t i = 0;
+    for (; i + substr.length - 1 + 32 <= str.length; i += 32) {
+        __m256i const starts = _mm256_loadu_si256((__m256i const*)(str.data + i));
+        __m256i const ends = _mm256_loadu_si256((__m256i const*)(str.data + i + substr.length - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(starts, first), _mm256_cmpeq_epi8(ends, last)));
+        while (mask != 0) {
+            size_t const candidate = i + __builtin_ctz(mask);
+            if (string_equals_avx2((String){ .data = str.data + candidate + 1, .length = substr.length - 2 },
+                                   (String){ .data = substr.data + 1, .length = substr.length - 2 })) {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+    _mm256_zeroupper();
+    return string_find_substr_tail(str, substr, i);
+}
+
+#endif // STRING_SIMD
+
+bool string_equals(String const a, String const b)
+{
+#ifdef STRING_SIMD
+    if (simd_level() == SIMD_AVX2) return string_equals_avx2(a, b);
+    return string_equals_sse2(a, b);
+#else
+    return string_equals_scalar(a, b);
+#endif
+}
+
+ssize_t string_find_char(String const str, char c)
+{
+#ifdef STRING_SIMD
+    if (simd_level() == SIMD_AVX2) return string_find_char_avx2(str, c);
+    return string_find_char_sse2(str, c);
+#else
+    return string_find_char_scalar(str, c);
+#endif
+}
+
+ssize_t string_find_substr(String const str, String const substr)
+{
+#ifdef STRING_SIMD
+    if (simd_level() == SIMD_AVX2) return string_find_substr_avx2(str, substr);
+    return string_find_substr_sse2(str, substr);
+#else
+    return string_find_substr_scalar(str, substr);
+#endif
+}
+
+String_list string_split_scalar(String const str, char delimiter)
+{
+    String_list parts = {0};
+
+    size_t start = 0;
+    for (size_t i = 0; i < str.length; i++) {
+        if (String_get(str, i) == delimiter || i == str.length - 1) {
+            String slice = { .data = str.data + start, .length = i - start };
+            if (i == str.length - 1) {
+                slice.length++;
+            }
+            list_append(&parts, slice);
+            start = i + 1;
+        }
+    }
+
+    return parts;
+}
+
+// Same parts as string_split_scalar(), taking the delimiters 16 at a time from a bitmask. Parts are short, so
+// AVX2 doesn't pay off here.
+String_list string_split(String const str, char delimiter)
+{
+#ifdef STRING_SIMD
+    String_list parts = {0};
+
+    size_t start = 0;
+    size_t i = 0;
+    __m128i const needle = _mm_set1_epi8(delimiter);
+    for (; i + 16 <= str.length; i += 16) {
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(str.data + i)), needle));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t const at = i + __builtin_ctz(mask);
+            // A trailing delimiter stays in the last part.
+            if (at == str.length - 1) break;
+            list_append(&parts, ((String){ .data = str.data + start, .length = at - start }));
+            start = at + 1;
+        }
+    }
+    for (; i + 1 < str.length; i++) {
+        if (String_get(str, i) == delimiter) {
+            list_append(&parts, ((String){ .data = str.data + start, .length = i - start }));
+            start = i + 1;
+        }
+    }
+    if (start < str.length) {
+        list_append(&parts, ((String){ .data = str.data + start, .length = str.length - start }));
+    }
+
+    return parts;
+#else
+    return string_split_scalar(str, delimiter);
+#endif
+}
+
+String_list string_split_words(String const str)
+{
+    String_list words = {0};
+    size_t i = 0;
+    while (i < str.length) {
+        while (i < str.length && isspace(String_get(str, i))) i++;
+        size_t const start = i;
+        while (i < str.length && !isspace(String_get(str, i))) i++;
+        if (i > start) {
+            list_append(&words, ((String){ .data = str.data + start, .length = i - start }));
+        }
+    }
+    return words;
+}
+
+// The whole string has to be the number.
+bool string_to_double(String const str, double* result)
+{
+    char buffer[64];
+    if (str.length == 0 || str.length >= sizeof(buffer)) {
+        return false;
+    }
+    memcpy(buffer, str.data, str.length);
+    buffer[str.length] = '\0';
+    char* end;
+    *result = strtod(buffer, &end);
+    return end == buffer + str.length;
+}
+
+// Hashing
+// ------------------------------------------------------------------------------------------------------- //
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME        0x100000001b3ull
+
+// 64 bit FNV-1a.
+uint64_t hash_string(String const str)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < str.length; i++) {
+        hash ^= (uint8_t)String_get(str, i);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Open addressing table from a hash to an index into a list that the caller owns. The list keeps the keys, so
+// callers compare the key of every candidate that hash_index_next() returns:
+//
+//     size_t probe = 0;
+//     for (uint32_t i; (i = hash_index_next(&index, hash, &probe)) != HASH_INDEX_EMPTY;) {
+//         if (string_equals(list_get(entries, i).key, key)) return &list_get(entries, i);
+//     }
+
+#define HASH_INDEX_EMPTY UINT32_MAX
+
+typedef struct {
+    uint64_t hash;
+    uint32_t index;
+} Hash_Slot;
+
+typedef struct {
+    Hash_Slot* slots;
+    size_t count, capacity; // The capacity is always a power of two.
+} Hash_Index;
+
+uint32_t hash_index_next(Hash_Index const* table, uint64_t const hash, size_t* probe)
+{
+    if (table->capacity == 0) {
+        return HASH_INDEX_EMPTY;
+    }
+    size_t const mask = table->capacity - 1;
+    for (;;) {
+        Hash_Slot const slot = table->slots[(hash + *probe) & mask];
+        *probe += 1;
+        if (slot.index == HASH_INDEX_EMPTY) return HASH_INDEX_EMPTY;
+        if (slot.hash == hash) return slot.index;
+    }
+}
+
+void hash_index_insert(Hash_Index* table, uint64_t const hash, uint32_t const index);
+
+void hash_index_grow(Hash_Index* table)
+{
+    Hash_Index grown = { .capacity = table->capacity == 0 ? 64 : table->capacity * 2 };
+    grown.slots = (Hash_Slot*)malloc(grown.capacity * sizeof(*grown.slots));
+    assert(grown.slots != NULL);
+    for (size_t i = 0; i < grown.capacity; i++) {
+        grown.slots[i].index = HASH_INDEX_EMPTY;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].index != HASH_INDEX_EMPTY) {
+            hash_index_insert(&grown, table->slots[i].hash, table->slots[i].index);
+        }
+    }
+    free(table->slots);
+    *table = grown;
+}
+
+void hash_index_insert(Hash_Index* table, uint64_t const hash, uint32_t const index)
+{
+    // Kept at most half full so probes stay short.
+    if ((table->count + 1) * 2 > table->capacity) {
+        hash_index_grow(table);
+    }
+    size_t const mask = table->capacity - 1;
+    size_t slot = hash & mask;
+    while (table->slots[slot].index != HASH_INDEX_EMPTY) {
+        slot = (slot + 1) & mask;
+    }
+    table->slots[slot] = (Hash_Slot){ .hash = hash, .index = index };
+    table->count++;
+}
+
 // String Builder
 // ------------------------------------------------------------------------------------------------------- //
 
@@ -241,7 +604,7 @@ void string_builder_appendf(String_Builder* builder, const char* fmt, ...)
     int const added_count = vsnprintf(NULL, 0, fmt, _args);
     va_end(_args);
 
-    string_builder_grow_if_needed(builder, added_count);
+    string_builder_grow_if_needed(builder, added_count + 1);
 
     va_list  args;
     va_start(args, fmt);
@@ -285,220 +648,3124 @@ bool fs_read_entire_file(const char *path, String *result) {
     return true;
 }
 
-// Sockets
+// Time
 // ------------------------------------------------------------------------------------------------------- //
 
-int connect_to_output(const char* output_hostname, const char* output_port)
+uint64_t time_now_ms(void)
 {
-    struct addrinfo hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-    };
-    struct addrinfo *res = NULL;
-    int status = getaddrinfo(output_hostname, output_port, &hints, &res);
-    if (status != 0) {
-        fprintf(stderr, "ERROR: getaddrinfo: %s\n", gai_strerror(status));
-        return -1;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-    // Try each result until we connect
-    int forward_fd = -1;
-    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
-        forward_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (forward_fd < 0) continue;
+uint64_t time_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-        if (connect(forward_fd, p->ai_addr, p->ai_addrlen) == 0) {
-            break;
-        }
+// Wall clock time, which is the only one that means the same in two processes on different machines.
+uint64_t time_unix_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-        close(forward_fd);
-        forward_fd = -1;
+// Durations like "90s", "15m", "1h" or "30d", in seconds.
+bool parse_duration(String const text, unsigned int* seconds)
+{
+    if (text.length < 2) return false;
+    double unit;
+    switch (String_get(text, text.length - 1)) {
+        case 's': unit = 1; break;
+        case 'm': unit = 60; break;
+        case 'h': unit = 60 * 60; break;
+        case 'd': unit = 24 * 60 * 60; break;
+        default: return false;
     }
+    double count;
+    if (!string_to_double((String){ .data = text.data, .length = text.length - 1 }, &count)) return false;
+    if (!(count * unit >= 1 && count * unit <= UINT32_MAX)) return false;
+    *seconds = (unsigned int)(count * unit);
+    return true;
+}
 
-    freeaddrinfo(res);
-
-    if (forward_fd < 0) {
-        eprintfln("Failed to connect to forwarding target %s:%s\n", output_hostname, output_port);
+// Absolute CLOCK_REALTIME time `ms` from now, which is what pthread_cond_timedwait() expects.
+struct timespec timespec_after_ms(uint64_t ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
     }
-    return forward_fd;
+    return ts;
 }
 
-ssize_t forward_message(int forward_fd, String message, bool show_recieved)
+// Sockets
+// ------------------------------------------------------------------------------------------------------- //
+
+bool send_all(int fd, String const message)
 {
-    if (show_recieved) {
-        static int recieved_count = 1;
-        printf("Recieved message: (%d)\"%.*s\"(%d)\n", recieved_count, fmt_String(message), recieved_count);
-        recieved_count++;
+    size_t total_sent = 0;
+    while (total_sent < message.length) {
+        // MSG_NOSIGNAL: a peer that went away must not kill the whole process with SIGPIPE.
+        ssize_t sent = send(fd, message.data + total_sent, message.length - total_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        total_sent += sent;
     }
+    return true;
+}
 
-    // Send the received message to the output
-    ssize_t sent = send(forward_fd, message.data, message.length, 0);
-    if (sent < 0) {
-        perror("ERROR: Forwarding message failed");
+// Returns true when the peer already closed a connection that we have not used for a while, so the next
+// send() would be silently lost instead of failing.
+bool is_connection_stale(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) <= 0) {
+        return false;
     }
-    return sent;
+    if (pfd.revents & (POLLERR | POLLHUP)) {
+        return true;
+    }
+    char byte;
+    ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
 }
 
-// Topics
+// Receive Buffer
 // ------------------------------------------------------------------------------------------------------- //
 
+// Lines read from a stream, parsed where they landed. The unparsed bytes only move to the front once the free
+// space after them runs out, instead of after every read.
 typedef struct {
-    String original;
-    String_list levels;
-    int32_t multilevel_wildcard_index; 
-} Topic;
-
-#define PRI_Topic "%.*s"
-#define fmt_Topic(topic) fmt_String((topic).original)
+    char* data;
+    size_t capacity;
+    size_t start, end; // The unparsed bytes are data[start...end].
+    size_t scanned;    // How many of them are known not to have a newline.
+    bool discarding;   // Skipping the rest of a line that didn't fit.
+} Receive_Buffer;
 
-#define topic_get_level(topic, index) list_get((topic).levels, (index))
+Receive_Buffer receive_buffer_create(size_t const capacity)
+{
+    Receive_Buffer buffer = { .data = (char*)malloc(capacity), .capacity = capacity };
+    assert(buffer.data != NULL);
+    return buffer;
+}
 
-// Fast macro to check if a level has a single level wildcard.
-#define topic_level_has_wildcard(topic, index)          \
-    (topic_get_level((topic), (index)).length > 0 &&    \
-     (*topic_get_level((topic), (index)).data == '+' || \
-      *topic_get_level((topic), (index)).data == '#'))
+void receive_buffer_destroy(Receive_Buffer* buffer)
+{
+    free(buffer->data);
+    *buffer = (Receive_Buffer){};
+}
 
-bool is_topic_valid(Topic const topic)
+// Makes room after the unparsed bytes, moving them to the front when there's none left, or dropping the line
+// they are the start of when it fills the whole buffer.
+void receive_buffer_make_room(Receive_Buffer* buffer)
 {
-    return !is_string_null(topic.original);
+    if (buffer->end == buffer->capacity) {
+        if (buffer->start == 0) {
+            if (!buffer->discarding) {
+                eprintfln("ERROR: Line longer than %zu bytes, dropping it", buffer->capacity);
+            }
+            buffer->discarding = true;
+            buffer->end = 0;
+            buffer->scanned = 0;
+        } else {
+            memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+            buffer->end -= buffer->start;
+            buffer->start = 0;
+        }
+    }
 }
 
-Topic parse_topic(String const text)
+// Returns what read() did. The lines from receive_buffer_next_line() are only valid until the next call.
+ssize_t receive_buffer_read(Receive_Buffer* buffer, int const fd)
 {
-    if (string_equals(text, str8("#"))) {
-        return (Topic){ 
-            .original = str8("#"),
-            .levels.count = 1,
-            .multilevel_wildcard_index = 0,
-        };
+    receive_buffer_make_room(buffer);
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(fd, buffer->data + buffer->end, buffer->capacity - buffer->end);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read > 0) {
+        buffer->end += bytes_read;
     }
+    return bytes_read;
+}
 
-    Topic topic = {
-        .original = string_clone(text),
-        .multilevel_wildcard_index = -1,
-    };
+// The line is a view into the buffer, without its '\n'. Returns false when no complete line is left.
+bool receive_buffer_next_line(Receive_Buffer* buffer, String* line)
+{
+    for (;;) {
+        size_t const from = buffer->start + buffer->scanned;
+        ssize_t newline = string_find_char((String){ .data = buffer->data + from, .length = buffer->end - from }, '\n');
+        if (newline < 0) {
+            buffer->scanned = buffer->end - buffer->start;
+            if (buffer->start == buffer->end) {
+                buffer->start = buffer->end = buffer->scanned = 0;
+            }
+            return false;
+        }
 
-    // It has to view the cloned string, not the one passed in.
+        *line = (String){ .data = buffer->data + buffer->start, .length = buffer->scanned + newline };
+        buffer->start += line->length + 1;
+        buffer->scanned = 0;
+        if (!buffer->discarding) return true;
+        buffer->discarding = false;
+    }
+}
+
+// IO Uring
+// ------------------------------------------------------------------------------------------------------- //
+
+// A minimal io_uring, straight on its system calls. Submissions are queued with uring_get_sqe() and go to the
+// kernel together with the next uring_submit_and_wait(), a single system call that also waits for completions.
+// Multishot receives don't have buffers of their own: the kernel picks one from a ring of provided buffers that
+// is registered once, and uring_recycle_buffer() gives it back once its bytes are used.
+
+#define URING_BUFFER_GROUP 0
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_queued;    // Tail of what's queued, the kernel's tail is what was submitted.
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    size_t rings_size;
+    size_t sqes_size;
+    // The provided buffers.
+    struct io_uring_buf_ring* buffer_ring;
+    size_t buffer_ring_size;
+    char* buffers;
+    unsigned buffer_count; // A power of two.
+    unsigned buffer_size;
+} Uring;
+
+// Whether the ring does accept and receive. The kernels that have them but not their multishot forms turn those
+// down with EINVAL, and the ones without provided buffer rings fail to register them.
+bool uring_supported(int const fd)
+{
+    size_t const size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+    assert(probe != NULL);
+    bool supported = false;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        supported = probe->last_op >= IORING_OP_RECV &&
+                    (probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+void uring_destroy(Uring* ring);
+
+bool uring_init(Uring* ring, unsigned const entries, unsigned const buffer_count, unsigned const buffer_size)
+{
+    *ring = (Uring){ .fd = -1 };
+    struct io_uring_params params = {};
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_supported(ring->fd)) {
+        errno = ENOSYS;
+        goto had_error;
+    }
+
+    // Both queues share one mapping.
+    ring->rings_size = Max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                           params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) goto had_error;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto had_error;
+
+    char* rings = (char*)ring->rings;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned*)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(rings + params.sq_off.array);
+    ring->sq_queued = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    assert((buffer_count & (buffer_count - 1)) == 0);
+    ring->buffer_count = buffer_count;
+    ring->buffer_size = buffer_size;
+    ring->buffer_ring_size = buffer_count * sizeof(struct io_uring_buf);
+    ring->buffer_ring = (struct io_uring_buf_ring*)mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED) goto had_error;
+    ring->buffers = (char*)malloc((size_t)buffer_count * buffer_size);
+    assert(ring->buffers != NULL);
+
+    struct io_uring_buf_reg registration = {
+        .ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring,
+        .ring_entries = buffer_count,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) goto had_error;
+    ring->buffer_ring->tail = 0;
+    for (unsigned i = 0; i < buffer_count; i++) {
+        struct io_uring_buf* buffer = &ring->buffer_ring->bufs[i];
+        buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)i * buffer_size);
+        buffer->len = buffer_size;
+        buffer->bid = i;
+    }
+    __atomic_store_n(&ring->buffer_ring->tail, (uint16_t)buffer_count, __ATOMIC_RELEASE);
+    return true;
+
+had_error: {
+        int const error = errno;
+        uring_destroy(ring);
+        errno = error;
+        return false;
+    }
+}
+
+void uring_destroy(Uring* ring)
+{
+    if (ring->buffer_ring != NULL && ring->buffer_ring != MAP_FAILED) munmap(ring->buffer_ring, ring->buffer_ring_size);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->rings != NULL && ring->rings != MAP_FAILED) munmap(ring->rings, ring->rings_size);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring->buffers);
+    *ring = (Uring){ .fd = -1 };
+}
+
+// Submits what's queued and waits for at least `wait_for` completions. Returns what io_uring_enter() did.
+int uring_submit_and_wait(Uring* ring, unsigned const wait_for)
+{
+    unsigned const submitted = *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+    return (int)syscall(__NR_io_uring_enter, ring->fd, ring->sq_queued - submitted, wait_for,
+            wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// A zeroed submission, queued for the next submit. Submits what's queued when the queue is full.
+struct io_uring_sqe* uring_get_sqe(Uring* ring)
+{
+    while (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_submit_and_wait(ring, 0);
+    }
+    unsigned const index = ring->sq_queued & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_queued++;
+    return sqe;
+}
+
+// The next completion, NULL when there's none. Call uring_completion_seen() once done with it.
+struct io_uring_cqe* uring_next_completion(Uring* ring)
+{
+    unsigned const head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_completion_seen(Uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prepare_multishot_accept(Uring* ring, int const fd, uint64_t const user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prepare_multishot_recv(Uring* ring, int const fd, uint64_t const user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+}
+
+// The provided buffer that a receive completion filled.
+char* uring_completion_buffer(Uring const* ring, struct io_uring_cqe const* cqe)
+{
+    assert(cqe->flags & IORING_CQE_F_BUFFER);
+    return ring->buffers + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * ring->buffer_size;
+}
+
+// Gives the buffer of a receive completion back to the kernel.
+void uring_recycle_buffer(Uring* ring, struct io_uring_cqe const* cqe)
+{
+    unsigned const id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint16_t const tail = ring->buffer_ring->tail;
+    struct io_uring_buf* buffer = &ring->buffer_ring->bufs[tail & (ring->buffer_count - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)id * ring->buffer_size);
+    buffer->len = ring->buffer_size;
+    buffer->bid = id;
+    __atomic_store_n(&ring->buffer_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// Connection Pool
+// ------------------------------------------------------------------------------------------------------- //
+
+#define ADDRESS_CACHE_TTL_MS     (60 * 1000)
+#define RECONNECT_BACKOFF_MIN_MS 100
+#define RECONNECT_BACKOFF_MAX_MS (10 * 1000)
+
+// A host:port that we send messages to. The resolved addresses are cached for ADDRESS_CACHE_TTL_MS and the
+// connection stays open between sends. When connecting fails the endpoint refuses new attempts until its
+// backoff expires, which doubles on every failure up to RECONNECT_BACKOFF_MAX_MS.
+typedef struct {
+    String host;
+    String port;
+    struct addrinfo *addresses;
+    uint64_t resolved_at_ms;
+    int fd;
+    uint32_t backoff_ms;
+    uint64_t retry_at_ms;
+    pthread_mutex_t mutex;
+} Endpoint;
+
+typedef struct {
+    Endpoint** data;
+    size_t count, capacity;
+    pthread_mutex_t mutex;
+} Connection_Pool;
+
+#define CONNECTION_POOL_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER }
+
+Endpoint* connection_pool_get(Connection_Pool* pool, const char* host, const char* port)
+{
+    String const host_string = String_from_cstr(host);
+    String const port_string = String_from_cstr(port);
+
+    pthread_mutex_lock(&pool->mutex);
+    for (size_t i = 0; i < pool->count; i++) {
+        Endpoint* endpoint = list_get(*pool, i);
+        if (string_equals(endpoint->host, host_string) && string_equals(endpoint->port, port_string)) {
+            pthread_mutex_unlock(&pool->mutex);
+            return endpoint;
+        }
+    }
+
+    Endpoint* endpoint = (Endpoint*)malloc(sizeof(*endpoint));
+    assert(endpoint != NULL);
+    *endpoint = (Endpoint){
+        .host = string_clone(host_string),
+        .port = string_clone(port_string),
+        .fd = -1,
+    };
+    pthread_mutex_init(&endpoint->mutex, NULL);
+    list_append(pool, endpoint);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return endpoint;
+}
+
+// The endpoint mutex must be held for all the endpoint_* functions below except endpoint_send().
+bool endpoint_resolve(Endpoint* endpoint)
+{
+    uint64_t const now = time_now_ms();
+    if (endpoint->addresses != NULL && now - endpoint->resolved_at_ms < ADDRESS_CACHE_TTL_MS) {
+        return true;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    int status = getaddrinfo(endpoint->host.data, endpoint->port.data, &hints, &res);
+    if (status != 0) {
+        eprintfln("ERROR: getaddrinfo %s:%s: %s", endpoint->host.data, endpoint->port.data, gai_strerror(status));
+        // A stale answer is better than none when the resolver is having a bad moment.
+        return endpoint->addresses != NULL;
+    }
+
+    if (endpoint->addresses != NULL) {
+        freeaddrinfo(endpoint->addresses);
+    }
+    endpoint->addresses = res;
+    endpoint->resolved_at_ms = now;
+    return true;
+}
+
+int endpoint_connect(Endpoint* endpoint)
+{
+    // Try each result until we connect
+    for (struct addrinfo *p = endpoint->addresses; p != NULL; p = p->ai_next) {
+        int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+            return fd;
+        }
+
+        close(fd);
+    }
+
+    // None of the cached addresses work, the host may have moved.
+    endpoint->resolved_at_ms = 0;
+    return -1;
+}
+
+void endpoint_disconnect(Endpoint* endpoint)
+{
+    if (endpoint->fd >= 0) {
+        close(endpoint->fd);
+        endpoint->fd = -1;
+    }
+}
+
+void endpoint_backoff(Endpoint* endpoint)
+{
+    if (endpoint->backoff_ms == 0) {
+        endpoint->backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+    } else {
+        endpoint->backoff_ms = Min(endpoint->backoff_ms * 2, RECONNECT_BACKOFF_MAX_MS);
+    }
+    endpoint->retry_at_ms = time_now_ms() + endpoint->backoff_ms;
+}
+
+// Connects lazily. Returns false without touching the network while the endpoint is backing off.
+bool endpoint_send(Endpoint* endpoint, String const message)
+{
+    bool sent = false;
+
+    pthread_mutex_lock(&endpoint->mutex);
+    if (endpoint->fd >= 0 && is_connection_stale(endpoint->fd)) {
+        endpoint_disconnect(endpoint);
+    }
+    // A connection that breaks mid-send gets one retry on a fresh connection. A fresh connection that breaks
+    // too backs off like a failed connect, or peers that accept and then drop us would be reconnected to in a
+    // tight loop.
+    for (int attempt = 0; attempt < 2 && !sent; attempt++) {
+        bool const fresh = endpoint->fd < 0;
+        if (fresh) {
+            if (time_now_ms() < endpoint->retry_at_ms) break;
+            if (!endpoint_resolve(endpoint) || (endpoint->fd = endpoint_connect(endpoint)) < 0) {
+                endpoint_backoff(endpoint);
+                break;
+            }
+        }
+        sent = send_all(endpoint->fd, message);
+        if (sent) {
+            endpoint->backoff_ms = 0;
+        } else {
+            endpoint_disconnect(endpoint);
+            if (fresh) {
+                endpoint_backoff(endpoint);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&endpoint->mutex);
+
+    return sent;
+}
+
+// Sleeps until the endpoint accepts connection attempts again.
+void endpoint_wait_for_retry(Endpoint* endpoint)
+{
+    pthread_mutex_lock(&endpoint->mutex);
+    uint64_t const retry_at_ms = endpoint->retry_at_ms;
+    pthread_mutex_unlock(&endpoint->mutex);
+
+    uint64_t const now = time_now_ms();
+    if (retry_at_ms > now) {
+        usleep((retry_at_ms - now) * 1000);
+    }
+}
+
+bool connection_pool_send(Connection_Pool* pool, const char* host, const char* port, String const message)
+{
+    return endpoint_send(connection_pool_get(pool, host, port), message);
+}
+
+void connection_pool_destroy(Connection_Pool* pool)
+{
+    for (size_t i = 0; i < pool->count; i++) {
+        Endpoint* endpoint = list_get(*pool, i);
+        endpoint_disconnect(endpoint);
+        if (endpoint->addresses != NULL) {
+            freeaddrinfo(endpoint->addresses);
+        }
+        string_destroy(&endpoint->host);
+        string_destroy(&endpoint->port);
+        pthread_mutex_destroy(&endpoint->mutex);
+        free(endpoint);
+    }
+    list_destroy_safely(pool);
+}
+
+// Closes the connection to host:port but keeps the cached addresses.
+void connection_pool_release(Connection_Pool* pool, const char* host, const char* port)
+{
+    Endpoint* endpoint = connection_pool_get(pool, host, port);
+    pthread_mutex_lock(&endpoint->mutex);
+    endpoint_disconnect(endpoint);
+    pthread_mutex_unlock(&endpoint->mutex);
+}
+
+// Binary Encoding
+// ------------------------------------------------------------------------------------------------------- //
+
+// Functions and not macros, they get called with byte_reader_varint() which can't be evaluated twice.
+uint64_t zigzag_encode(int64_t const x) { return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63); }
+int64_t zigzag_decode(uint64_t const x) { return (int64_t)(x >> 1) ^ -(int64_t)(x & 1); }
+
+void bytes_append(String_Builder* builder, void const* data, size_t size)
+{
+    string_builder_grow_if_needed(builder, size);
+    memcpy(builder->data + builder->count, data, size);
+    builder->count += size;
+}
+
+void varint_append(String_Builder* builder, uint64_t value)
+{
+    while (value >= 0x80) {
+        list_append(builder, (char)(value | 0x80));
+        value >>= 7;
+    }
+    list_append(builder, (char)value);
+}
+
+void f64_append(String_Builder* builder, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) {
+        list_append(builder, (char)(bits >> (8 * i)));
+    }
+}
+
+void encoded_string_append(String_Builder* builder, String const str)
+{
+    varint_append(builder, str.length);
+    bytes_append(builder, str.data, str.length);
+}
+
+// Reading past the end never crashes, it sets `failed` and returns zeroes.
+typedef struct {
+    const uint8_t* data;
+    size_t length;
+    size_t position;
+    bool failed;
+} Byte_Reader;
+
+#define Byte_Reader_from_String(str) (Byte_Reader){ .data = (const uint8_t*)(str).data, .length = (str).length }
+
+uint8_t byte_reader_u8(Byte_Reader* reader)
+{
+    if (reader->position >= reader->length) {
+        reader->failed = true;
+        return 0;
+    }
+    return reader->data[reader->position++];
+}
+
+uint64_t byte_reader_varint(Byte_Reader* reader)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = byte_reader_u8(reader);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    reader->failed = true;
+    return 0;
+}
+
+double byte_reader_f64(Byte_Reader* reader)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+        bits |= (uint64_t)byte_reader_u8(reader) << (8 * i);
+    }
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// The result is a view into the reader's data.
+String byte_reader_string(Byte_Reader* reader)
+{
+    uint64_t length = byte_reader_varint(reader);
+    if (reader->failed || length > reader->length - reader->position) {
+        reader->failed = true;
+        return (String){};
+    }
+    String result = { .data = (char*)reader->data + reader->position, .length = length };
+    reader->position += length;
+    return result;
+}
+
+// Writes bits most significant first.
+typedef struct {
+    String_Builder bytes;
+    uint8_t used_bits; // Bits already used in the last byte, 0 when a new byte is needed.
+} Bit_Writer;
+
+void bits_write(Bit_Writer* writer, uint64_t value, int bit_count)
+{
+    while (bit_count > 0) {
+        if (writer->used_bits == 0) {
+            list_append(&writer->bytes, 0);
+        }
+        int const free_bits = 8 - writer->used_bits;
+        int const taken = Min(free_bits, bit_count);
+        uint8_t const chunk = (value >> (bit_count - taken)) & ((1u << taken) - 1);
+        writer->bytes.data[writer->bytes.count - 1] |= chunk << (free_bits - taken);
+        writer->used_bits = (writer->used_bits + taken) % 8;
+        bit_count -= taken;
+    }
+}
+
+typedef struct {
+    const uint8_t* data;
+    size_t length;
+    size_t bit_position;
+    bool failed;
+} Bit_Reader;
+
+uint64_t bits_read(Bit_Reader* reader, int bit_count)
+{
+    if (reader->bit_position + bit_count > reader->length * 8) {
+        reader->failed = true;
+        return 0;
+    }
+    uint64_t value = 0;
+    while (bit_count > 0) {
+        int const available = 8 - reader->bit_position % 8;
+        int const taken = Min(available, bit_count);
+        uint8_t const byte = reader->data[reader->bit_position / 8];
+        value = (value << taken) | ((byte >> (available - taken)) & ((1u << taken) - 1));
+        reader->bit_position += taken;
+        bit_count -= taken;
+    }
+    return value;
+}
+
+// Sign extends the lowest `bit_count` bits of `value`.
+#define bits_sign_extend(value, bit_count) ((int64_t)((value) << (64 - (bit_count))) >> (64 - (bit_count)))
+
+// Metric Values
+// ------------------------------------------------------------------------------------------------------- //
+
+// Typed form of a metric value, so consumers don't need to parse "42.1% (3400 MB / 8000 MB )" again.
+// The strings are views, into the original text when parsed and into the record when decoded.
+
+typedef enum {
+    FIELD_F64 = 1,
+    FIELD_I64 = 2,
+    FIELD_TAG = 3,
+} Field_Kind;
+
+typedef struct {
+    String name;
+    uint8_t kind;
+    union {
+        double f64;
+        int64_t i64;
+        String tag;
+    };
+} Metric_Field;
+
+#define METRIC_VALUE_MAX_FIELDS 4
+
+typedef struct {
+    Metric_Field fields[METRIC_VALUE_MAX_FIELDS];
+    uint8_t count;
+} Metric_Value;
+
+void metric_value_add(Metric_Value* value, Metric_Field const field)
+{
+    if (value->count < METRIC_VALUE_MAX_FIELDS) {
+        value->fields[value->count++] = field;
+    }
+}
+
+Metric_Field const* metric_value_get(Metric_Value const* value, String const name)
+{
+    for (uint8_t i = 0; i < value->count; i++) {
+        if (string_equals(value->fields[i].name, name)) {
+            return &value->fields[i];
+        }
+    }
+    return NULL;
+}
+
+// The number every metric is compared by, which is the leading number of the text.
+bool metric_value_number(Metric_Value const* value, double* number)
+{
+    Metric_Field const* field = metric_value_get(value, str8("value"));
+    if (field == NULL || field->kind == FIELD_TAG) {
+        return false;
+    }
+    *number = field->kind == FIELD_F64 ? field->f64 : (double)field->i64;
+    return true;
+}
+
+// Returns the length of the number at the start of the text, or 0 if there isn't one.
+size_t number_prefix_length(String const text, bool* is_integer)
+{
+    size_t i = 0;
+    *is_integer = true;
+    if (i < text.length && (text.data[i] == '-' || text.data[i] == '+')) i++;
+    size_t const digits_start = i;
+    while (i < text.length && isdigit(text.data[i])) i++;
+    if (i < text.length && text.data[i] == '.') {
+        *is_integer = false;
+        i++;
+        while (i < text.length && isdigit(text.data[i])) i++;
+    }
+    if (i == digits_start || (i == digits_start + 1 && !*is_integer)) {
+        return 0;
+    }
+    if (i + 1 < text.length && (text.data[i] == 'e' || text.data[i] == 'E')) {
+        size_t j = i + 1;
+        if (j < text.length && (text.data[j] == '-' || text.data[j] == '+')) j++;
+        if (j < text.length && isdigit(text.data[j])) {
+            *is_integer = false;
+            while (j < text.length && isdigit(text.data[j])) j++;
+            i = j;
+        }
+    }
+    return i;
+}
+
+String string_trim(String str)
+{
+    while (str.length > 0 && isspace(String_get(str, 0))) { str.data++; str.length--; }
+    while (str.length > 0 && isspace(String_get_last(str))) { str.length--; }
+    return str;
+}
+
+// Splits the human formatted output of a command into its leading number, the unit right after it and the
+// details that follow. Text that doesn't start with a number is kept as a single tag.
+Metric_Value metric_value_parse(String const text)
+{
+    Metric_Value value = {};
+    String const trimmed = string_trim(text);
+
+    bool is_integer;
+    size_t const number_length = number_prefix_length(trimmed, &is_integer);
+    if (number_length == 0) {
+        metric_value_add(&value, (Metric_Field){ .name = str8("text"), .kind = FIELD_TAG, .tag = trimmed });
+        return value;
+    }
+
+    char number[64];
+    int const copied = (int)Min(number_length, sizeof(number) - 1);
+    memcpy(number, trimmed.data, copied);
+    number[copied] = '\0';
+    if (is_integer) {
+        metric_value_add(&value, (Metric_Field){ .name = str8("value"), .kind = FIELD_I64, .i64 = strtoll(number, NULL, 10) });
+    } else {
+        metric_value_add(&value, (Metric_Field){ .name = str8("value"), .kind = FIELD_F64, .f64 = strtod(number, NULL) });
+    }
+
+    String rest = { .data = trimmed.data + number_length, .length = trimmed.length - number_length };
+    size_t unit_length = 0;
+    while (unit_length < rest.length && !isspace(rest.data[unit_length]) && rest.data[unit_length] != '(') {
+        unit_length++;
+    }
+    if (unit_length > 0) {
+        String const unit = { .data = rest.data, .length = unit_length };
+        metric_value_add(&value, (Metric_Field){ .name = str8("unit"), .kind = FIELD_TAG, .tag = unit });
+    }
+
+    String const detail = string_trim((String){ .data = rest.data + unit_length, .length = rest.length - unit_length });
+    if (detail.length > 0) {
+        metric_value_add(&value, (Metric_Field){ .name = str8("detail"), .kind = FIELD_TAG, .tag = detail });
+    }
+    return value;
+}
+
+void metric_value_append(String_Builder* builder, Metric_Value const* value)
+{
+    list_append(builder, (char)value->count);
+    for (uint8_t i = 0; i < value->count; i++) {
+        Metric_Field const* field = &value->fields[i];
+        list_append(builder, (char)field->kind);
+        encoded_string_append(builder, field->name);
+        switch (field->kind) {
+            case FIELD_F64: f64_append(builder, field->f64); break;
+            case FIELD_I64: varint_append(builder, zigzag_encode(field->i64)); break;
+            case FIELD_TAG: encoded_string_append(builder, field->tag); break;
+        }
+    }
+}
+
+Metric_Value byte_reader_metric_value(Byte_Reader* reader)
+{
+    Metric_Value value = {};
+    uint8_t const count = byte_reader_u8(reader);
+    for (uint8_t i = 0; i < count && !reader->failed; i++) {
+        Metric_Field field = { .kind = byte_reader_u8(reader) };
+        field.name = byte_reader_string(reader);
+        switch (field.kind) {
+            case FIELD_F64: field.f64 = byte_reader_f64(reader); break;
+            case FIELD_I64: field.i64 = zigzag_decode(byte_reader_varint(reader)); break;
+            case FIELD_TAG: field.tag = byte_reader_string(reader); break;
+            default: reader->failed = true; break;
+        }
+        metric_value_add(&value, field);
+    }
+    return value;
+}
+
+// Renders the value back the way a person would write it: "42.1% (3400 MB / 8000 MB )".
+void metric_value_append_text(String_Builder* builder, Metric_Value const* value)
+{
+    for (uint8_t i = 0; i < value->count; i++) {
+        Metric_Field const* field = &value->fields[i];
+        if (!string_equals(field->name, str8("unit"))) {
+            if (i > 0) {
+                string_builder_appendf(builder, " ");
+            }
+            if (!string_equals(field->name, str8("value")) &&
+                !string_equals(field->name, str8("detail")) &&
+                !string_equals(field->name, str8("text"))) {
+                string_builder_appendf(builder, PRI_String "=", fmt_String(field->name));
+            }
+        }
+        switch (field->kind) {
+            case FIELD_F64: string_builder_appendf(builder, "%g", field->f64); break;
+            case FIELD_I64: string_builder_appendf(builder, "%lld", (long long)field->i64); break;
+            case FIELD_TAG: string_builder_appendf(builder, PRI_String, fmt_String(field->tag)); break;
+        }
+    }
+}
+
+// Metric Series
+// ------------------------------------------------------------------------------------------------------- //
+
+// Compression of (timestamp, number) points from the Gorilla paper. Timestamps are stored as the delta of their
+// deltas and values as the XOR with the previous value, so a metric sampled at a fixed rate that barely changes
+// takes one or two bits per point instead of a whole message.
+
+typedef struct {
+    Bit_Writer bits;
+    size_t count;
+    int64_t last_timestamp;
+    int64_t last_delta;
+    uint64_t last_value;
+    uint8_t leading, trailing; // XOR window of the last value that didn't fit the previous one.
+} Series_Encoder;
+
+typedef struct {
+    Bit_Reader bits;
+    size_t remaining;
+    size_t index;
+    int64_t last_timestamp;
+    int64_t last_delta;
+    uint64_t last_value;
+    uint8_t leading, trailing;
+} Series_Decoder;
+
+void series_append(Series_Encoder* series, int64_t timestamp, double number)
+{
+    uint64_t value;
+    memcpy(&value, &number, sizeof(value));
+
+    if (series->count == 0) {
+        bits_write(&series->bits, (uint64_t)timestamp, 64);
+        bits_write(&series->bits, value, 64);
+        series->leading = 0xff;
+    } else {
+        int64_t const delta = timestamp - series->last_timestamp;
+        int64_t const dod = delta - series->last_delta;
+        if (dod == 0) {
+            bits_write(&series->bits, 0b0, 1);
+        } else if (dod >= -64 && dod <= 63) {
+            bits_write(&series->bits, 0b10, 2);
+            bits_write(&series->bits, (uint64_t)dod, 7);
+        } else if (dod >= -256 && dod <= 255) {
+            bits_write(&series->bits, 0b110, 3);
+            bits_write(&series->bits, (uint64_t)dod, 9);
+        } else if (dod >= -2048 && dod <= 2047) {
+            bits_write(&series->bits, 0b1110, 4);
+            bits_write(&series->bits, (uint64_t)dod, 12);
+        } else {
+            bits_write(&series->bits, 0b1111, 4);
+            bits_write(&series->bits, (uint64_t)dod, 64);
+        }
+        series->last_delta = delta;
+
+        uint64_t const xor = value ^ series->last_value;
+        if (xor == 0) {
+            bits_write(&series->bits, 0b0, 1);
+        } else {
+            uint8_t const leading = Min(__builtin_clzll(xor), 31);
+            uint8_t const trailing = __builtin_ctzll(xor);
+            if (series->leading != 0xff && leading >= series->leading && trailing >= series->trailing) {
+                bits_write(&series->bits, 0b10, 2);
+                bits_write(&series->bits, xor >> series->trailing, 64 - series->leading - series->trailing);
+            } else {
+                uint8_t const meaningful = 64 - leading - trailing;
+                bits_write(&series->bits, 0b11, 2);
+                bits_write(&series->bits, leading, 5);
+                bits_write(&series->bits, meaningful - 1, 6);
+                bits_write(&series->bits, xor >> trailing, meaningful);
+                series->leading = leading;
+                series->trailing = trailing;
+            }
+        }
+    }
+
+    series->last_timestamp = timestamp;
+    series->last_value = value;
+    series->count++;
+}
+
+void series_destroy(Series_Encoder* series)
+{
+    list_destroy_safely(&series->bits.bytes);
+    *series = (Series_Encoder){};
+}
+
+Series_Decoder series_decoder_make(String const bytes, size_t count)
+{
+    return (Series_Decoder){
+        .bits = { .data = (const uint8_t*)bytes.data, .length = bytes.length },
+        .remaining = count,
+        .leading = 0xff,
+    };
+}
+
+bool series_next(Series_Decoder* series, int64_t* timestamp, double* number)
+{
+    if (series->remaining == 0 || series->bits.failed) {
+        return false;
+    }
+
+    uint64_t value;
+    if (series->index == 0) {
+        series->last_timestamp = (int64_t)bits_read(&series->bits, 64);
+        value = bits_read(&series->bits, 64);
+    } else {
+        int64_t dod;
+        if (bits_read(&series->bits, 1) == 0) {
+            dod = 0;
+        } else if (bits_read(&series->bits, 1) == 0) {
+            dod = bits_sign_extend(bits_read(&series->bits, 7), 7);
+        } else if (bits_read(&series->bits, 1) == 0) {
+            dod = bits_sign_extend(bits_read(&series->bits, 9), 9);
+        } else if (bits_read(&series->bits, 1) == 0) {
+            dod = bits_sign_extend(bits_read(&series->bits, 12), 12);
+        } else {
+            dod = (int64_t)bits_read(&series->bits, 64);
+        }
+        series->last_delta += dod;
+        series->last_timestamp += series->last_delta;
+
+        uint64_t xor = 0;
+        if (bits_read(&series->bits, 1) == 1) {
+            if (bits_read(&series->bits, 1) == 1) {
+                series->leading = bits_read(&series->bits, 5);
+                uint8_t const meaningful = bits_read(&series->bits, 6) + 1;
+                series->trailing = 64 - series->leading - meaningful;
+            }
+            int const meaningful = 64 - series->leading - series->trailing;
+            xor = bits_read(&series->bits, meaningful) << series->trailing;
+        }
+        value = series->last_value ^ xor;
+    }
+
+    if (series->bits.failed) {
+        return false;
+    }
+    series->last_value = value;
+    series->index++;
+    series->remaining--;
+    *timestamp = series->last_timestamp;
+    memcpy(number, &value, sizeof(*number));
+    return true;
+}
+
+// Conditions
+// ------------------------------------------------------------------------------------------------------- //
+
+// A test on a number such as "value > 80", "value between 70 90" or "rate >= 5". The rate is the change per
+// second since the previous value, whoever evaluates the condition has to keep track of it. The rest of the
+// subjects test the aggregate of a window instead of a single value, see aggregate_get().
+
+typedef enum {
+    SUBJECT_VALUE,
+    SUBJECT_RATE,
+    SUBJECT_COUNT,
+    SUBJECT_MIN,
+    SUBJECT_MAX,
+    SUBJECT_MEAN,
+    SUBJECT_P50,
+    SUBJECT_P90,
+    SUBJECT_P99,
+} Condition_Subject;
+
+static const char* condition_subject_names[] = {
+    [SUBJECT_VALUE] = "value",
+    [SUBJECT_RATE] = "rate",
+    [SUBJECT_COUNT] = "count",
+    [SUBJECT_MIN] = "min",
+    [SUBJECT_MAX] = "max",
+    [SUBJECT_MEAN] = "mean",
+    [SUBJECT_P50] = "p50",
+    [SUBJECT_P90] = "p90",
+    [SUBJECT_P99] = "p99",
+};
+
+#define is_aggregate_subject(subject) ((subject) >= SUBJECT_COUNT)
+
+typedef enum {
+    OP_GT,
+    OP_GE,
+    OP_LT,
+    OP_LE,
+    OP_EQ,
+    OP_NE,
+    OP_BETWEEN, // a <= x <= b
+    OP_OUTSIDE, // x < a || x > b
+} Condition_Op;
+
+static const char* condition_op_names[] = {
+    [OP_GT] = ">",
+    [OP_GE] = ">=",
+    [OP_LT] = "<",
+    [OP_LE] = "<=",
+    [OP_EQ] = "==",
+    [OP_NE] = "!=",
+    [OP_BETWEEN] = "between",
+    [OP_OUTSIDE] = "outside",
+};
+
+typedef struct {
+    uint8_t subject;
+    uint8_t op;
+    double a, b;
+} Condition;
+
+// Parses "<subject> <op> <number> [<number>]" from words[start...]. Returns how many words it took, or 0 when
+// they aren't a condition.
+size_t parse_condition(String_list const words, size_t const start, Condition* condition)
+{
+    if (start + 3 > words.count) return 0;
+
+    String const subject = list_get(words, start);
+    size_t subject_index = ArrayCount(condition_subject_names);
+    for (size_t i = 0; i < ArrayCount(condition_subject_names); i++) {
+        if (string_equals(subject, String_from_cstr(condition_subject_names[i]))) {
+            subject_index = i;
+            break;
+        }
+    }
+    if (subject_index == ArrayCount(condition_subject_names)) return 0;
+    condition->subject = subject_index;
+
+    String const op = list_get(words, start + 1);
+    size_t op_index = ArrayCount(condition_op_names);
+    for (size_t i = 0; i < ArrayCount(condition_op_names); i++) {
+        if (string_equals(op, String_from_cstr(condition_op_names[i]))) {
+            op_index = i;
+            break;
+        }
+    }
+    if (op_index == ArrayCount(condition_op_names)) return 0;
+    condition->op = op_index;
+
+    if (!string_to_double(list_get(words, start + 2), &condition->a)) return 0;
+    if (condition->op != OP_BETWEEN && condition->op != OP_OUTSIDE) {
+        return 3;
+    }
+    if (start + 4 > words.count || !string_to_double(list_get(words, start + 3), &condition->b)) return 0;
+    if (condition->a > condition->b) {
+        double const swap = condition->a;
+        condition->a = condition->b;
+        condition->b = swap;
+    }
+    return 4;
+}
+
+bool condition_holds(Condition const* condition, double const x)
+{
+    switch (condition->op) {
+        case OP_GT:      return x > condition->a;
+        case OP_GE:      return x >= condition->a;
+        case OP_LT:      return x < condition->a;
+        case OP_LE:      return x <= condition->a;
+        case OP_EQ:      return x == condition->a;
+        case OP_NE:      return x != condition->a;
+        case OP_BETWEEN: return x >= condition->a && x <= condition->b;
+        case OP_OUTSIDE: return x < condition->a || x > condition->b;
+    }
+    return false;
+}
+
+// Aggregates
+// ------------------------------------------------------------------------------------------------------- //
+
+// Count, min, max, mean and quantiles of the numbers seen in a window. The quantiles come from a sketch whose
+// bucket bounds grow geometrically: 2^SKETCH_SUBBUCKET_BITS buckets per power of two, so a quantile is within
+// about 1.6% of a number that was actually seen. Only the buckets that got numbers take memory, 8 bytes each,
+// so numbers that vary by a few percent take a few buckets. At most SKETCH_MAX_BUCKETS are kept, enough for
+// 16 powers of two (about 5 orders of magnitude) per sign: past that the two lowest get merged, which gives up
+// the accuracy of the lowest quantiles first. Sketches can be merged, so a sliding window is the merge of the
+// sketches of its panes.
+
+#define SKETCH_SUBBUCKET_BITS 5
+#define SKETCH_MAX_BUCKETS    (16 << SKETCH_SUBBUCKET_BITS)
+
+typedef struct {
+    int32_t key;
+    uint32_t count;
+} Sketch_Bucket;
+
+typedef struct {
+    Sketch_Bucket* data; // Sorted by key.
+    size_t count, capacity;
+} Sketch_Bucket_list;
+
+typedef struct {
+    Sketch_Bucket_list buckets;
+    uint64_t total;
+} Quantile_Sketch;
+
+// The exponent and the top bits of the mantissa of a positive double sort the same way the double does, so
+// they make a key that keeps the order of the numbers. Negative numbers get the negated key of their absolute
+// value. Both zeros get key 0, -0.0 would otherwise keep its sign bit and sort above everything.
+int32_t sketch_key(double const x)
+{
+    if (x == 0) return 0;
+    double const magnitude = x < 0 ? -x : x;
+    uint64_t bits;
+    memcpy(&bits, &magnitude, sizeof(bits));
+    int32_t const key = bits >> (52 - SKETCH_SUBBUCKET_BITS);
+    return x < 0 ? -key : key;
+}
+
+// The middle of the bucket of `key`.
+double sketch_key_value(int32_t const key)
+{
+    uint64_t const magnitude = key < 0 ? -(int64_t)key : key;
+    if (magnitude >= (0x7ffull << SKETCH_SUBBUCKET_BITS)) {
+        return key < 0 ? -INFINITY : INFINITY;
+    }
+    uint64_t const low_bits = magnitude << (52 - SKETCH_SUBBUCKET_BITS);
+    uint64_t const high_bits = (magnitude + 1) << (52 - SKETCH_SUBBUCKET_BITS);
+    double low, high;
+    memcpy(&low, &low_bits, sizeof(low));
+    memcpy(&high, &high_bits, sizeof(high));
+    double const middle = low + (high - low) / 2;
+    return key < 0 ? -middle : middle;
+}
+
+// Merges the lowest buckets until there are at most SKETCH_MAX_BUCKETS.
+void sketch_collapse(Quantile_Sketch* sketch)
+{
+    if (sketch->buckets.count <= SKETCH_MAX_BUCKETS) return;
+    size_t const excess = sketch->buckets.count - SKETCH_MAX_BUCKETS;
+    for (size_t i = 0; i < excess; i++) {
+        sketch->buckets.data[excess].count += sketch->buckets.data[i].count;
+    }
+    memmove(&sketch->buckets.data[0], &sketch->buckets.data[excess], SKETCH_MAX_BUCKETS * sizeof(sketch->buckets.data[0]));
+    sketch->buckets.count = SKETCH_MAX_BUCKETS;
+}
+
+void sketch_add(Quantile_Sketch* sketch, int32_t const key, uint32_t const count)
+{
+    Sketch_Bucket_list* buckets = &sketch->buckets;
+    size_t low = 0, high = buckets->count;
+    while (low < high) {
+        size_t const middle = (low + high) / 2;
+        if (buckets->data[middle].key < key) low = middle + 1;
+        else high = middle;
+    }
+    sketch->total += count;
+    if (low < buckets->count && buckets->data[low].key == key) {
+        buckets->data[low].count += count;
+        return;
+    }
+    if (low == 0 && buckets->count == SKETCH_MAX_BUCKETS) {
+        // The new number is the lowest, it goes into the lowest bucket.
+        buckets->data[0].count += count;
+        return;
+    }
+
+    list_reserve_add(buckets, 1);
+    memmove(&buckets->data[low + 1], &buckets->data[low], (buckets->count - low) * sizeof(buckets->data[0]));
+    buckets->data[low] = (Sketch_Bucket){ .key = key, .count = count };
+    buckets->count++;
+    sketch_collapse(sketch);
+}
+
+// One pass over both sketches, whatever their size.
+void sketch_merge(Quantile_Sketch* sketch, Quantile_Sketch const* other)
+{
+    if (other->buckets.count == 0) return;
+    Sketch_Bucket_list merged = {};
+    list_reserve_add(&merged, sketch->buckets.count + other->buckets.count);
+    size_t i = 0, j = 0;
+    while (i < sketch->buckets.count || j < other->buckets.count) {
+        Sketch_Bucket next;
+        if (j == other->buckets.count || (i < sketch->buckets.count && sketch->buckets.data[i].key < other->buckets.data[j].key)) {
+            next = sketch->buckets.data[i++];
+        } else if (i == sketch->buckets.count || other->buckets.data[j].key < sketch->buckets.data[i].key) {
+            next = other->buckets.data[j++];
+        } else {
+            next = sketch->buckets.data[i++];
+            next.count += other->buckets.data[j++].count;
+        }
+        merged.data[merged.count++] = next;
+    }
+    list_destroy_safely(&sketch->buckets);
+    sketch->buckets = merged;
+    sketch->total += other->total;
+    sketch_collapse(sketch);
+}
+
+// Empties the sketch and keeps its memory.
+void sketch_reset(Quantile_Sketch* sketch)
+{
+    sketch->buckets.count = 0;
+    sketch->total = 0;
+}
+
+void sketch_destroy(Quantile_Sketch* sketch)
+{
+    list_destroy_safely(&sketch->buckets);
+    sketch->total = 0;
+}
+
+// `q` goes from 0 to 1. The sketch must not be empty.
+double sketch_quantile(Quantile_Sketch const* sketch, double const q)
+{
+    double const rank = q * (sketch->total - 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < sketch->buckets.count; i++) {
+        seen += sketch->buckets.data[i].count;
+        if (seen > rank) {
+            return sketch_key_value(sketch->buckets.data[i].key);
+        }
+    }
+    return sketch_key_value(list_get_last(sketch->buckets).key);
+}
+
+typedef struct {
+    uint64_t count;
+    double sum, min, max;
+    Quantile_Sketch sketch;
+} Aggregate;
+
+typedef struct {
+    Aggregate* data;
+    size_t count, capacity;
+} Aggregate_list;
+
+void aggregate_add(Aggregate* aggregate, double const x)
+{
+    if (x != x) return; // NaN
+    if (aggregate->count == 0 || x < aggregate->min) aggregate->min = x;
+    if (aggregate->count == 0 || x > aggregate->max) aggregate->max = x;
+    aggregate->count++;
+    aggregate->sum += x;
+    sketch_add(&aggregate->sketch, sketch_key(x), 1);
+}
+
+void aggregate_merge(Aggregate* aggregate, Aggregate const* other)
+{
+    if (other->count == 0) return;
+    if (aggregate->count == 0 || other->min < aggregate->min) aggregate->min = other->min;
+    if (aggregate->count == 0 || other->max > aggregate->max) aggregate->max = other->max;
+    aggregate->count += other->count;
+    aggregate->sum += other->sum;
+    sketch_merge(&aggregate->sketch, &other->sketch);
+}
+
+void aggregate_reset(Aggregate* aggregate)
+{
+    sketch_reset(&aggregate->sketch);
+    *aggregate = (Aggregate){ .sketch = aggregate->sketch };
+}
+
+void aggregate_destroy(Aggregate* aggregate)
+{
+    sketch_destroy(&aggregate->sketch);
+    *aggregate = (Aggregate){};
+}
+
+// The middle of a bucket can fall outside of the numbers seen, so it gets clamped to them.
+double aggregate_quantile(Aggregate const* aggregate, double const q)
+{
+    double const x = sketch_quantile(&aggregate->sketch, q);
+    return Max(aggregate->min, Min(aggregate->max, x));
+}
+
+// Returns false for the subjects that aren't aggregates, and for empty aggregates.
+bool aggregate_get(Aggregate const* aggregate, Condition_Subject const subject, double* result)
+{
+    if (aggregate->count == 0) return false;
+    switch (subject) {
+        case SUBJECT_COUNT: *result = aggregate->count; return true;
+        case SUBJECT_MIN:   *result = aggregate->min; return true;
+        case SUBJECT_MAX:   *result = aggregate->max; return true;
+        case SUBJECT_MEAN:  *result = aggregate->sum / aggregate->count; return true;
+        case SUBJECT_P50:   *result = aggregate_quantile(aggregate, 0.50); return true;
+        case SUBJECT_P90:   *result = aggregate_quantile(aggregate, 0.90); return true;
+        case SUBJECT_P99:   *result = aggregate_quantile(aggregate, 0.99); return true;
+        default: return false;
+    }
+}
+
+// Histograms
+// ------------------------------------------------------------------------------------------------------- //
+
+// Counts of durations in nanoseconds, like HdrHistogram: every power of two is split into
+// 2^HISTOGRAM_SUBBUCKET_BITS linear buckets, so a percentile is within about 1.6% of a duration that was
+// actually recorded, from a nanosecond to centuries. Unlike a Quantile_Sketch it never gives up accuracy, for a
+// fixed size of about 15 KB, and merging is adding the counts.
+
+#define HISTOGRAM_SUBBUCKET_BITS 5
+#define HISTOGRAM_SUBBUCKETS     (1u << HISTOGRAM_SUBBUCKET_BITS)
+#define HISTOGRAM_BUCKET_COUNT   ((64 - HISTOGRAM_SUBBUCKET_BITS + 1) * HISTOGRAM_SUBBUCKETS)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKET_COUNT];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+// The values below HISTOGRAM_SUBBUCKETS get a bucket each, the rest share buckets with the values that have
+// the same highest HISTOGRAM_SUBBUCKET_BITS + 1 bits.
+size_t histogram_bucket(uint64_t const value)
+{
+    if (value < HISTOGRAM_SUBBUCKETS) return value;
+    int const shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUBBUCKET_BITS;
+    return (size_t)(shift + 1) * HISTOGRAM_SUBBUCKETS + ((value >> shift) - HISTOGRAM_SUBBUCKETS);
+}
+
+// The middle of the values that fall in `bucket`.
+uint64_t histogram_bucket_value(size_t const bucket)
+{
+    if (bucket < HISTOGRAM_SUBBUCKETS) return bucket;
+    int const shift = bucket / HISTOGRAM_SUBBUCKETS - 1;
+    uint64_t const low = (uint64_t)(HISTOGRAM_SUBBUCKETS + bucket % HISTOGRAM_SUBBUCKETS) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+void histogram_record(Histogram* histogram, uint64_t const value)
+{
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    histogram->max = Max(histogram->max, value);
+}
+
+void histogram_merge(Histogram* into, Histogram const* from)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->max = Max(into->max, from->max);
+}
+
+// `percentile` goes from 0 to 100. Returns 0 for an empty histogram.
+uint64_t histogram_percentile(Histogram const* histogram, double const percentile)
+{
+    if (histogram->total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100 * histogram->total);
+    if (rank >= histogram->total) rank = histogram->total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) return Min(histogram_bucket_value(i), histogram->max);
+    }
+    return histogram->max;
+}
+
+// Latency Tracing
+// ------------------------------------------------------------------------------------------------------- //
+
+// Where the time of a message goes between the publisher and the subscriber. Every stage is the time since the
+// end of the previous one, measured with the monotonic clock, except for the two that start at the publisher's
+// own timestamp, which can only use the wall clock.
+
+typedef enum {
+    TRACE_PUBLISH,     // From the publisher's timestamp until the broker read the message.
+    TRACE_PARSE,       // Read until parsed.
+    TRACE_APPEND,      // Parsed until appended to the log, waiting for the lock included.
+    TRACE_QUEUE,       // Appended until the subscription read it from the log.
+    TRACE_MATCH,       // Read until matched against the subscription.
+    TRACE_SEND,        // Matched until sent to the subscriber.
+    TRACE_BROKER,      // Read until sent, the whole time in the broker.
+    TRACE_END_TO_END,  // From the publisher's timestamp until sent.
+    TRACE_STAGE_COUNT,
+} Trace_Stage;
+
+__attribute__((unused)) static const char* trace_stage_names[] = {
+    [TRACE_PUBLISH] = "publish",
+    [TRACE_PARSE] = "parse",
+    [TRACE_APPEND] = "append",
+    [TRACE_QUEUE] = "queue",
+    [TRACE_MATCH] = "match",
+    [TRACE_SEND] = "send",
+    [TRACE_BROKER] = "broker",
+    [TRACE_END_TO_END] = "end_to_end",
+};
+
+// Every thread records into its own histograms, so recording takes no lock and no atomic read-modify-write:
+// only its thread writes them, with relaxed stores that latency_snapshot() can read at any time. The counts it
+// reads may be a few records behind, never torn.
+typedef struct Latency_Recorder {
+    Histogram stages[TRACE_STAGE_COUNT];
+    struct Latency_Recorder* next;
+} Latency_Recorder;
+
+static struct {
+    pthread_mutex_t mutex; // Guards the list and `retired`, not the histograms.
+    Latency_Recorder* recorders;
+    Histogram retired[TRACE_STAGE_COUNT]; // What the threads that are gone recorded.
+} latency_tracing = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread Latency_Recorder* thread_latency_recorder = NULL;
+
+// Records `value` into a histogram that only the calling thread writes.
+void histogram_record_relaxed(Histogram* histogram, uint64_t const value)
+{
+    uint64_t* count = &histogram->counts[histogram_bucket(value)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->total, histogram->total + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    if (value > histogram->max) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void latency_record(Trace_Stage const stage, uint64_t const ns)
+{
+    if (thread_latency_recorder == NULL) {
+        thread_latency_recorder = (Latency_Recorder*)calloc(1, sizeof(*thread_latency_recorder));
+        assert(thread_latency_recorder != NULL);
+        pthread_mutex_lock(&latency_tracing.mutex);
+        thread_latency_recorder->next = latency_tracing.recorders;
+        latency_tracing.recorders = thread_latency_recorder;
+        pthread_mutex_unlock(&latency_tracing.mutex);
+    }
+    histogram_record_relaxed(&thread_latency_recorder->stages[stage], ns);
+}
+
+// Same as latency_record() for a stage that started at `start_ns` and ends now. Clocks that went backwards
+// count as 0.
+void latency_record_since(Trace_Stage const stage, uint64_t const start_ns, uint64_t const now_ns)
+{
+    latency_record(stage, now_ns > start_ns ? now_ns - start_ns : 0);
+}
+
+// Threads that recorded anything call this before they exit, what they recorded stays in the snapshots.
+void latency_retire_thread(void)
+{
+    Latency_Recorder* recorder = thread_latency_recorder;
+    if (recorder == NULL) return;
+    pthread_mutex_lock(&latency_tracing.mutex);
+    for (Latency_Recorder** link = &latency_tracing.recorders; *link != NULL; link = &(*link)->next) {
+        if (*link == recorder) {
+            *link = recorder->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < TRACE_STAGE_COUNT; i++) {
+        histogram_merge(&latency_tracing.retired[i], &recorder->stages[i]);
+    }
+    pthread_mutex_unlock(&latency_tracing.mutex);
+    free(recorder);
+    thread_latency_recorder = NULL;
+}
+
+// Merges the histograms of every thread into `stages`, which has TRACE_STAGE_COUNT of them.
+void latency_snapshot(Histogram* stages)
+{
+    memset(stages, 0, TRACE_STAGE_COUNT * sizeof(*stages));
+    pthread_mutex_lock(&latency_tracing.mutex);
+    for (size_t i = 0; i < TRACE_STAGE_COUNT; i++) {
+        histogram_merge(&stages[i], &latency_tracing.retired[i]);
+    }
+    for (Latency_Recorder* recorder = latency_tracing.recorders; recorder != NULL; recorder = recorder->next) {
+        for (size_t i = 0; i < TRACE_STAGE_COUNT; i++) {
+            Histogram const* from = &recorder->stages[i];
+            Histogram* into = &stages[i];
+            for (size_t j = 0; j < HISTOGRAM_BUCKET_COUNT; j++) {
+                into->counts[j] += __atomic_load_n(&from->counts[j], __ATOMIC_RELAXED);
+            }
+            into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+            into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+            into->max = Max(into->max, __atomic_load_n(&from->max, __ATOMIC_RELAXED));
+        }
+    }
+    pthread_mutex_unlock(&latency_tracing.mutex);
+}
+
+// Logging
+// ------------------------------------------------------------------------------------------------------- //
+
+// Threads don't format or print what they log. log_write() copies the format string pointer and the arguments
+// into a record in a ring of the calling thread, and the thread started by log_start() formats the records of
+// every ring and prints them. Errors and warnings go to stderr, the rest to stdout. Until log_start() is called
+// log_write() prints right away instead, so the tools that don't start the logger can log too.
+//
+// Messages below the level are skipped before their arguments are evaluated, so per-message logging at
+// LOG_DEBUG costs a branch when it's off.
+
+typedef enum {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_LEVEL_COUNT,
+} Log_Level;
+
+static const char* log_level_names[] = {
+    [LOG_ERROR] = "error",
+    [LOG_WARNING] = "warning",
+    [LOG_INFO] = "info",
+    [LOG_DEBUG] = "debug",
+};
+
+static Log_Level log_level = LOG_INFO;
+
+#define log_at(level, fmt, ...) do { if ((level) <= log_level) log_write((level), fmt, ##__VA_ARGS__); } while (0)
+#define log_error(fmt, ...)   log_at(LOG_ERROR, fmt, ##__VA_ARGS__)
+#define log_warning(fmt, ...) log_at(LOG_WARNING, fmt, ##__VA_ARGS__)
+#define log_info(fmt, ...)    log_at(LOG_INFO, fmt, ##__VA_ARGS__)
+#define log_debug(fmt, ...)   log_at(LOG_DEBUG, fmt, ##__VA_ARGS__)
+
+#define LOG_RING_SIZE      (64 * 1024) // A power of two.
+#define LOG_RECORD_MAX     1024        // Longer strings in the arguments get cut.
+#define LOG_FLUSH_INTERVAL_MS 10
+
+// A record is this header and then the arguments: the integers as 64 bits, the floating point numbers as
+// doubles, and the strings as their 32 bit length and their bytes.
+typedef struct {
+    uint32_t size; // Of the whole record.
+    uint32_t level;
+    uint64_t logged_ns;
+    const char* fmt;
+} Log_Record_Header;
+
+// A formatted record, waiting to be printed in the order they were logged in.
+typedef struct {
+    uint64_t logged_ns;
+    Log_Level level;
+    size_t start, length; // In the text of the flush.
+} Log_Line;
+
+typedef struct {
+    Log_Line* data;
+    size_t count, capacity;
+} Log_Line_list;
+
+// Only its thread moves `head` and only the flusher moves `tail`, so neither takes a lock. When the ring is
+// full the record is dropped and counted.
+typedef struct Log_Ring {
+    char data[LOG_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    bool retired; // Its thread is gone, the flusher frees it once it's empty.
+    struct Log_Ring* next;
+} Log_Ring;
+
+static struct {
+    pthread_mutex_t mutex; // Guards the list, and draining the rings.
+    Log_Ring* rings;
+    bool started;
+} logging = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread Log_Ring* thread_log_ring = NULL;
+
+// A conversion of a printf format.
+typedef struct {
+    const char* start;    // The '%'.
+    const char* end;      // After the conversion character.
+    const char* length;   // The length modifier, `length_size` characters.
+    size_t length_size;
+    bool has_precision;
+    char conversion;
+} Log_Conversion;
+
+Log_Conversion log_parse_conversion(const char* p)
+{
+    Log_Conversion conversion = { .start = p };
+    p++;
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL) p++;
+    if (*p == '*') {
+        p++;
+    } else {
+        while (isdigit(*p)) p++;
+    }
+    if (*p == '.') {
+        conversion.has_precision = true;
+        p++;
+        if (*p == '*') {
+            p++;
+        } else {
+            while (isdigit(*p)) p++;
+        }
+    }
+    conversion.length = p;
+    while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) p++;
+    conversion.length_size = p - conversion.length;
+    conversion.conversion = *p;
+    if (*p != '\0') p++;
+    conversion.end = p;
+    return conversion;
+}
+
+bool log_length_is(Log_Conversion const* conversion, const char* length)
+{
+    return conversion->length_size == strlen(length) && memcmp(conversion->length, length, conversion->length_size) == 0;
+}
+
+// Copies the arguments `fmt` takes into `record` after `size` bytes, returns the new size. Stops at the first
+// argument that doesn't fit.
+size_t log_encode_arguments(char* record, size_t size, const char* fmt, va_list args)
+{
+    for (const char* p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%')) {
+        Log_Conversion const conversion = log_parse_conversion(p);
+        p = conversion.end;
+        if (size + sizeof(int64_t) > LOG_RECORD_MAX) break;
+
+        // The '*' for the width and the precision.
+        int precision = -1;
+        for (const char* c = conversion.start; c < conversion.length; c++) {
+            if (*c == '*') {
+                int64_t const star = va_arg(args, int);
+                memcpy(record + size, &star, sizeof(star));
+                size += sizeof(star);
+                precision = (int)star;
+            } else if (*c == '.' && isdigit(c[1])) {
+                precision = atoi(c + 1);
+            }
+        }
+        if (size + sizeof(int64_t) > LOG_RECORD_MAX) break;
+
+        int64_t integer;
+        double floating;
+        switch (conversion.conversion) {
+        case 'd': case 'i':
+            if (log_length_is(&conversion, "l")) integer = va_arg(args, long);
+            else if (log_length_is(&conversion, "ll") || log_length_is(&conversion, "q")) integer = va_arg(args, long long);
+            else if (log_length_is(&conversion, "z")) integer = va_arg(args, ssize_t);
+            else if (log_length_is(&conversion, "j")) integer = va_arg(args, intmax_t);
+            else if (log_length_is(&conversion, "t")) integer = va_arg(args, ptrdiff_t);
+            else integer = va_arg(args, int);
+            memcpy(record + size, &integer, sizeof(integer));
+            size += sizeof(integer);
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            if (log_length_is(&conversion, "l")) integer = va_arg(args, unsigned long);
+            else if (log_length_is(&conversion, "ll") || log_length_is(&conversion, "q")) integer = va_arg(args, unsigned long long);
+            else if (log_length_is(&conversion, "z")) integer = va_arg(args, size_t);
+            else if (log_length_is(&conversion, "j")) integer = va_arg(args, uintmax_t);
+            else if (log_length_is(&conversion, "t")) integer = va_arg(args, ptrdiff_t);
+            else integer = va_arg(args, unsigned int);
+            memcpy(record + size, &integer, sizeof(integer));
+            size += sizeof(integer);
+            break;
+        case 'c':
+            integer = va_arg(args, int);
+            memcpy(record + size, &integer, sizeof(integer));
+            size += sizeof(integer);
+            break;
+        case 'p':
+            integer = (int64_t)(uintptr_t)va_arg(args, void*);
+            memcpy(record + size, &integer, sizeof(integer));
+            size += sizeof(integer);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            floating = log_length_is(&conversion, "L") ? (double)va_arg(args, long double) : va_arg(args, double);
+            memcpy(record + size, &floating, sizeof(floating));
+            size += sizeof(floating);
+            break;
+        case 's': {
+            const char* string = va_arg(args, const char*);
+            if (string == NULL) string = "(null)";
+            uint32_t length = conversion.has_precision && precision >= 0 ? strnlen(string, precision) : strlen(string);
+            length = Min(length, LOG_RECORD_MAX - size - sizeof(length));
+            memcpy(record + size, &length, sizeof(length));
+            memcpy(record + size + sizeof(length), string, length);
+            size += sizeof(length) + length;
+        } break;
+        default:
+            // "%%", and conversions that take nothing to copy.
+            break;
+        }
+    }
+    return size;
+}
+
+bool log_take(const char** cursor, const char* end, void* into, size_t size)
+{
+    if ((size_t)(end - *cursor) < size) return false;
+    memcpy(into, *cursor, size);
+    *cursor += size;
+    return true;
+}
+
+// Formats a record with the arguments log_encode_arguments() copied. Each conversion is printed with a format
+// of its own, made from the original with the '*'s replaced by their values and the length modifier by the
+// one of the copy.
+void log_format_record(String_Builder* out, const char* fmt, const char* arguments, size_t size)
+{
+    const char* cursor = arguments;
+    const char* const end = arguments + size;
+    for (const char* p = fmt; *p != '\0';) {
+        const char* percent = strchr(p, '%');
+        size_t const literal = percent == NULL ? strlen(p) : (size_t)(percent - p);
+        string_builder_appendf(out, "%.*s", (int)literal, p);
+        p += literal;
+        if (percent == NULL) break;
+
+        Log_Conversion const conversion = log_parse_conversion(p);
+        p = conversion.end;
+        if (conversion.conversion == '%') {
+            list_append(out, '%');
+            continue;
+        }
+
+        char format[64];
+        size_t length = 0;
+        bool in_precision = false;
+        for (const char* c = conversion.start; c < conversion.length && length < sizeof(format) - 16; c++) {
+            // The strings of the record end at their length, not at a '\0'.
+            in_precision = in_precision || (*c == '.' && conversion.conversion == 's');
+            if (*c == '*') {
+                int64_t star;
+                if (!log_take(&cursor, end, &star, sizeof(star))) goto truncated;
+                if (!in_precision) length += snprintf(format + length, sizeof(format) - length, "%d", (int)star);
+            } else if (!in_precision) {
+                format[length++] = *c;
+            }
+        }
+
+        int64_t integer;
+        double floating;
+        switch (conversion.conversion) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            if (!log_take(&cursor, end, &integer, sizeof(integer))) goto truncated;
+            snprintf(format + length, sizeof(format) - length, "ll%c", conversion.conversion);
+            string_builder_appendf(out, format, (long long)integer);
+            break;
+        case 'c':
+            if (!log_take(&cursor, end, &integer, sizeof(integer))) goto truncated;
+            snprintf(format + length, sizeof(format) - length, "c");
+            string_builder_appendf(out, format, (int)integer);
+            break;
+        case 'p':
+            if (!log_take(&cursor, end, &integer, sizeof(integer))) goto truncated;
+            snprintf(format + length, sizeof(format) - length, "p");
+            string_builder_appendf(out, format, (void*)(uintptr_t)integer);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (!log_take(&cursor, end, &floating, sizeof(floating))) goto truncated;
+            snprintf(format + length, sizeof(format) - length, "%c", conversion.conversion);
+            string_builder_appendf(out, format, floating);
+            break;
+        case 's': {
+            uint32_t string_length;
+            if (!log_take(&cursor, end, &string_length, sizeof(string_length)) || (size_t)(end - cursor) < string_length) goto truncated;
+            snprintf(format + length, sizeof(format) - length, ".*s");
+            string_builder_appendf(out, format, (int)string_length, cursor);
+            cursor += string_length;
+        } break;
+        default:
+            string_builder_appendf(out, "%.*s", (int)(conversion.end - conversion.start), conversion.start);
+            break;
+        }
+    }
+    return;
+
+truncated:
+    string_builder_appendf(out, "...");
+}
+
+void log_write(Log_Level const level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_write(Log_Level const level, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if (!__atomic_load_n(&logging.started, __ATOMIC_ACQUIRE)) {
+        FILE* stream = level <= LOG_WARNING ? stderr : stdout;
+        vfprintf(stream, fmt, args);
+        fputc('\n', stream);
+        va_end(args);
+        return;
+    }
+
+    char record[LOG_RECORD_MAX];
+    Log_Record_Header header = { .level = level, .logged_ns = time_now_ns(), .fmt = fmt };
+    header.size = log_encode_arguments(record, sizeof(header), fmt, args);
+    va_end(args);
+    memcpy(record, &header, sizeof(header));
+
+    Log_Ring* ring = thread_log_ring;
+    if (ring == NULL) {
+        ring = thread_log_ring = (Log_Ring*)calloc(1, sizeof(*ring));
+        assert(ring != NULL);
+        pthread_mutex_lock(&logging.mutex);
+        ring->next = logging.rings;
+        logging.rings = ring;
+        pthread_mutex_unlock(&logging.mutex);
+    }
+
+    uint64_t const tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (ring->head - tail) < header.size) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t const start = ring->head & (LOG_RING_SIZE - 1);
+    size_t const first = Min(header.size, LOG_RING_SIZE - start);
+    memcpy(ring->data + start, record, first);
+    memcpy(ring->data, record + first, header.size - first);
+    __atomic_store_n(&ring->head, ring->head + header.size, __ATOMIC_RELEASE);
+}
+
+// Threads that logged anything call this before they exit, what they logged still gets printed.
+void log_retire_thread(void)
+{
+    if (thread_log_ring == NULL) return;
+    __atomic_store_n(&thread_log_ring->retired, true, __ATOMIC_RELEASE);
+    thread_log_ring = NULL;
+}
+
+void log_ring_read(Log_Ring const* ring, uint64_t const from, void* into, size_t const size)
+{
+    size_t const start = from & (LOG_RING_SIZE - 1);
+    size_t const first = Min(size, LOG_RING_SIZE - start);
+    memcpy(into, ring->data + start, first);
+    memcpy((char*)into + first, ring->data, size - first);
+}
+
+int log_line_compare(const void* a, const void* b)
+{
+    uint64_t const a_ns = ((Log_Line const*)a)->logged_ns;
+    uint64_t const b_ns = ((Log_Line const*)b)->logged_ns;
+    return (a_ns > b_ns) - (a_ns < b_ns);
+}
+
+// Prints what every ring has, in the order it was logged. Called by the flusher, and at exit for what it didn't
+// get to.
+void log_flush(void)
+{
+    String_Builder text = {};
+    Log_Line_list lines = {};
+    String_Builder out = {};
+    String_Builder err = {};
+    char record[LOG_RECORD_MAX];
+
+    pthread_mutex_lock(&logging.mutex);
+    for (Log_Ring** link = &logging.rings; *link != NULL;) {
+        Log_Ring* ring = *link;
+        // Read before the head, so a retired ring is only freed once everything it got is printed.
+        bool const retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+        uint64_t const head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        while (tail < head) {
+            Log_Record_Header header;
+            log_ring_read(ring, tail, &header, sizeof(header));
+            log_ring_read(ring, tail, record, header.size);
+            Log_Line line = { .logged_ns = header.logged_ns, .level = (Log_Level)header.level, .start = text.count };
+            log_format_record(&text, header.fmt, record + sizeof(header), header.size - sizeof(header));
+            line.length = text.count - line.start;
+            list_append(&lines, line);
+            tail += header.size;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t const dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            string_builder_appendf(&err, "WARNING: Dropped %llu log messages, the logger couldn't keep up\n", (unsigned long long)dropped);
+        }
+
+        if (retired) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    qsort(lines.data, lines.count, sizeof(*lines.data), log_line_compare);
+    for (size_t i = 0; i < lines.count; i++) {
+        Log_Line const* line = &list_get(lines, i);
+        string_builder_appendf(line->level <= LOG_WARNING ? &err : &out, "%.*s\n", (int)line->length, text.data + line->start);
+    }
+
+    // Printed under the lock, so what two flushes print doesn't interleave.
+    if (out.count > 0) {
+        fwrite(out.data, 1, out.count, stdout);
+        fflush(stdout);
+    }
+    if (err.count > 0) {
+        fwrite(err.data, 1, err.count, stderr);
+        fflush(stderr);
+    }
+    pthread_mutex_unlock(&logging.mutex);
+
+    list_destroy(&text);
+    list_destroy(&lines);
+    list_destroy(&out);
+    list_destroy(&err);
+}
+
+void* log_flusher(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        usleep(LOG_FLUSH_INTERVAL_MS * 1000);
+        log_flush();
+    }
+    return NULL;
+}
+
+// Starts the thread that prints what gets logged, from then on logging doesn't print in the calling thread.
+bool log_start(Log_Level const level)
+{
+    log_level = level;
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, log_flusher, NULL) != 0) {
+        eprintfln("ERROR: Failed to create the log flusher thread");
+        return false;
+    }
+    pthread_detach(flusher);
+    atexit(log_flush);
+    __atomic_store_n(&logging.started, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Parses the name of a level, returns false when it isn't one.
+bool log_level_parse(const char* name, Log_Level* level)
+{
+    for (size_t i = 0; i < LOG_LEVEL_COUNT; i++) {
+        if (strcmp(name, log_level_names[i]) == 0) {
+            *level = (Log_Level)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Topics
+// ------------------------------------------------------------------------------------------------------- //
+
+#define TOPIC_MAX_LEVELS 32
+
+typedef struct {
+    String original;
+    String_list levels;
+    // What topics_match() compares instead of the levels, filled in by topic_compile().
+    uint64_t* level_hashes;
+    uint32_t wildcard_mask; // Bit i is set when level i is a wildcard.
+    int32_t multilevel_wildcard_index; 
+} Topic;
+
+#define PRI_Topic "%.*s"
+#define fmt_Topic(topic) fmt_String((topic).original)
+
+#define topic_get_level(topic, index) list_get((topic).levels, (index))
+
+// Fast macro to check if a level has a single level wildcard.
+#define topic_level_has_wildcard(topic, index)          \
+    (topic_get_level((topic), (index)).length > 0 &&    \
+     (*topic_get_level((topic), (index)).data == '+' || \
+      *topic_get_level((topic), (index)).data == '#'))
+
+bool is_topic_valid(Topic const topic)
+{
+    return !is_string_null(topic.original);
+}
+
+// `level_hashes` has room for a hash per level and belongs to the topic from now on.
+void topic_compile(Topic* topic, uint64_t* level_hashes)
+{
+    topic->level_hashes = level_hashes;
+    topic->wildcard_mask = 0;
+    for (size_t i = 0; i < topic->levels.count; i++) {
+        level_hashes[i] = hash_string(topic_get_level(*topic, i));
+        if (topic_level_has_wildcard(*topic, i)) {
+            topic->wildcard_mask |= 1u << i;
+        }
+    }
+}
+
+Topic parse_topic(String const text)
+{
+    if (string_equals(text, str8("#"))) {
+        return (Topic){ 
+            .original = str8("#"),
+            .levels.count = 1,
+            .wildcard_mask = 1,
+            .multilevel_wildcard_index = 0,
+        };
+    }
+
+    Topic topic = {
+        .original = string_clone(text),
+        .multilevel_wildcard_index = -1,
+    };
+
+    // It has to view the cloned string, not the one passed in.
     topic.levels = string_split(topic.original, '/');
+    if (topic.levels.count > TOPIC_MAX_LEVELS) {
+        eprintfln("ERROR: Topic has more than %d levels: \"%.*s\"", TOPIC_MAX_LEVELS, fmt_String(text));
+        goto had_error;
+    }
+
+    for (size_t i = 0; i < topic.levels.count; i++) {
+        if (string_equals(list_get(topic.levels, i), str8("#"))) {
+            // Multilevel wildcard errors.
+            if (topic.multilevel_wildcard_index != -1) {
+                eprintfln("ERROR: Topic has more than one multilevel wildcard: \"%.*s\"", fmt_String(text));
+                goto had_error;
+            } else if (i != topic.levels.count - 1) {
+                eprintfln("ERROR: Topic has a multilevel wildcard that's not at the end: \"%.*s\"", fmt_String(text));
+                goto had_error;
+            }
+            // Happy path.
+            topic.multilevel_wildcard_index = i;
+        }
+    }
+
+    uint64_t* level_hashes = (uint64_t*)malloc(Max(topic.levels.count, 1) * sizeof(*level_hashes));
+    assert(level_hashes != NULL);
+    topic_compile(&topic, level_hashes);
+    return topic;
+
+had_error:
+    string_destroy(&topic.original);
+    list_destroy(&topic.levels);
+    return (Topic){};
+}
+
+void topic_destroy(Topic* topic)
+{
+    // The "#" topic is a literal, it owns nothing.
+    if (topic->levels.data != NULL) {
+        string_destroy(&topic->original);
+        list_destroy(&topic->levels);
+        free(topic->level_hashes);
+    }
+    *topic = (Topic){};
+}
+
+typedef struct {
+    Topic* data;
+    size_t count, capacity;
+} Topic_list;
+
+// A multilevel wildcard matches its parent level and everything below it. The levels are compared by their
+// hashes first, which rules out almost every pattern that doesn't match. Only the levels whose hashes are equal
+// get their bytes compared, in case the hashes collided. Like in MQTT, topics that start with '$' belong to the
+// broker and a wildcard in the first level doesn't match them, "$SYS/#" does.
+bool topics_match(Topic const a, Topic const b) {
+    bool const a_reserved = a.original.length > 0 && a.original.data[0] == '$';
+    bool const b_reserved = b.original.length > 0 && b.original.data[0] == '$';
+    if ((a_reserved && (b.wildcard_mask & 1)) || (b_reserved && (a.wildcard_mask & 1))) return false;
+
+    int32_t multilevel = a.multilevel_wildcard_index;
+    if (multilevel < 0 || (b.multilevel_wildcard_index >= 0 && b.multilevel_wildcard_index < multilevel)) {
+        multilevel = b.multilevel_wildcard_index;
+    }
+
+    size_t count;
+    if (multilevel >= 0) {
+        count = multilevel;
+        if (count > a.levels.count || count > b.levels.count) return false;
+    } else if (a.levels.count != b.levels.count) {
+        return false;
+    } else {
+        count = a.levels.count;
+    }
+
+    uint32_t const compared = ~(a.wildcard_mask | b.wildcard_mask) & (uint32_t)((1ull << count) - 1);
+    uint32_t differ = 0;
+    for (size_t i = 0; i < count; i++) {
+        differ |= (uint32_t)(a.level_hashes[i] != b.level_hashes[i]) << i;
+    }
+    if (differ & compared) return false;
+
+    for (uint32_t left = compared; left != 0; left &= left - 1) {
+        int i = __builtin_ctz(left);
+        if (!string_equals(topic_get_level(a, i), topic_get_level(b, i))) return false;
+    }
+    return true;
+}
+
+// Publishers
+// ------------------------------------------------------------------------------------------------------- //
+
+typedef struct {
+    Topic topic;
+    String value;
+    Metric_Value typed; // Views into `value`, parsed once when the message arrives.
+    time_t timestamp;
+    uint64_t published_ns; // Wall clock time the publisher gave, 0 when it didn't give one.
+    // Monotonic times of the stages a message goes through in the broker, see Latency Tracing.
+    uint64_t received_ns;
+    uint64_t appended_ns;
+} Publisher_Message;
+
+#define PRI_Publisher_Message "(topic: " PRI_Topic ", value: \"%.*s\")"
+#define fmt_Publisher_Message(msg) fmt_Topic((msg).topic), fmt_String((msg).value)
+
+typedef struct {
+    Publisher_Message* data;
+    size_t count, capacity;
+} Publisher_Message_list;
+
+// Splits a line rendered with PRI_Publisher_Message back into its topic and value.
+bool parse_delivery_line(String const line, String* topic, String* value)
+{
+    String const topic_prefix = str8("(topic: ");
+    String const value_prefix = str8(", value: \"");
+    String const suffix = str8("\")");
+    if (line.length < topic_prefix.length + value_prefix.length + suffix.length ||
+        !string_equals((String){ .data = line.data, .length = topic_prefix.length }, topic_prefix) ||
+        !string_equals((String){ .data = line.data + line.length - suffix.length, .length = suffix.length }, suffix)) {
+        return false;
+    }
+
+    String const inner = {
+        .data = line.data + topic_prefix.length,
+        .length = line.length - topic_prefix.length - suffix.length,
+    };
+    ssize_t const separator = string_find_substr(inner, value_prefix);
+    if (separator < 0) {
+        return false;
+    }
+    *topic = (String){ .data = inner.data, .length = separator };
+    *value = (String){ .data = inner.data + separator + value_prefix.length, .length = inner.length - separator - value_prefix.length };
+    return true;
+}
+
+bool is_publisher_message_valid(Publisher_Message const msg)
+{
+    return !is_string_null(msg.topic.original);
+}
+
+// Milliseconds since the epoch, from the publisher's time when it gave one and whole seconds otherwise.
+uint64_t publisher_message_time_ms(Publisher_Message const* message)
+{
+    return message->published_ns != 0 ? message->published_ns / 1000000 : (uint64_t)message->timestamp * 1000;
+}
+
+// A publisher message parsed in place, its strings are views into the received line. Nothing gets allocated
+// until publisher_message_from_view() copies it.
+typedef struct {
+    String topic;
+    String value;
+    uint64_t published_ns;
+    uint16_t level_ends[TOPIC_MAX_LEVELS]; // Where each level ends in `topic`, the next one starts after the '/'.
+    uint8_t level_count;
+    int8_t multilevel_wildcard_index;
+} Publisher_Message_View;
+
+String view_get_level(Publisher_Message_View const* view, size_t const index)
+{
+    size_t const start = index == 0 ? 0 : view->level_ends[index - 1] + 1u;
+    return (String){ .data = view->topic.data + start, .length = view->level_ends[index] - start };
+}
+
+// Format: "topic|value" with an optional "|<ns>" at the end, the wall clock time the publisher sent it at in
+// nanoseconds since the epoch. Accepts the same lines as splitting on '|' and '/' with string_split() did, quirks
+// included: a delimiter at the very end stays in the last part.
+bool parse_publisher_message_view(String const text, Publisher_Message_View* view)
+{
+    *view = (Publisher_Message_View){ .multilevel_wildcard_index = -1 };
+
+    ssize_t const bar = string_find_char(text, '|');
+    String value = { .data = text.data + bar + 1, .length = text.length - bar - 1 };
+    ssize_t const second_bar = bar < 0 ? -1 : string_find_char(value, '|');
+    if (second_bar >= 0 && (size_t)second_bar != value.length - 1) {
+        String const published = { .data = value.data + second_bar + 1, .length = value.length - second_bar - 1 };
+        for (size_t i = 0; i < published.length && view->published_ns != UINT64_MAX; i++) {
+            char const c = String_get(published, i);
+            view->published_ns = isdigit(c) ? view->published_ns * 10 + (c - '0') : UINT64_MAX;
+        }
+        value.length = second_bar;
+    }
+    if (bar < 0 || value.length == 0 || view->published_ns == UINT64_MAX) {
+        eprintfln("ERROR: Publisher message isn't \"topic|value\" or \"topic|value|<ns>\": \"%.*s\"", fmt_String(text));
+        return false;
+    }
+    view->topic = (String){ .data = text.data, .length = bar };
+    view->value = value;
+    if (view->topic.length == 0 || view->topic.length > UINT16_MAX) {
+        eprintfln("ERROR: Publisher message has a topic of %zu bytes: \"%.*s\"", view->topic.length, fmt_String(text));
+        return false;
+    }
+
+    size_t start = 0;
+    while (start < view->topic.length) {
+        if (view->level_count == TOPIC_MAX_LEVELS) {
+            eprintfln("ERROR: Topic has more than %d levels: \"%.*s\"", TOPIC_MAX_LEVELS, fmt_String(view->topic));
+            return false;
+        }
+        String const rest = { .data = view->topic.data + start, .length = view->topic.length - start };
+        ssize_t slash = string_find_char(rest, '/');
+        size_t const end = (slash < 0 || (size_t)slash == rest.length - 1) ? view->topic.length : start + slash;
+        view->level_ends[view->level_count++] = end;
+        start = end + 1;
+    }
+
+    for (size_t i = 0; i < view->level_count; i++) {
+        if (!string_equals(view_get_level(view, i), str8("#"))) continue;
+        // Multilevel wildcard errors.
+        if (view->multilevel_wildcard_index != -1) {
+            eprintfln("ERROR: Topic has more than one multilevel wildcard: \"%.*s\"", fmt_String(view->topic));
+            return false;
+        } else if (i != view->level_count - 1u) {
+            eprintfln("ERROR: Topic has a multilevel wildcard that's not at the end: \"%.*s\"", fmt_String(view->topic));
+            return false;
+        }
+        view->multilevel_wildcard_index = i;
+    }
+    return true;
+}
+
+// The only copy of a message. It is a single block: the levels, their hashes, then the topic and the value, both
+// ending in a '\0'. Free it with publisher_message_destroy() and not topic_destroy().
+Publisher_Message publisher_message_from_view(Publisher_Message_View const* view)
+{
+    size_t const levels_size = view->level_count * (sizeof(String) + sizeof(uint64_t));
+    char* block = (char*)malloc(levels_size + view->topic.length + 1 + view->value.length + 1);
+    assert(block != NULL);
+
+    char* topic = block + levels_size;
+    memcpy(topic, view->topic.data, view->topic.length);
+    topic[view->topic.length] = '\0';
+    char* value = topic + view->topic.length + 1;
+    memcpy(value, view->value.data, view->value.length);
+    value[view->value.length] = '\0';
+
+    String* levels = (String*)block;
+    for (size_t i = 0; i < view->level_count; i++) {
+        levels[i] = view_get_level(view, i);
+        levels[i].data = topic + (levels[i].data - view->topic.data);
+    }
+
+    Publisher_Message message = {
+        .topic = {
+            .original = { .data = topic, .length = view->topic.length },
+            .levels = { .data = levels, .count = view->level_count, .capacity = view->level_count },
+            .multilevel_wildcard_index = view->multilevel_wildcard_index,
+        },
+        .value = { .data = value, .length = view->value.length },
+        .timestamp = time(NULL),
+        .published_ns = view->published_ns,
+    };
+    topic_compile(&message.topic, (uint64_t*)(levels + view->level_count));
+    message.typed = metric_value_parse(message.value);
+    return message;
+}
+
+Publisher_Message parse_publisher_message(String const text)
+{
+    Publisher_Message_View view;
+    if (!parse_publisher_message_view(text, &view)) return (Publisher_Message){};
+    return publisher_message_from_view(&view);
+}
+
+void publisher_message_destroy(Publisher_Message* message)
+{
+    free(message->topic.levels.data);
+    *message = (Publisher_Message){};
+}
+
+// Message Log
+// ------------------------------------------------------------------------------------------------------- //
+
+// Messages are addressed by their offset, the position they were appended at, which never changes. They are
+// kept in fixed size segments, so readers can resume from any offset still in the log without copying the rest
+// of it, and trimming the oldest messages frees whole segments instead of moving every message down.
+//
+// A segment that was compacted (see Log Compaction) only keeps some of its messages. It still covers the same
+// LOG_SEGMENT_SIZE offsets, so finding the segment of an offset stays a division, but the offsets in it have
+// gaps that readers skip.
+//
+// The log doesn't lock, whoever shares it does. Range queries read segments without the lock, so while the log
+// is pinned the segments that trimming or compaction replace are only retired, and freed once it isn't.
+// Readers also use the messages they copied after they unlocked, so the segments that were trimmed keep their
+// messages until message_log_release() is told that no reader is before them.
+
+#define LOG_SEGMENT_SIZE 1024
+
+typedef struct {
+    uint64_t offset;        // The offset of its first message.
+    uint32_t count;         // Messages in the segment.
+    uint16_t* indices;      // NULL until it's compacted, then where each message is in the segment, in order.
+    time_t oldest, newest;  // The range of the timestamps of its messages, which range queries skip segments by.
+    Publisher_Message messages[];
+} Log_Segment;
+
+typedef struct {
+    Log_Segment** data;
+    size_t count, capacity;
+} Log_Segment_list;
+
+typedef struct {
+    Log_Segment_list segments;
+    uint64_t first_segment_offset; // Offset of the first message of the first segment.
+    uint64_t base_offset;          // The oldest message still in the log.
+    uint64_t next_offset;          // The offset of the next message appended.
+    size_t pins;                   // Range queries reading segments without the lock.
+    Log_Segment_list retired;      // Segments replaced while pinned.
+    Log_Segment_list trimmed;      // Segments trimmed whose messages weren't freed yet.
+} Message_Log;
+
+void message_log_free_segment(Message_Log* log, Log_Segment* segment)
+{
+    if (log->pins > 0) {
+        list_append(&log->retired, segment);
+    } else {
+        free(segment);
+    }
+}
+
+void message_log_pin(Message_Log* log)
+{
+    log->pins++;
+}
+
+void message_log_unpin(Message_Log* log)
+{
+    assert(log->pins > 0);
+    if (--log->pins > 0) return;
+    for (size_t i = 0; i < log->retired.count; i++) {
+        free(list_get(log->retired, i));
+    }
+    log->retired.count = 0;
+}
+
+uint64_t message_log_append(Message_Log* log, Publisher_Message const message)
+{
+    size_t const index = log->next_offset - log->first_segment_offset;
+    if (index == log->segments.count * LOG_SEGMENT_SIZE) {
+        Log_Segment* segment = (Log_Segment*)malloc(sizeof(*segment) + LOG_SEGMENT_SIZE * sizeof(Publisher_Message));
+        assert(segment != NULL);
+        *segment = (Log_Segment){ .offset = log->next_offset };
+        list_append(&log->segments, segment);
+    }
+    Log_Segment* segment = list_get(log->segments, index / LOG_SEGMENT_SIZE);
+    if (segment->count == 0 || message.timestamp < segment->oldest) segment->oldest = message.timestamp;
+    if (segment->count == 0 || message.timestamp > segment->newest) segment->newest = message.timestamp;
+    segment->messages[segment->count++] = message;
+    return log->next_offset++;
+}
+
+// Where the message at `index` in the segment is, or would be, in its messages.
+size_t log_segment_lower_bound(Log_Segment const* segment, size_t const index)
+{
+    if (segment->indices == NULL) {
+        return Min(index, segment->count);
+    }
+    size_t low = 0, high = segment->count;
+    while (low < high) {
+        size_t const middle = low + (high - low) / 2;
+        if (segment->indices[middle] < index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
 
-    for (size_t i = 0; i < topic.levels.count; i++) {
-        if (string_equals(list_get(topic.levels, i), str8("#"))) {
-            // Multilevel wildcard errors.
-            if (topic.multilevel_wildcard_index != -1) {
-                eprintfln("ERROR: Topic has more than one multilevel wildcard: \"%.*s\"", fmt_String(text));
-                goto had_error;
-            } else if (i != topic.levels.count - 1) {
-                eprintfln("ERROR: Topic has a multilevel wildcard that's not at the end: \"%.*s\"", fmt_String(text));
-                goto had_error;
+size_t log_segment_index(Log_Segment const* segment, size_t const position)
+{
+    return segment->indices == NULL ? position : segment->indices[position];
+}
+
+// Returns NULL when the message was trimmed, compacted or doesn't exist yet.
+Publisher_Message const* message_log_get(Message_Log const* log, uint64_t const offset)
+{
+    if (offset < log->base_offset || offset >= log->next_offset) {
+        return NULL;
+    }
+    size_t const index = offset - log->first_segment_offset;
+    Log_Segment const* segment = list_get(log->segments, index / LOG_SEGMENT_SIZE);
+    size_t const position = log_segment_lower_bound(segment, index % LOG_SEGMENT_SIZE);
+    if (position == segment->count || log_segment_index(segment, position) != index % LOG_SEGMENT_SIZE) {
+        return NULL;
+    }
+    return &segment->messages[position];
+}
+
+// Copies up to `max_count` messages starting at `offset` and returns how many. `next_offset` gets the offset to
+// read from next, which is further than `offset` plus the count when messages were compacted. The copies share
+// their strings with the log.
+size_t message_log_read(Message_Log const* log, uint64_t const offset, Publisher_Message* messages, size_t const max_count,
+        uint64_t* next_offset)
+{
+    *next_offset = offset;
+    if (offset < log->base_offset || offset >= log->next_offset) {
+        return 0;
+    }
+    size_t count = 0;
+    while (count < max_count && *next_offset < log->next_offset) {
+        size_t const index = *next_offset - log->first_segment_offset;
+        uint64_t const segment_offset = *next_offset - index % LOG_SEGMENT_SIZE;
+        Log_Segment const* segment = list_get(log->segments, index / LOG_SEGMENT_SIZE);
+        size_t const position = log_segment_lower_bound(segment, index % LOG_SEGMENT_SIZE);
+        size_t const copied = Min(max_count - count, segment->count - position);
+        memcpy(&messages[count], &segment->messages[position], copied * sizeof(*messages));
+        count += copied;
+        if (position + copied < segment->count) {
+            *next_offset = segment_offset + log_segment_index(segment, position + copied);
+        } else {
+            *next_offset = Min(segment_offset + LOG_SEGMENT_SIZE, log->next_offset);
+        }
+    }
+    return count;
+}
+
+// Drops the messages before `offset`. They are freed by message_log_release(), readers may still hold copies.
+void message_log_trim(Message_Log* log, uint64_t offset)
+{
+    offset = Min(offset, log->next_offset);
+    if (offset <= log->base_offset) return;
+    log->base_offset = offset;
+
+    size_t const dropped = (offset - log->first_segment_offset) / LOG_SEGMENT_SIZE;
+    if (dropped == 0) return;
+    for (size_t i = 0; i < dropped; i++) {
+        list_append(&log->trimmed, list_get(log->segments, i));
+    }
+    memmove(log->segments.data, log->segments.data + dropped, (log->segments.count - dropped) * sizeof(*log->segments.data));
+    log->segments.count -= dropped;
+    log->first_segment_offset += dropped * LOG_SEGMENT_SIZE;
+}
+
+// Frees the messages of the trimmed segments before `oldest_read`, the oldest offset a reader may still hold a
+// copy of. Range queries may hold copies of any of them, so none are freed while the log is pinned.
+void message_log_release(Message_Log* log, uint64_t const oldest_read)
+{
+    if (log->pins > 0) return;
+    size_t kept = 0;
+    for (size_t i = 0; i < log->trimmed.count; i++) {
+        Log_Segment* segment = list_get(log->trimmed, i);
+        if (segment->offset + LOG_SEGMENT_SIZE <= oldest_read) {
+            for (size_t j = 0; j < segment->count; j++) {
+                publisher_message_destroy(&segment->messages[j]);
             }
-            // Happy path.
-            topic.multilevel_wildcard_index = i;
+            free(segment);
+        } else {
+            list_get(log->trimmed, kept++) = segment;
         }
     }
+    log->trimmed.count = kept;
+}
 
-    return topic;
+// Log Compaction
+// ------------------------------------------------------------------------------------------------------- //
 
-had_error:
-    string_destroy(&topic.original);
-    list_destroy(&topic.levels);
-    return (Topic){};
+// For topics that carry a state rather than events, only their newest value matters. The compactor rewrites
+// the full segments of the log so they keep only the newest message of each of those topics. It works a bounded
+// number of messages per call, so whoever holds the lock around it doesn't hold it for long:
+//  - log_compactor_scan() goes through the messages appended since it last did and remembers the offset of the
+//    newest message of every topic that matches one of the patterns.
+//  - log_compactor_compact() rewrites the segments that are entirely scanned, one after the other, and starts
+//    over from the oldest one once it reached the newest.
+// Readers copy messages out of the log and use them after they unlocked it, so the strings of the messages that
+// were dropped are only freed by log_compactor_release() once no reader can be before them.
+
+typedef struct {
+    String topic;    // Owned.
+    uint64_t newest; // The offset of its newest message.
+} Compaction_Key;
+
+typedef struct {
+    Compaction_Key* data;
+    size_t count, capacity;
+} Compaction_Key_list;
+
+typedef struct {
+    uint64_t offset;
+    Publisher_Message message;
+} Dropped_Message;
+
+typedef struct {
+    Dropped_Message* data;
+    size_t count, capacity;
+} Dropped_Message_list;
+
+typedef struct {
+    Topic_list patterns; // The topics that get compacted.
+    Compaction_Key_list keys;
+    Hash_Index keys_index;
+    uint64_t scanned_offset;      // Every message before it was scanned.
+    uint64_t cursor;              // The first offset of the next segment to compact.
+    Dropped_Message_list dropped; // Those not freed yet.
+    uint64_t compacted;           // Messages dropped so far.
+} Log_Compactor;
+
+Compaction_Key* log_compactor_find_key(Log_Compactor* compactor, String const topic, uint64_t const hash)
+{
+    size_t probe = 0;
+    for (uint32_t i; (i = hash_index_next(&compactor->keys_index, hash, &probe)) != HASH_INDEX_EMPTY;) {
+        if (string_equals(list_get(compactor->keys, i).topic, topic)) {
+            return &list_get(compactor->keys, i);
+        }
+    }
+    return NULL;
 }
 
-bool topics_match(Topic const a, Topic const b) {
-    size_t smaller_count = Min(a.levels.count, b.levels.count);
-    bool a_has_multilevel = a.multilevel_wildcard_index >= 0;
-    bool b_has_multilevel = b.multilevel_wildcard_index >= 0;
-
-    size_t ignore_from;
-    if (a_has_multilevel && b_has_multilevel) {
-        ignore_from = Min(a.multilevel_wildcard_index, b.multilevel_wildcard_index);
-        assert(ignore_from == smaller_count - 1);
-    } else if (a_has_multilevel) {
-        ignore_from = a.multilevel_wildcard_index;
-        assert(ignore_from == smaller_count - 1);
-    } else if (b_has_multilevel) {
-        ignore_from = b.multilevel_wildcard_index;
-        assert(ignore_from == smaller_count - 1);
-    } else if (a.levels.count != b.levels.count) {
-        return false;
-    } else {
-        ignore_from = smaller_count;
+// Scans up to `max_count` messages and returns how many.
+size_t log_compactor_scan(Log_Compactor* compactor, Message_Log const* log, size_t const max_count)
+{
+    compactor->scanned_offset = Max(compactor->scanned_offset, log->base_offset);
+    size_t scanned = 0;
+    for (; scanned < max_count && compactor->scanned_offset < log->next_offset; scanned++, compactor->scanned_offset++) {
+        // The newer messages were never compacted, so the ones not there were trimmed.
+        Publisher_Message const* message = message_log_get(log, compactor->scanned_offset);
+        if (message == NULL) continue;
+
+        uint64_t const hash = hash_string(message->topic.original);
+        Compaction_Key* key = log_compactor_find_key(compactor, message->topic.original, hash);
+        if (key != NULL) {
+            key->newest = compactor->scanned_offset;
+            continue;
+        }
+        for (size_t i = 0; i < compactor->patterns.count; i++) {
+            if (topics_match(list_get(compactor->patterns, i), message->topic)) {
+                list_append(&compactor->keys, ((Compaction_Key){
+                    .topic = string_clone(message->topic.original),
+                    .newest = compactor->scanned_offset,
+                }));
+                hash_index_insert(&compactor->keys_index, hash, compactor->keys.count - 1);
+                break;
+            }
+        }
     }
+    return scanned;
+}
 
-    for (size_t i = 0; i < ignore_from; i++) {
-        bool ignore = topic_level_has_wildcard(a, i) ||
-                      topic_level_has_wildcard(b, i);
-        if (!ignore && !string_equals(topic_get_level(a, i), topic_get_level(b, i))) {
-            return false;
+// Whether the message at `offset` has a newer one on its topic that replaces it.
+bool log_compactor_replaced(Log_Compactor* compactor, Message_Log const* log, uint64_t const offset, Publisher_Message const* message)
+{
+    // The trimmed messages stay in their segment until the whole segment is.
+    if (offset < log->base_offset) return false;
+    String const topic = message->topic.original;
+    Compaction_Key const* key = log_compactor_find_key(compactor, topic, hash_string(topic));
+    return key != NULL && key->newest != offset;
+}
+
+// Compacts segments until it went through `max_count` messages and returns how many it dropped.
+size_t log_compactor_compact(Log_Compactor* compactor, Message_Log* log, size_t const max_count)
+{
+    size_t dropped = 0;
+    size_t examined = 0;
+    while (examined < max_count) {
+        compactor->cursor = Max(compactor->cursor, log->first_segment_offset);
+        if (compactor->cursor + LOG_SEGMENT_SIZE > Min(compactor->scanned_offset, log->next_offset)) {
+            compactor->cursor = log->first_segment_offset;
+            break;
+        }
+        uint64_t const segment_offset = compactor->cursor;
+        compactor->cursor += LOG_SEGMENT_SIZE;
+        size_t const segment_index = (segment_offset - log->first_segment_offset) / LOG_SEGMENT_SIZE;
+        Log_Segment* segment = list_get(log->segments, segment_index);
+        examined += segment->count;
+
+        size_t replaced = 0;
+        for (size_t i = 0; i < segment->count; i++) {
+            uint64_t const offset = segment_offset + log_segment_index(segment, i);
+            replaced += log_compactor_replaced(compactor, log, offset, &segment->messages[i]);
         }
+        if (replaced == 0) continue;
+
+        // The indices go right after the messages.
+        size_t const kept = segment->count - replaced;
+        Log_Segment* compacted = (Log_Segment*)malloc(sizeof(*compacted) + kept * (sizeof(Publisher_Message) + sizeof(uint16_t)));
+        assert(compacted != NULL);
+        *compacted = (Log_Segment){
+            .offset = segment->offset,
+            .indices = (uint16_t*)&compacted->messages[kept],
+            .oldest = segment->oldest,
+            .newest = segment->newest,
+        };
+        for (size_t i = 0; i < segment->count; i++) {
+            uint16_t const index = (uint16_t)log_segment_index(segment, i);
+            Publisher_Message const* message = &segment->messages[i];
+            if (log_compactor_replaced(compactor, log, segment_offset + index, message)) {
+                list_append(&compactor->dropped, ((Dropped_Message){ .offset = segment_offset + index, .message = *message }));
+            } else {
+                compacted->indices[compacted->count] = index;
+                compacted->messages[compacted->count++] = *message;
+            }
+        }
+        message_log_free_segment(log, segment);
+        log->segments.data[segment_index] = compacted;
+        dropped += replaced;
     }
-    return true;
+    compactor->compacted += dropped;
+    return dropped;
 }
 
-// Publishers
+// Frees the dropped messages before `oldest_read`, the oldest offset a reader may still hold a copy of. Range
+// queries may hold copies of any of them, so none are freed while the log is pinned.
+void log_compactor_release(Log_Compactor* compactor, Message_Log const* log, uint64_t const oldest_read)
+{
+    if (log->pins > 0) return;
+    size_t kept = 0;
+    for (size_t i = 0; i < compactor->dropped.count; i++) {
+        Dropped_Message* dropped = &list_get(compactor->dropped, i);
+        if (dropped->offset < oldest_read) {
+            publisher_message_destroy(&dropped->message);
+        } else {
+            list_get(compactor->dropped, kept++) = *dropped;
+        }
+    }
+    compactor->dropped.count = kept;
+}
+
+// Rollups
 // ------------------------------------------------------------------------------------------------------- //
 
+// Numeric topics can be kept for longer than the raw messages at a coarser resolution. Each tier sums every
+// numeric topic up over buckets of `interval` seconds, and keeps a message per bucket for `retention` seconds:
+// its mean as the value, and the min, max and count as fields. Only the finest tier sees the raw messages,
+// every bucket it closes is added to the next tier, and so on, so ingest costs the same however many tiers
+// there are. A bucket closes when a message of the next bucket arrives, or when rollup_tiers_close() is called
+// after it ended.
+
 typedef struct {
-    Topic topic;
-    String value;
-    time_t timestamp;
-} Publisher_Message;
+    String topic; // Owned.
+    time_t bucket_start;
+    uint64_t count; // 0 when no bucket is open.
+    double sum, min, max;
+} Rollup_Series;
 
-#define PRI_Publisher_Message "(topic: " PRI_Topic ", value: \"%.*s\")"
-#define fmt_Publisher_Message(msg) fmt_Topic((msg).topic), fmt_String((msg).value)
+typedef struct {
+    Rollup_Series* data;
+    size_t count, capacity;
+} Rollup_Series_list;
 
 typedef struct {
-    Publisher_Message* data;
+    unsigned int interval;  // Seconds per bucket.
+    unsigned int retention; // Seconds a bucket is kept after it started.
+    Rollup_Series_list series;
+    Hash_Index series_index;
+    Message_Log log;        // A message per closed bucket, in the order they closed.
+} Rollup_Tier;
+
+typedef struct {
+    Rollup_Tier* data;
     size_t count, capacity;
-} Publisher_Message_list;
+} Rollup_Tier_list;
+
+// Parses "<interval>:<retention>", like "1m:1d".
+bool parse_rollup_tier(String const text, Rollup_Tier* tier)
+{
+    *tier = (Rollup_Tier){};
+    ssize_t const colon = string_find_char(text, ':');
+    if (colon < 0) return false;
+    return parse_duration((String){ .data = text.data, .length = colon }, &tier->interval) &&
+           parse_duration((String){ .data = text.data + colon + 1, .length = text.length - colon - 1 }, &tier->retention);
+}
+
+// The message of a closed bucket, at the time the bucket started.
+Publisher_Message rollup_series_message(Rollup_Series const* series)
+{
+    String_Builder line = {};
+    double const mean = series->sum / series->count;
+    string_builder_appendf(&line, PRI_String "|%g (min %g, max %g, count %llu)", fmt_String(series->topic),
+            mean, series->min, series->max, (unsigned long long)series->count);
+    Publisher_Message message = parse_publisher_message(String_from_builder(line));
+    list_destroy(&line);
+
+    message.timestamp = series->bucket_start;
+    message.typed = (Metric_Value){};
+    metric_value_add(&message.typed, (Metric_Field){ .name = str8("value"), .kind = FIELD_F64, .f64 = mean });
+    metric_value_add(&message.typed, (Metric_Field){ .name = str8("min"), .kind = FIELD_F64, .f64 = series->min });
+    metric_value_add(&message.typed, (Metric_Field){ .name = str8("max"), .kind = FIELD_F64, .f64 = series->max });
+    metric_value_add(&message.typed, (Metric_Field){ .name = str8("count"), .kind = FIELD_I64, .i64 = (int64_t)series->count });
+    return message;
+}
+
+void rollup_tiers_add(Rollup_Tier_list* tiers, size_t const tier_index, String const topic, time_t const timestamp,
+        uint64_t const count, double const sum, double const min, double const max);
 
-Publisher_Message_list get_messages_snapshot(Publisher_Message_list const messages, pthread_mutex_t* mutex)
+// Appends the message of the open bucket to the tier and adds the bucket to the next tier.
+void rollup_tiers_close_bucket(Rollup_Tier_list* tiers, size_t const tier_index, Rollup_Series* series)
 {
-    Publisher_Message_list snapshot = {};
+    Rollup_Tier* tier = &list_get(*tiers, tier_index);
+    Publisher_Message const message = rollup_series_message(series);
+    if (message.topic.levels.count > 0) {
+        message_log_append(&tier->log, message);
+    }
+    if (tier_index + 1 < tiers->count) {
+        rollup_tiers_add(tiers, tier_index + 1, series->topic, series->bucket_start, series->count, series->sum, series->min, series->max);
+    }
+    series->count = 0;
+}
 
-    pthread_mutex_lock(mutex);
-    snapshot.count = messages.count;
-    if (snapshot.count > 0) {
-        snapshot.capacity = snapshot.count;
-        snapshot.data = (Publisher_Message*)malloc(snapshot.count * sizeof(*snapshot.data));
-        assert(snapshot.data != NULL);
-        for (size_t i = 0; i < snapshot.count; i++) {
-            list_set(snapshot, i, list_get(messages, i));
+// Adds `count` numbers that summed to `sum` to the bucket of `timestamp` in the tier.
+void rollup_tiers_add(Rollup_Tier_list* tiers, size_t const tier_index, String const topic, time_t const timestamp,
+        uint64_t const count, double const sum, double const min, double const max)
+{
+    Rollup_Tier* tier = &list_get(*tiers, tier_index);
+    uint64_t const hash = hash_string(topic);
+    Rollup_Series* series = NULL;
+    size_t probe = 0;
+    for (uint32_t i; (i = hash_index_next(&tier->series_index, hash, &probe)) != HASH_INDEX_EMPTY;) {
+        if (string_equals(list_get(tier->series, i).topic, topic)) {
+            series = &list_get(tier->series, i);
+            break;
         }
     }
-    pthread_mutex_unlock(mutex);
+    if (series == NULL) {
+        list_append(&tier->series, ((Rollup_Series){ .topic = string_clone(topic) }));
+        hash_index_insert(&tier->series_index, hash, tier->series.count - 1);
+        series = &list_get_last(tier->series);
+    }
 
-    return snapshot;
+    time_t const bucket_start = timestamp - timestamp % tier->interval;
+    // Late numbers go to the open bucket rather than reopening one that closed.
+    if (series->count > 0 && bucket_start > series->bucket_start) {
+        rollup_tiers_close_bucket(tiers, tier_index, series);
+    }
+    if (series->count == 0) {
+        *series = (Rollup_Series){ .topic = series->topic, .bucket_start = bucket_start, .min = min, .max = max };
+    }
+    series->count += count;
+    series->sum += sum;
+    series->min = Min(series->min, min);
+    series->max = Max(series->max, max);
 }
 
-bool is_publisher_message_valid(Publisher_Message const msg)
+// Only the numeric messages are rolled up, and not the broker's own.
+void rollup_tiers_add_message(Rollup_Tier_list* tiers, Publisher_Message const* message)
 {
-    return !is_string_null(msg.topic.original);
+    double x;
+    if (tiers->count == 0 || !metric_value_number(&message->typed, &x) || x != x) return;
+    if (message->topic.original.length > 0 && message->topic.original.data[0] == '$') return;
+    rollup_tiers_add(tiers, 0, message->topic.original, message->timestamp, 1, x, x, x);
 }
 
-Publisher_Message parse_publisher_message(String const text)
+// Closes the buckets that ended by `now`, finest tier first so theirs get into the coarser tiers.
+void rollup_tiers_close(Rollup_Tier_list* tiers, time_t const now)
 {
-    String_list parts = string_split(text, '|');
-    if (parts.count != 2) {
-        eprintfln("ERROR: Publisher message has %d parts instead of 2: \"%.*s\"", (int)parts.count, fmt_String(text));
-        goto had_error;
+    for (size_t i = 0; i < tiers->count; i++) {
+        Rollup_Tier* tier = &list_get(*tiers, i);
+        for (size_t j = 0; j < tier->series.count; j++) {
+            Rollup_Series* series = &list_get(tier->series, j);
+            if (series->count > 0 && series->bucket_start + (time_t)tier->interval <= now) {
+                rollup_tiers_close_bucket(tiers, i, series);
+            }
+        }
     }
+}
 
-    Topic topic = parse_topic(list_get(parts, 0));
-    if (!is_topic_valid(topic)) goto had_error;
+// Drops the buckets that started more than their tier's retention ago, returns how many. Their messages are
+// freed once no range query pins the tier.
+uint64_t rollup_tiers_trim(Rollup_Tier_list* tiers, time_t const now)
+{
+    uint64_t trimmed = 0;
+    for (size_t i = 0; i < tiers->count; i++) {
+        Message_Log* log = &list_get(*tiers, i).log;
+        uint64_t expired = log->base_offset;
+        Publisher_Message const* oldest;
+        while ((oldest = message_log_get(log, expired)) != NULL && now - oldest->timestamp > list_get(*tiers, i).retention) {
+            expired++;
+        }
+        trimmed += expired - log->base_offset;
+        message_log_trim(log, expired);
+        // Only range queries read the tiers, and they pin them.
+        message_log_release(log, UINT64_MAX);
+    }
+    return trimmed;
+}
 
-    Publisher_Message message = {
-        .topic = topic,
-        .value = string_clone(list_get(parts, 1)),
-        .timestamp = time(NULL),
-    };
-    list_destroy(&parts);
-    return message;
+// Range Queries
+// ------------------------------------------------------------------------------------------------------- //
 
-had_error:
+// Besides registering, clients can send the subscriber port a query for the messages of a time range:
+//     query|<topic pattern>|<from>|<to>|<limit>[|<resolution>]
+// The times are unix seconds, "now", or a duration ago like "-8h", and a limit of 0 means no limit. The
+// resolution is "raw" or the interval of a -rollup tier. Without it the answer comes from the finest that
+// still goes back to <from>. The broker answers on the same connection with a line per message, in the order
+// it stored them,
+//     <topic>|<value>|<unix ns>
+// and closes it once it sent them all.
+
+typedef struct {
+    Topic pattern;
+    time_t from, to;
+    size_t limit;               // 0 for no limit.
+    bool has_resolution;
+    unsigned int resolution;    // 0 for the raw messages, or the interval of a rollup tier.
+} Range_Query;
+
+bool parse_query_time(String const text, time_t const now, time_t* result)
+{
+    unsigned int ago;
+    double seconds;
+    if (string_equals(text, str8("now"))) {
+        *result = now;
+    } else if (text.length > 1 && text.data[0] == '-' &&
+               parse_duration((String){ .data = text.data + 1, .length = text.length - 1 }, &ago)) {
+        *result = now - ago;
+    } else if (string_to_double(text, &seconds) && seconds >= 0) {
+        *result = (time_t)seconds;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses what comes after "query|".
+bool parse_range_query(String const text, time_t const now, Range_Query* query)
+{
+    *query = (Range_Query){};
+    String_list parts = string_split(text, '|');
+    double limit;
+    bool ok = (parts.count == 4 || parts.count == 5) &&
+              parse_query_time(list_get(parts, 1), now, &query->from) &&
+              parse_query_time(list_get(parts, 2), now, &query->to) &&
+              string_to_double(list_get(parts, 3), &limit) && limit >= 0;
+    if (ok && parts.count == 5) {
+        query->has_resolution = true;
+        ok = string_equals(list_get(parts, 4), str8("raw")) || parse_duration(list_get(parts, 4), &query->resolution);
+    }
+    if (ok) {
+        query->limit = (size_t)limit;
+        query->pattern = parse_topic(list_get(parts, 0));
+        ok = query->pattern.levels.count > 0;
+    }
     list_destroy(&parts);
-    return (Publisher_Message){};
+    return ok;
+}
+
+// The log that answers the query, NULL when there's no tier of the resolution it asked for.
+Message_Log* range_query_log(Range_Query const* query, Message_Log* raw, Rollup_Tier_list* tiers)
+{
+    if (query->has_resolution) {
+        if (query->resolution == 0) return raw;
+        for (size_t i = 0; i < tiers->count; i++) {
+            if (list_get(*tiers, i).interval == query->resolution) return &list_get(*tiers, i).log;
+        }
+        return NULL;
+    }
+
+    Message_Log* log = raw;
+    for (size_t i = 0; ; i++) {
+        Publisher_Message oldest;
+        uint64_t next_offset;
+        bool const covers = message_log_read(log, log->base_offset, &oldest, 1, &next_offset) == 1 && oldest.timestamp <= query->from;
+        if (covers || i == tiers->count) return log;
+        log = &list_get(*tiers, i).log;
+    }
+}
+
+// The part of a segment that a query reads. Appending only writes after `end`, so while the log is pinned it can
+// be read without the lock.
+typedef struct {
+    Log_Segment const* segment;
+    uint32_t start, end;
+} Segment_Range;
+
+typedef struct {
+    Segment_Range* data;
+    size_t count, capacity;
+} Segment_Range_list;
+
+// The segments with messages from `from` to `to`, oldest first. The log must be locked.
+void message_log_ranges(Message_Log const* log, time_t const from, time_t const to, Segment_Range_list* ranges)
+{
+    if (log->base_offset == log->next_offset) return;
+    size_t const first_index = log->base_offset - log->first_segment_offset;
+    for (size_t i = first_index / LOG_SEGMENT_SIZE; i < log->segments.count; i++) {
+        Log_Segment const* segment = list_get(log->segments, i);
+        if (segment->count == 0 || segment->newest < from || segment->oldest > to) continue;
+        uint32_t const start = i == first_index / LOG_SEGMENT_SIZE ? log_segment_lower_bound(segment, first_index % LOG_SEGMENT_SIZE) : 0;
+        if (start < segment->count) {
+            list_append(ranges, ((Segment_Range){ .segment = segment, .start = start, .end = segment->count }));
+        }
+    }
+}
+
+// Appends the messages of the range that the query asks for, up to its limit.
+void segment_range_scan(Segment_Range const range, Range_Query const* query, Publisher_Message_list* results)
+{
+    for (uint32_t i = range.start; i < range.end; i++) {
+        if (query->limit > 0 && results->count == query->limit) return;
+        Publisher_Message const* message = &range.segment->messages[i];
+        if (message->timestamp < query->from || message->timestamp > query->to) continue;
+        if (!topics_match(query->pattern, message->topic)) continue;
+        list_append(results, *message);
+    }
+}
+
+// The line a query answers with for a message.
+void range_query_append_line(String_Builder* lines, Publisher_Message const* message)
+{
+    uint64_t const unix_ns = message->published_ns != 0 ? message->published_ns : (uint64_t)message->timestamp * 1000000000;
+    string_builder_appendf(lines, PRI_String "|" PRI_String "|%llu\n", fmt_String(message->topic.original),
+            fmt_String(message->value), (unsigned long long)unix_ns);
+}
+
+// Records
+// ------------------------------------------------------------------------------------------------------- //
+
+// Subscribers that register with the "typed" option get binary records instead of text lines. Every record is
+// a frame: a 4 byte big endian length followed by the record itself, which starts with its kind.
+
+#define FRAME_HEADER_SIZE 4
+#define RECORDS_FLUSH_SIZE (64 * 1024)
+
+typedef enum {
+    RECORD_MESSAGE = 1, // topic, time in ms, metric value
+    RECORD_SERIES  = 2, // topic, unit, point count, compressed points with their time in ms
+} Record_Kind;
+
+typedef struct {
+    String topic;
+    int64_t timestamp; // Milliseconds since the epoch, see publisher_message_time_ms().
+    Metric_Value value;
+} Typed_Message;
+
+size_t frame_begin(String_Builder* builder)
+{
+    size_t const start = builder->count;
+    string_builder_grow_if_needed(builder, FRAME_HEADER_SIZE);
+    builder->count += FRAME_HEADER_SIZE;
+    return start;
+}
+
+void frame_end(String_Builder* builder, size_t const start)
+{
+    uint32_t const length = builder->count - start - FRAME_HEADER_SIZE;
+    for (int i = 0; i < FRAME_HEADER_SIZE; i++) {
+        builder->data[start + i] = (char)(length >> (8 * (FRAME_HEADER_SIZE - 1 - i)));
+    }
+}
+
+// Finds the frame at the start of `buffer`. Returns false when its bytes haven't all arrived yet.
+bool frame_parse(String const buffer, String* payload, size_t* frame_size)
+{
+    if (buffer.length < FRAME_HEADER_SIZE) {
+        return false;
+    }
+    uint32_t length = 0;
+    for (int i = 0; i < FRAME_HEADER_SIZE; i++) {
+        length = (length << 8) | (uint8_t)buffer.data[i];
+    }
+    if (buffer.length - FRAME_HEADER_SIZE < length) {
+        return false;
+    }
+    *payload = (String){ .data = buffer.data + FRAME_HEADER_SIZE, .length = length };
+    *frame_size = FRAME_HEADER_SIZE + length;
+    return true;
+}
+
+// A value that is only a number and maybe its unit, so it fits in a series.
+bool metric_value_is_plain_number(Metric_Value const* value, double* number, String* unit)
+{
+    if (!metric_value_number(value, number) || value->count > 2) {
+        return false;
+    }
+    Metric_Field const* unit_field = metric_value_get(value, str8("unit"));
+    if (value->count == 2 && unit_field == NULL) {
+        return false;
+    }
+    *unit = unit_field != NULL ? unit_field->tag : (String){};
+    return true;
+}
+
+void record_append_message(String_Builder* builder, Publisher_Message const* message)
+{
+    size_t const frame = frame_begin(builder);
+    list_append(builder, (char)RECORD_MESSAGE);
+    encoded_string_append(builder, message->topic.original);
+    varint_append(builder, publisher_message_time_ms(message));
+    metric_value_append(builder, &message->typed);
+    frame_end(builder, frame);
+}
+
+void record_append_series(String_Builder* builder, String const topic, String const unit, Series_Encoder const* series)
+{
+    size_t const frame = frame_begin(builder);
+    list_append(builder, (char)RECORD_SERIES);
+    encoded_string_append(builder, topic);
+    encoded_string_append(builder, unit);
+    varint_append(builder, series->count);
+    bytes_append(builder, series->bits.bytes.data, series->bits.bytes.count);
+    frame_end(builder, frame);
+}
+
+// Calls `handle` for every message in the record, series get expanded back into one message per point.
+bool record_for_each_message(String const record, void (*handle)(Typed_Message const*))
+{
+    Byte_Reader reader = Byte_Reader_from_String(record);
+    uint8_t const kind = byte_reader_u8(&reader);
+
+    if (kind == RECORD_MESSAGE) {
+        Typed_Message message = { .topic = byte_reader_string(&reader) };
+        message.timestamp = (int64_t)byte_reader_varint(&reader);
+        message.value = byte_reader_metric_value(&reader);
+        if (reader.failed) return false;
+        handle(&message);
+        return true;
+    }
+
+    if (kind == RECORD_SERIES) {
+        Typed_Message message = { .topic = byte_reader_string(&reader) };
+        String const unit = byte_reader_string(&reader);
+        size_t const count = byte_reader_varint(&reader);
+        if (reader.failed) return false;
+
+        String const points = { .data = (char*)reader.data + reader.position, .length = reader.length - reader.position };
+        Series_Decoder series = series_decoder_make(points, count);
+        double number;
+        while (series_next(&series, &message.timestamp, &number)) {
+            message.value = (Metric_Value){};
+            metric_value_add(&message.value, (Metric_Field){ .name = str8("value"), .kind = FIELD_F64, .f64 = number });
+            if (unit.length > 0) {
+                metric_value_add(&message.value, (Metric_Field){ .name = str8("unit"), .kind = FIELD_TAG, .tag = unit });
+            }
+            handle(&message);
+        }
+        return series.remaining == 0;
+    }
+
+    return false;
 }
 
 // Subscribers
@@ -508,7 +3775,11 @@ typedef struct {
     Topic topic;
     String output_hostname;
     String output_port;
+    String name; // Empty when the subscriber didn't give one.
     bool persistent;
+    bool typed;
+    bool filtered;    // Only the messages whose value passes `filter` get delivered.
+    Condition filter;
 } Subscriber_Message;
 
 typedef struct {
@@ -519,18 +3790,25 @@ typedef struct {
 #define PRI_Subscriber_Message "(\"%.*s\", %.*s:%.*s, %s)"
 #define fmt_Subscriber_Message(msg) fmt_String((msg).topic.original), fmt_String((msg).output_hostname), fmt_String((msg).output_port), ((msg).persistent ? "persistent" : "not persistent")
 
+// Format: "topic|host:port|p-" followed by optional "|option" parts.
+// Options:
+//  - typed: Deliver binary records instead of text lines.
+//  - name=<name>: Identifies the subscriber across registrations, so a persistent one resumes where it was.
+//  - filter=value <op> <number> [<number>]: Delivers only the messages whose value passes the condition, the
+//    ones without a number never do. Only "value" can be tested, the broker keeps no state per topic.
 Subscriber_Message* parse_subscriber_message(String const text)
 {
+    String_list output_parts = {};
     String_list parts = string_split(text, '|');
-    if (parts.count != 3) {
-        eprintfln("ERROR: Subscriber message has %d parts instead of 3: \"%.*s\"", (int)parts.count, fmt_String(text));
+    if (parts.count < 3) {
+        eprintfln("ERROR: Subscriber message has %d parts instead of at least 3: \"%.*s\"", (int)parts.count, fmt_String(text));
         goto had_error;
     }
 
     Topic topic = parse_topic(list_get(parts, 0));
     if (!is_topic_valid(topic)) goto had_error;
     
-    String_list output_parts = string_split(list_get(parts, 1), ':');
+    output_parts = string_split(list_get(parts, 1), ':');
     if (output_parts.count != 2) {
         eprintfln("ERROR: Subscriber message has %d output parts instead of 2: \"%.*s\"", (int)output_parts.count, fmt_String(text));
         goto had_error;
@@ -538,54 +3816,173 @@ Subscriber_Message* parse_subscriber_message(String const text)
 
     const bool persistent = string_equals(list_get(parts, 2), str8("p"));
 
+    bool typed = false;
+    String name = {};
+    bool filtered = false;
+    Condition filter = {};
+    String const name_prefix = str8("name=");
+    String const filter_prefix = str8("filter=");
+    for (size_t i = 3; i < parts.count; i++) {
+        String const option = list_get(parts, i);
+        if (string_equals(option, str8("typed"))) {
+            typed = true;
+        } else if (option.length > name_prefix.length &&
+                string_equals((String){ .data = option.data, .length = name_prefix.length }, name_prefix)) {
+            name = (String){ .data = option.data + name_prefix.length, .length = option.length - name_prefix.length };
+        } else if (option.length > filter_prefix.length &&
+                string_equals((String){ .data = option.data, .length = filter_prefix.length }, filter_prefix)) {
+            String_list words = string_split_words((String){
+                .data = option.data + filter_prefix.length,
+                .length = option.length - filter_prefix.length,
+            });
+            size_t const taken = parse_condition(words, 0, &filter);
+            bool const valid = taken > 0 && taken == words.count && filter.subject == SUBJECT_VALUE;
+            list_destroy_safely(&words);
+            if (!valid) {
+                eprintfln("ERROR: Subscriber filter is not \"value <op> <number> [<number>]\": \"%.*s\"", fmt_String(option));
+                goto had_error;
+            }
+            filtered = true;
+        } else {
+            eprintfln("ERROR: Unknown subscriber option \"%.*s\" in \"%.*s\"", fmt_String(option), fmt_String(text));
+            goto had_error;
+        }
+    }
+
     Subscriber_Message* message = (Subscriber_Message*)malloc(sizeof(*message));
     message->topic = topic;
     message->output_hostname = string_clone(list_get(output_parts, 0));
     message->output_port = string_clone(list_get(output_parts, 1));
+    message->name = name.length > 0 ? string_clone(name) : (String){};
     message->persistent = persistent;
+    message->typed = typed;
+    message->filtered = filtered;
+    message->filter = filter;
 
     list_destroy(&output_parts);
     list_destroy(&parts);
     return message;
 
 had_error:
-    list_destroy(&output_parts);
+    list_destroy_safely(&output_parts);
     list_destroy(&parts);
     return NULL;
 }
 
-void subscriber_forward_message(Subscriber_Message const sub, Publisher_Message const message)
+void subscriber_message_destroy(Subscriber_Message* sub)
+{
+    topic_destroy(&sub->topic);
+    string_destroy(&sub->output_hostname);
+    string_destroy(&sub->output_port);
+    if (!is_string_null(sub->name)) {
+        string_destroy(&sub->name);
+    }
+    *sub = (Subscriber_Message){};
+}
+
+bool subscriber_send(Connection_Pool* connections, Subscriber_Message const sub, String const data)
 {
-    if (topics_match(sub.topic, message.topic)) {
-        char* buffer = malloc(BUFFER_SIZE);
-        int chars_written = snprintf(buffer, BUFFER_SIZE, PRI_Publisher_Message, fmt_Publisher_Message(message));
-        String to_send = { .data = buffer, .length = chars_written };
+    if (!connection_pool_send(connections, sub.output_hostname.data, sub.output_port.data, data)) {
+        eprintfln("ERROR: Could not forward message to %s:%s", sub.output_hostname.data, sub.output_port.data);
+        return false;
+    }
+    return true;
+}
 
-        int forward_fd = connect_to_output(sub.output_hostname.data, sub.output_port.data);
-        if (forward_fd >= 0) {
-            forward_message(forward_fd, to_send, false);
+bool subscriber_accepts(Subscriber_Message const* sub, Publisher_Message const* message)
+{
+    if (!topics_match(sub->topic, message->topic)) return false;
+    if (!sub->filtered) return true;
+    double number;
+    return metric_value_number(&message->typed, &number) && condition_holds(&sub->filter, number);
+}
+
+// Returns false when the subscriber couldn't be reached.
+bool subscriber_forward_message(Connection_Pool* connections, Subscriber_Message const sub, Publisher_Message const message)
+{
+    bool sent = true;
+    if (subscriber_accepts(&sub, &message)) {
+        if (sub.typed) {
+            String_Builder record = {};
+            record_append_message(&record, &message);
+            sent = subscriber_send(connections, sub, String_from_builder(record));
+            string_builder_destroy(&record);
+        } else {
+            String_Builder line = {};
+            string_builder_appendf(&line, PRI_Publisher_Message "\n", fmt_Publisher_Message(message));
+            sent = subscriber_send(connections, sub, String_from_builder(line));
+            string_builder_destroy(&line);
         }
-        close(forward_fd);
-        free(buffer);
 
-        printfln("Subscriber " PRI_Subscriber_Message " accepted " PRI_Publisher_Message,
+        log_debug("Subscriber " PRI_Subscriber_Message " accepted " PRI_Publisher_Message,
                 fmt_Subscriber_Message(sub), fmt_Publisher_Message(message));
 
     } else {
-        printfln("Subscriber " PRI_Subscriber_Message " rejected " PRI_Publisher_Message,
+        log_debug("Subscriber " PRI_Subscriber_Message " rejected " PRI_Publisher_Message,
                 fmt_Subscriber_Message(sub), fmt_Publisher_Message(message));
     }
+    return sent;
 }
 
-// Ports
-// ------------------------------------------------------------------------------------------------------- //
-
-bool is_port_in(const String_list ports, String port)
+// Text subscribers get the matching messages as lines, sent together. Typed subscribers get the plain numbers
+// of each topic compressed into a single series record and the rest of the messages one record each. Returns
+// false when the subscriber couldn't be reached, some of the messages may have been delivered anyway.
+bool subscriber_forward_messages(Connection_Pool* connections, Subscriber_Message const sub, Publisher_Message const* messages, size_t count)
 {
-    for (size_t i = 0; i < ports.count; i++) {
-        if (string_equals(list_get(ports, i), port)) {
-            return true;
+    String_Builder records = {};
+    bool* batched = (bool*)calloc(count, sizeof(*batched));
+    assert(count == 0 || batched != NULL);
+    bool sent = true;
+
+    for (size_t i = 0; i < count && sent; i++) {
+        Publisher_Message const* first = &messages[i];
+        if (batched[i] || !subscriber_accepts(&sub, first)) continue;
+
+        if (!sub.typed) {
+            string_builder_appendf(&records, PRI_Publisher_Message "\n", fmt_Publisher_Message(*first));
+            if (records.count >= RECORDS_FLUSH_SIZE) {
+                sent = subscriber_send(connections, sub, String_from_builder(records));
+                records.count = 0;
+            }
+            continue;
+        }
+
+        double number;
+        String unit;
+        if (!metric_value_is_plain_number(&first->typed, &number, &unit)) {
+            record_append_message(&records, first);
+        } else {
+            Series_Encoder series = {};
+            series_append(&series, publisher_message_time_ms(first), number);
+            for (size_t j = i + 1; j < count; j++) {
+                Publisher_Message const* other = &messages[j];
+                if (batched[j] || !string_equals(other->topic.original, first->topic.original)) continue;
+
+                // A message of the topic that can't join the series ends it, the later ones would go before it.
+                double other_number;
+                String other_unit;
+                if (!metric_value_is_plain_number(&other->typed, &other_number, &other_unit)) break;
+                if (!string_equals(other_unit, unit)) break;
+                // Not delivered at all.
+                if (sub.filtered && !condition_holds(&sub.filter, other_number)) continue;
+
+                series_append(&series, publisher_message_time_ms(other), other_number);
+                batched[j] = true;
+            }
+            record_append_series(&records, first->topic.original, unit, &series);
+            series_destroy(&series);
+        }
+
+        if (records.count >= RECORDS_FLUSH_SIZE) {
+            sent = subscriber_send(connections, sub, String_from_builder(records));
+            records.count = 0;
         }
     }
-    return false;
+    if (sent && records.count > 0) {
+        sent = subscriber_send(connections, sub, String_from_builder(records));
+    }
+
+    free(batched);
+    list_destroy_safely(&records);
+    return sent;
 }
@@ -0,0 +1,49 @@
+// Publishes application metrics from inside a program through the client library, at a rate the
+// `publisher` binary could never reach by forking a shell for every value.
+#include "akclient.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MESSAGE_COUNT 100000
+
+int main(int argc, const char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s app_name broker_host:port [broker_host:port ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* app_name = argv[1];
+
+    Ak_Client_Config config = {
+        .brokers = &argv[2],
+        .broker_count = argc - 2,
+    };
+    Ak_Client* client = ak_client_create(&config);
+    if (client == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    char topic[256];
+    char value[64];
+    for (int i = 0; i < MESSAGE_COUNT; i++) {
+        // Keyed by metric name, so every sample of a metric lands on the same broker.
+        snprintf(topic, sizeof(topic), "%s/requests", app_name);
+        snprintf(value, sizeof(value), "%d", i);
+        ak_publish(client, topic, "requests", value);
+
+        snprintf(topic, sizeof(topic), "%s/latency", app_name);
+        snprintf(value, sizeof(value), "%.2f ms", (rand() % 10000) / 100.0);
+        ak_publish(client, topic, "latency", value);
+    }
+
+    if (!ak_client_flush(client, 5000)) {
+        fprintf(stderr, "WARNING: Some messages could not be sent in time.\n");
+    }
+
+    Ak_Client_Stats stats = ak_client_destroy(client);
+    printf("published: %llu, sent: %llu, dropped: %llu\n",
+            (unsigned long long)stats.published, (unsigned long long)stats.sent, (unsigned long long)stats.dropped);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,516 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+
+// Synthetic load for capacity tests. Thousands of virtual publishers, each with its own connection to a broker,
+// are driven from a single epoll loop, far more than real publisher processes can produce.
+//
+// The load is open loop: message i is due at a time that comes from the schedule alone, whether or not the
+// broker keeps up. A timerfd wakes the loop when the next message is due, every message that's due goes to the
+// buffer of its publisher, and the buffers are written whenever their sockets take more. Each message carries
+// the wall clock time it was due as its publish timestamp, so the broker's publish and end to end latencies
+// (see Latency Tracing) start at the schedule and not at when the load generator got around to sending it.
+//
+// The topics are "load/<a>/<b>/...", with as many levels and values per level as -levels says. The publisher of
+// a message is picked round robin and its topic is drawn from the key distribution.
+
+#define LOADGEN_TOPIC_PREFIX    "load"
+#define LOADGEN_MAX_BROKERS     16
+#define LOADGEN_MAX_PENDING     (1024 * 1024) // Bytes a publisher buffers before its messages get dropped.
+#define LOADGEN_EPOLL_EVENTS    256
+#define LOADGEN_REPORT_INTERVAL_NS (1000 * 1000 * 1000ull)
+
+typedef enum {
+    SCHEDULE_FIXED,   // Evenly spaced.
+    SCHEDULE_POISSON, // Exponentially distributed gaps with the same mean.
+    SCHEDULE_BURST,   // Bursts of -burst messages due at once, spaced to keep the rate.
+} Schedule;
+
+typedef enum {
+    KEYS_UNIFORM,
+    KEYS_ZIPF, // The topic of rank k is drawn with a probability proportional to 1 / k^zipf_exponent.
+} Key_Distribution;
+
+typedef struct {
+    const char* brokers[LOADGEN_MAX_BROKERS]; // "host:port" of their publisher ports.
+    int broker_count;
+    int publisher_count;
+    int levels[TOPIC_MAX_LEVELS - 1]; // Values of each topic level.
+    int level_count;
+    Key_Distribution keys;
+    double zipf_exponent;
+    size_t min_size, max_size; // Of the values, in bytes.
+    double rate;               // Messages per second, of all publishers together.
+    Schedule schedule;
+    int burst;
+    double duration;           // Seconds.
+    uint64_t seed;
+} Loadgen_Config;
+
+static Loadgen_Config config = {
+    .publisher_count = 1000,
+    .levels = { 10, 10, 10 },
+    .level_count = 3,
+    .keys = KEYS_UNIFORM,
+    .zipf_exponent = 1.0,
+    .min_size = 16,
+    .max_size = 16,
+    .rate = 10000,
+    .schedule = SCHEDULE_FIXED,
+    .burst = 100,
+    .duration = 10,
+    .seed = 42,
+};
+
+static const char* schedule_names[] = {
+    [SCHEDULE_FIXED] = "fixed",
+    [SCHEDULE_POISSON] = "poisson",
+    [SCHEDULE_BURST] = "burst",
+};
+
+// Random numbers
+// ------------------------------------------------------------------------------------------------------- //
+
+// xorshift64*, good enough for load and the same for the same seed.
+static uint64_t random_state;
+
+uint64_t random_next(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+// In [0, 1).
+double random_unit(void)
+{
+    return (random_next() >> 11) * (1.0 / (1ull << 53));
+}
+
+uint64_t random_below(uint64_t const n)
+{
+    return random_next() % n;
+}
+
+// Topics
+// ------------------------------------------------------------------------------------------------------- //
+
+static uint64_t topic_count;
+static double* zipf_cdf; // Of the ranks, only with KEYS_ZIPF.
+
+void topics_init(void)
+{
+    topic_count = 1;
+    for (int i = 0; i < config.level_count; i++) {
+        topic_count *= config.levels[i];
+    }
+    if (config.keys != KEYS_ZIPF) return;
+
+    zipf_cdf = (double*)malloc(topic_count * sizeof(*zipf_cdf));
+    assert(zipf_cdf != NULL);
+    double sum = 0;
+    for (uint64_t k = 0; k < topic_count; k++) {
+        sum += 1.0 / pow((double)(k + 1), config.zipf_exponent);
+        zipf_cdf[k] = sum;
+    }
+    for (uint64_t k = 0; k < topic_count; k++) {
+        zipf_cdf[k] /= sum;
+    }
+}
+
+uint64_t topic_sample(void)
+{
+    if (config.keys == KEYS_UNIFORM) return random_below(topic_count);
+
+    double const u = random_unit();
+    uint64_t low = 0, high = topic_count - 1;
+    while (low < high) {
+        uint64_t const middle = low + (high - low) / 2;
+        if (zipf_cdf[middle] <= u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Topic `index` written in mixed radix, one digit per level.
+void topic_append(String_Builder* builder, uint64_t index)
+{
+    char digits[TOPIC_MAX_LEVELS][24];
+    for (int i = config.level_count - 1; i >= 0; i--) {
+        snprintf(digits[i], sizeof(digits[i]), "%llu", (unsigned long long)(index % config.levels[i]));
+        index /= config.levels[i];
+    }
+    string_builder_appendf(builder, LOADGEN_TOPIC_PREFIX);
+    for (int i = 0; i < config.level_count; i++) {
+        string_builder_appendf(builder, "/%s", digits[i]);
+    }
+}
+
+// Schedule
+// ------------------------------------------------------------------------------------------------------- //
+
+// When the message after the one due at `due_ns` is due, `sequence` being the number of the next one.
+uint64_t schedule_next(uint64_t const due_ns, uint64_t const sequence)
+{
+    double const interval_ns = 1e9 / config.rate;
+    switch (config.schedule) {
+    case SCHEDULE_FIXED:
+        return due_ns + (uint64_t)interval_ns;
+    case SCHEDULE_POISSON:
+        return due_ns + (uint64_t)(-log(1.0 - random_unit()) * interval_ns);
+    case SCHEDULE_BURST:
+        return sequence % config.burst == 0 ? due_ns + (uint64_t)(interval_ns * config.burst) : due_ns;
+    }
+    return due_ns;
+}
+
+// Virtual publishers
+// ------------------------------------------------------------------------------------------------------- //
+
+typedef struct {
+    int fd; // -1 once the broker closed it.
+    String_Builder pending;
+    size_t written; // Of `pending`.
+    bool waiting;   // For the socket to take more, with EPOLLOUT.
+} Virtual_Publisher;
+
+typedef struct {
+    uint64_t messages;   // Queued to be sent.
+    uint64_t bytes;      // Written to the sockets.
+    uint64_t dropped;    // Because their publisher had too much pending or was closed.
+} Loadgen_Stats;
+
+static Loadgen_Stats stats;
+// From when each message was due until it was queued, since the last report and since the start.
+static Histogram interval_lag, total_lag;
+
+// Writes what the socket takes. Returns false when the connection is gone.
+bool publisher_flush(Virtual_Publisher* publisher)
+{
+    while (publisher->written < publisher->pending.count) {
+        ssize_t const n = write(publisher->fd, publisher->pending.data + publisher->written,
+                publisher->pending.count - publisher->written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        publisher->written += n;
+        stats.bytes += n;
+    }
+    publisher->pending.count = publisher->written = 0;
+    return true;
+}
+
+void publisher_close(int const epoll_fd, Virtual_Publisher* publisher)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, publisher->fd, NULL);
+    close(publisher->fd);
+    publisher->fd = -1;
+}
+
+// Flushes the publisher and waits for EPOLLOUT only when the socket didn't take everything.
+void publisher_send(int const epoll_fd, Virtual_Publisher* publisher, size_t const index)
+{
+    if (!publisher_flush(publisher)) {
+        eprintfln("ERROR: Publisher %zu lost its connection: %s", index, strerror(errno));
+        publisher_close(epoll_fd, publisher);
+        return;
+    }
+    bool const waiting = publisher->pending.count > 0;
+    if (waiting != publisher->waiting) {
+        struct epoll_event event = { .events = EPOLLIN | (waiting ? EPOLLOUT : 0), .data.u64 = index };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, publisher->fd, &event);
+        publisher->waiting = waiting;
+    }
+}
+
+int connect_publisher(Endpoint* broker)
+{
+    if (!endpoint_resolve(broker)) return -1;
+    int const fd = endpoint_connect(broker);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Runner
+// ------------------------------------------------------------------------------------------------------- //
+
+void print_report(const char* label, double const seconds, Loadgen_Stats const* since, Histogram const* lag)
+{
+    printfln("%-8s %10.0f msg/s %8.2f MB/s, %llu dropped, lag p50 %.3f ms p99 %.3f ms max %.3f ms", label,
+            (stats.messages - since->messages) / seconds, (stats.bytes - since->bytes) / seconds / 1e6,
+            (unsigned long long)(stats.dropped - since->dropped), histogram_percentile(lag, 50) / 1e6,
+            histogram_percentile(lag, 99) / 1e6, lag->max / 1e6);
+    fflush(stdout);
+}
+
+bool parse_levels(const char* text)
+{
+    config.level_count = 0;
+    for (const char* p = text; *p != '\0';) {
+        char* end;
+        long const values = strtol(p, &end, 10);
+        if (end == p || values < 1 || config.level_count == ArrayCount(config.levels)) return false;
+        config.levels[config.level_count++] = (int)values;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') return false;
+    }
+    return config.level_count > 0;
+}
+
+void usage(const char **argv)
+{
+    eprintfln("usage: %s [flags ...]", argv[0]);
+    eprintfln("\nflags:");
+    eprintfln("    -broker <host:port>: A publisher port of a broker, can be given more than once. The publishers");
+    eprintfln("                         are spread over them. 127.0.0.1:31001 by default.");
+    eprintfln("    -publishers <n>: Virtual publishers, each with its own connection. %d by default.", config.publisher_count);
+    eprintfln("    -levels <n,n,...>: Values of each level of the topics. 10,10,10 by default.");
+    eprintfln("    -keys <uniform|zipf[:s]>: How the topics are drawn, zipf with exponent s (%g by default).", config.zipf_exponent);
+    eprintfln("                              uniform by default.");
+    eprintfln("    -size <bytes>[-<bytes>]: Of the values, uniform in the range. %zu by default.", config.min_size);
+    eprintfln("    -rate <n>: Messages per second of all the publishers. %g by default.", config.rate);
+    eprintfln("    -schedule <fixed|poisson|burst>: When the messages are due. fixed by default.");
+    eprintfln("    -burst <n>: Messages due at once with the burst schedule. %d by default.", config.burst);
+    eprintfln("    -duration <seconds>: %g by default.", config.duration);
+    eprintfln("    -seed <n>: %llu by default.", (unsigned long long)config.seed);
+    eprintfln();
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char** argv)
+{
+    for (const char **flag = &argv[1]; *flag != NULL; flag++) {
+        if (flag[1] == NULL) {
+            eprintfln("ERROR: Flag \"%s\" needs an argument.\n", *flag);
+            usage(argv);
+        }
+        const char* arg = *++flag;
+        if (strcmp(flag[-1], "-broker") == 0) {
+            if (config.broker_count == LOADGEN_MAX_BROKERS) {
+                eprintfln("ERROR: No more than %d brokers.\n", LOADGEN_MAX_BROKERS);
+                usage(argv);
+            }
+            config.brokers[config.broker_count++] = arg;
+        } else if (strcmp(flag[-1], "-publishers") == 0) {
+            config.publisher_count = atoi(arg);
+        } else if (strcmp(flag[-1], "-levels") == 0) {
+            if (!parse_levels(arg)) {
+                eprintfln("ERROR: Levels must be up to %zu positive numbers separated by commas: \"%s\"\n",
+                        ArrayCount(config.levels), arg);
+                usage(argv);
+            }
+        } else if (strcmp(flag[-1], "-keys") == 0) {
+            if (strcmp(arg, "uniform") == 0) {
+                config.keys = KEYS_UNIFORM;
+            } else if (strncmp(arg, "zipf", 4) == 0 && (arg[4] == '\0' || arg[4] == ':')) {
+                config.keys = KEYS_ZIPF;
+                if (arg[4] == ':') config.zipf_exponent = strtod(arg + 5, NULL);
+            } else {
+                eprintfln("ERROR: Unknown key distribution \"%s\".\n", arg);
+                usage(argv);
+            }
+        } else if (strcmp(flag[-1], "-size") == 0) {
+            char* end;
+            config.min_size = config.max_size = strtoull(arg, &end, 10);
+            if (*end == '-') config.max_size = strtoull(end + 1, NULL, 10);
+        } else if (strcmp(flag[-1], "-rate") == 0) {
+            config.rate = strtod(arg, NULL);
+        } else if (strcmp(flag[-1], "-schedule") == 0) {
+            size_t i = 0;
+            while (i < ArrayCount(schedule_names) && strcmp(arg, schedule_names[i]) != 0) i++;
+            if (i == ArrayCount(schedule_names)) {
+                eprintfln("ERROR: Unknown schedule \"%s\".\n", arg);
+                usage(argv);
+            }
+            config.schedule = (Schedule)i;
+        } else if (strcmp(flag[-1], "-burst") == 0) {
+            config.burst = atoi(arg);
+        } else if (strcmp(flag[-1], "-duration") == 0) {
+            config.duration = strtod(arg, NULL);
+        } else if (strcmp(flag[-1], "-seed") == 0) {
+            config.seed = strtoull(arg, NULL, 10);
+        } else {
+            eprintfln("ERROR: Unrecognized flag \"%s\".\n", flag[-1]);
+            usage(argv);
+        }
+    }
+    if (config.broker_count == 0) {
+        config.brokers[config.broker_count++] = "127.0.0.1:31001";
+    }
+    if (config.publisher_count < 1 || config.rate <= 0 || config.duration <= 0 || config.burst < 1 ||
+            config.min_size < 1 || config.max_size < config.min_size) {
+        eprintfln("ERROR: The counts, the sizes, the rate and the duration must be positive.\n");
+        usage(argv);
+    }
+
+    random_state = config.seed * 0x9E3779B97F4A7C15ull + 1;
+    topics_init();
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every publisher takes a file descriptor.
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    Endpoint* brokers = (Endpoint*)calloc(config.broker_count, sizeof(*brokers));
+    assert(brokers != NULL);
+    for (int i = 0; i < config.broker_count; i++) {
+        const char* colon = strrchr(config.brokers[i], ':');
+        if (colon == NULL) {
+            eprintfln("ERROR: Broker \"%s\" isn't host:port.\n", config.brokers[i]);
+            usage(argv);
+        }
+        brokers[i] = (Endpoint){
+            .host = string_clone((String){ .data = (char*)config.brokers[i], .length = colon - config.brokers[i] }),
+            .port = string_clone(String_from_cstr(colon + 1)),
+            .fd = -1,
+        };
+    }
+
+    int const epoll_fd = epoll_create1(0);
+    int const timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epoll_fd < 0 || timer_fd < 0) {
+        perror("ERROR: Could not set up epoll");
+        exit(EXIT_FAILURE);
+    }
+    // The timer is told apart from the publishers by an index none of them has.
+    struct epoll_event timer_event = { .events = EPOLLIN, .data.u64 = UINT64_MAX };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event);
+
+    Virtual_Publisher* publishers = (Virtual_Publisher*)calloc(config.publisher_count, sizeof(*publishers));
+    assert(publishers != NULL);
+    for (int i = 0; i < config.publisher_count; i++) {
+        Endpoint* broker = &brokers[i % config.broker_count];
+        publishers[i].fd = connect_publisher(broker);
+        if (publishers[i].fd < 0) {
+            eprintfln("ERROR: Publisher %d could not connect to %s: %s", i, config.brokers[i % config.broker_count], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = i };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, publishers[i].fd, &event);
+    }
+
+    const char* keys = config.keys == KEYS_UNIFORM ? "uniform" : "zipf";
+    printfln("INFO: %d publishers to %d brokers, %llu topics (%s keys), %zu-%zu byte values, %g msg/s %s, %g s",
+            config.publisher_count, config.broker_count, (unsigned long long)topic_count, keys, config.min_size,
+            config.max_size, config.rate, schedule_names[config.schedule], config.duration);
+    fflush(stdout);
+
+    // Messages are scheduled in monotonic time and stamped with the wall clock time that corresponds.
+    uint64_t const start_ns = time_now_ns();
+    uint64_t const unix_offset_ns = time_unix_ns() - start_ns;
+    uint64_t const end_ns = start_ns + (uint64_t)(config.duration * 1e9);
+    uint64_t due_ns = start_ns;
+    uint64_t sequence = 0;
+    uint64_t next_report_ns = start_ns + LOADGEN_REPORT_INTERVAL_NS;
+    Loadgen_Stats reported = {};
+    size_t* dirty = (size_t*)malloc(config.publisher_count * sizeof(*dirty));
+    assert(dirty != NULL);
+    struct epoll_event events[LOADGEN_EPOLL_EVENTS];
+
+    while (due_ns < end_ns) {
+        uint64_t const now_ns = time_now_ns();
+        size_t dirty_count = 0;
+        for (; due_ns <= now_ns && due_ns < end_ns; due_ns = schedule_next(due_ns, ++sequence)) {
+            size_t const index = sequence % config.publisher_count;
+            Virtual_Publisher* publisher = &publishers[index];
+            histogram_record(&interval_lag, now_ns - due_ns);
+            if (publisher->fd < 0 || publisher->pending.count >= LOADGEN_MAX_PENDING) {
+                stats.dropped++;
+                continue;
+            }
+
+            if (publisher->pending.count == 0) dirty[dirty_count++] = index;
+            topic_append(&publisher->pending, topic_sample());
+            size_t const size = config.min_size + random_below(config.max_size - config.min_size + 1);
+            // The value is the sequence number, padded with zeros to its size.
+            string_builder_appendf(&publisher->pending, "|%0*llu|%llu\n", (int)size, (unsigned long long)sequence,
+                    (unsigned long long)(due_ns + unix_offset_ns));
+            stats.messages++;
+        }
+        for (size_t i = 0; i < dirty_count; i++) {
+            if (!publishers[dirty[i]].waiting) publisher_send(epoll_fd, &publishers[dirty[i]], dirty[i]);
+        }
+
+        if (now_ns >= next_report_ns) {
+            print_report("sent:", (now_ns - next_report_ns + LOADGEN_REPORT_INTERVAL_NS) / 1e9, &reported, &interval_lag);
+            histogram_merge(&total_lag, &interval_lag);
+            memset(&interval_lag, 0, sizeof(interval_lag));
+            reported = stats;
+            next_report_ns = now_ns + LOADGEN_REPORT_INTERVAL_NS;
+        }
+
+        struct itimerspec const timer = {
+            .it_value = { .tv_sec = Min(due_ns, end_ns) / 1000000000, .tv_nsec = Min(due_ns, end_ns) % 1000000000 },
+        };
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+        int const count = epoll_wait(epoll_fd, events, ArrayCount(events), -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == UINT64_MAX) {
+                uint64_t expirations;
+                read(timer_fd, &expirations, sizeof(expirations));
+                continue;
+            }
+            size_t const index = events[i].data.u64;
+            Virtual_Publisher* publisher = &publishers[index];
+            if (publisher->fd < 0) continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                // The broker never writes to publishers, so this is it closing the connection.
+                eprintfln("ERROR: Broker closed the connection of publisher %zu", index);
+                publisher_close(epoll_fd, publisher);
+            } else if (events[i].events & EPOLLOUT) {
+                publisher_send(epoll_fd, publisher, index);
+            }
+        }
+    }
+
+    // What's still pending gets a second to go out.
+    uint64_t const drain_end_ns = time_now_ns() + LOADGEN_REPORT_INTERVAL_NS;
+    for (bool pending = true; pending && time_now_ns() < drain_end_ns;) {
+        pending = false;
+        for (int i = 0; i < config.publisher_count; i++) {
+            Virtual_Publisher* publisher = &publishers[i];
+            if (publisher->fd < 0 || publisher->pending.count == 0) continue;
+            publisher_send(epoll_fd, publisher, i);
+            pending = pending || (publisher->fd >= 0 && publisher->pending.count > 0);
+        }
+        if (pending) usleep(1000);
+    }
+
+    uint64_t unsent = 0;
+    for (int i = 0; i < config.publisher_count; i++) {
+        unsent += publishers[i].pending.count - publishers[i].written;
+    }
+    histogram_merge(&total_lag, &interval_lag);
+    print_report("total:", (time_now_ns() - start_ns) / 1e9, &(Loadgen_Stats){}, &total_lag);
+    printfln("INFO: %llu messages, %llu bytes left unsent", (unsigned long long)stats.messages, (unsigned long long)unsent);
+
+    for (int i = 0; i < config.publisher_count; i++) {
+        if (publishers[i].fd >= 0) close(publishers[i].fd);
+        list_destroy_safely(&publishers[i].pending);
+    }
+    for (int i = 0; i < config.broker_count; i++) {
+        string_destroy(&brokers[i].host);
+        string_destroy(&brokers[i].port);
+        if (brokers[i].addresses != NULL) freeaddrinfo(brokers[i].addresses);
+    }
+    free(publishers);
+    free(brokers);
+    free(dirty);
+    free(zipf_cdf);
+    close(timer_fd);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include "common.h"
+
+// Microbenchmarks of the primitives on the hot paths. Every benchmark repeats its body for at least
+// BENCH_MIN_NS and reports the time and the heap allocations per operation. The variants of a function are
+// compared with the first one, which is its scalar reference. With -csv the results come out as CSV, to compare
+// runs with other tools.
+//
+// Build with optimizations, build.sh does.
+
+#define BENCH_MIN_NS (200 * 1000 * 1000ull)
+#define BENCH_BATCH  1024
+
+// Results go here so the compiler can't drop the work.
+static volatile int64_t sink;
+
+static bool csv = false;
+static char baseline_name[64];
+static double baseline_ns = 0;
+
+// Every allocation of the process goes through these, which count them and hand them to glibc.
+static uint64_t allocations = 0;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+void* malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+void bench_report(const char* name, const char* variant, uint64_t ops, uint64_t elapsed_ns, uint64_t allocated)
+{
+    double const ns_per_op = (double)elapsed_ns / ops;
+    double const allocations_per_op = (double)allocated / ops;
+    if (strcmp(variant, simd_level_names[SIMD_NONE]) == 0) {
+        snprintf(baseline_name, sizeof(baseline_name), "%s", name);
+        baseline_ns = ns_per_op;
+    }
+    // Only the variants of the same function get compared.
+    double const speedup = strcmp(name, baseline_name) == 0 ? baseline_ns / ns_per_op : 1;
+    if (csv) {
+        printfln("%s,%s,%.3f,%.3f,%.3f", name, variant, ns_per_op, allocations_per_op, speedup);
+    } else {
+        printfln("%-40s %-8s %10.2f ns/op %6.2f allocs/op %8.2fx", name, variant, ns_per_op, allocations_per_op, speedup);
+    }
+}
+
+#define BENCH(name, variant, body) do {\
+    uint64_t ops = 0;\
+    uint64_t const allocations_before = allocations;\
+    uint64_t const start = time_now_ns();\
+    uint64_t elapsed;\
+    do {\
+        for (int bench_i = 0; bench_i < BENCH_BATCH; bench_i++) { body; }\
+        ops += BENCH_BATCH;\
+    } while ((elapsed = time_now_ns() - start) < BENCH_MIN_NS);\
+    bench_report((name), (variant), ops, elapsed, allocations - allocations_before);\
+} while (0)
+
+// Text of `length` bytes that looks like metric values, with `c` only at the very end.
+String make_text(size_t length, char c)
+{
+    String text = { .data = (char*)malloc(length + 1), .length = length };
+    assert(text.data != NULL);
+    for (size_t i = 0; i < length; i++) {
+        String_set(text, i, "0123456789 %.MB()/"[i % 18]);
+    }
+    String_set_last(text, c);
+    String_set(text, length, '\0');
+    return text;
+}
+
+void bench_strings(size_t length)
+{
+    char name[64];
+    String const text = make_text(length, '|');
+    String const same = string_clone(text);
+    String const needle = str8("MB|");
+
+    snprintf(name, sizeof(name), "string_find_char/%zu", length);
+    BENCH(name, "scalar", sink += string_find_char_scalar(text, '|'));
+#ifdef STRING_SIMD
+    BENCH(name, "sse2", sink += string_find_char_sse2(text, '|'));
+    if (simd_level() == SIMD_AVX2) BENCH(name, "avx2", sink += string_find_char_avx2(text, '|'));
+#endif
+
+    snprintf(name, sizeof(name), "string_equals/%zu", length);
+    BENCH(name, "scalar", sink += string_equals_scalar(text, same));
+#ifdef STRING_SIMD
+    BENCH(name, "sse2", sink += string_equals_sse2(text, same));
+    if (simd_level() == SIMD_AVX2) BENCH(name, "avx2", sink += string_equals_avx2(text, same));
+#endif
+
+    snprintf(name, sizeof(name), "string_find_substr/%zu", length);
+    BENCH(name, "scalar", sink += string_find_substr_scalar(text, needle));
+#ifdef STRING_SIMD
+    BENCH(name, "sse2", sink += string_find_substr_sse2(text, needle));
+    if (simd_level() == SIMD_AVX2) BENCH(name, "avx2", sink += string_find_substr_avx2(text, needle));
+#endif
+
+    // Splitting allocates the list, so it gets reused.
+    String const topic = make_text(length, '/');
+    snprintf(name, sizeof(name), "string_split/%zu", length);
+    BENCH(name, "scalar", {
+        String_list parts = string_split_scalar(topic, ' ');
+        sink += parts.count;
+        list_destroy_safely(&parts);
+    });
+#ifdef STRING_SIMD
+    BENCH(name, "sse2", {
+        String_list parts = string_split(topic, ' ');
+        sink += parts.count;
+        list_destroy_safely(&parts);
+    });
+#endif
+}
+
+// Topics
+// ------------------------------------------------------------------------------------------------------- //
+
+#define TOPIC_SET_SIZE 256 // Divides BENCH_BATCH, so every benchmark goes through the whole set the same times.
+
+static const char* level_names[] = {
+    "host", "cpu-usage", "memory-usage", "disk-usage", "eu-west-1", "rack17", "container", "network", "rx", "tx",
+};
+
+// Topics like the ones the publishers send: "host42/cpu-usage/rack17/...", `depth` levels each. The patterns
+// have each level replaced by a "+" with probability `wildcards`, and the last one by a "#" with half of that.
+String_list make_topics(size_t const depth, double const wildcards, bool const patterns)
+{
+    String_list topics = {};
+    for (size_t i = 0; i < TOPIC_SET_SIZE; i++) {
+        String_Builder topic = {};
+        for (size_t level = 0; level < depth; level++) {
+            if (level > 0) string_builder_appendf(&topic, "/");
+            double const dice = (double)rand() / RAND_MAX;
+            if (patterns && level == depth - 1 && dice < wildcards / 2) {
+                string_builder_appendf(&topic, "#");
+            } else if (patterns && dice < wildcards) {
+                string_builder_appendf(&topic, "+");
+            } else {
+                // Few names per level, so that some of the patterns match.
+                string_builder_appendf(&topic, "%s%d", level_names[(level + i % 2) % ArrayCount(level_names)], rand() % 4);
+            }
+        }
+        list_append(&topics, String_from_builder(topic));
+    }
+    return topics;
+}
+
+void bench_topics(size_t const depth)
+{
+    char name[64];
+    srand(depth);
+    String_list texts = make_topics(depth, 0, false);
+
+    Topic_list topics = {};
+    for (size_t i = 0; i < texts.count; i++) {
+        list_append(&topics, parse_topic(list_get(texts, i)));
+    }
+
+    snprintf(name, sizeof(name), "parse_topic/depth=%zu", depth);
+    BENCH(name, "-", {
+        Topic topic = parse_topic(list_get(texts, bench_i % TOPIC_SET_SIZE));
+        sink += topic.levels.count;
+        topic_destroy(&topic);
+    });
+
+    snprintf(name, sizeof(name), "string_split/depth=%zu", depth);
+    BENCH(name, "-", {
+        String_list levels = string_split(list_get(texts, bench_i % TOPIC_SET_SIZE), '/');
+        sink += levels.count;
+        list_destroy_safely(&levels);
+    });
+
+    double const densities[] = { 0, 0.25, 0.5 };
+    for (size_t d = 0; d < ArrayCount(densities); d++) {
+        String_list pattern_texts = make_topics(depth, densities[d], true);
+        Topic_list patterns = {};
+        for (size_t i = 0; i < pattern_texts.count; i++) {
+            list_append(&patterns, parse_topic(list_get(pattern_texts, i)));
+        }
+        // Every pattern against a different topic each round, like a message going through the subscriptions.
+        snprintf(name, sizeof(name), "topics_match/depth=%zu/wildcards=%g", depth, densities[d]);
+        BENCH(name, "-", {
+            int const i = bench_i % TOPIC_SET_SIZE;
+            sink += topics_match(list_get(patterns, i), list_get(topics, (i * 7 + bench_i / TOPIC_SET_SIZE) % TOPIC_SET_SIZE));
+        });
+        for (size_t i = 0; i < patterns.count; i++) {
+            topic_destroy(&list_get(patterns, i));
+            string_destroy(&list_get(pattern_texts, i));
+        }
+        list_destroy_safely(&patterns);
+        list_destroy_safely(&pattern_texts);
+    }
+
+    String_list lines = {};
+    String_list registrations = {};
+    for (size_t i = 0; i < texts.count; i++) {
+        String_Builder line = {};
+        string_builder_appendf(&line, PRI_String "|42.1%% (3400 MB / 8000 MB )", fmt_String(list_get(texts, i)));
+        list_append(&lines, String_from_builder(line));
+        String_Builder registration = {};
+        string_builder_appendf(&registration, PRI_String "|127.0.0.1:4000|p|name=monitor%zu|typed", fmt_String(list_get(texts, i)), i);
+        list_append(&registrations, String_from_builder(registration));
+    }
+
+    snprintf(name, sizeof(name), "parse_publisher_message/depth=%zu", depth);
+    BENCH(name, "-", {
+        Publisher_Message message = parse_publisher_message(list_get(lines, bench_i % TOPIC_SET_SIZE));
+        sink += message.value.length;
+        publisher_message_destroy(&message);
+    });
+
+    snprintf(name, sizeof(name), "parse_publisher_message_view/depth=%zu", depth);
+    BENCH(name, "-", {
+        Publisher_Message_View view;
+        sink += parse_publisher_message_view(list_get(lines, bench_i % TOPIC_SET_SIZE), &view);
+    });
+
+    snprintf(name, sizeof(name), "parse_subscriber_message/depth=%zu", depth);
+    BENCH(name, "-", {
+        Subscriber_Message* sub = parse_subscriber_message(list_get(registrations, bench_i % TOPIC_SET_SIZE));
+        sink += sub->typed;
+        subscriber_message_destroy(sub);
+        free(sub);
+    });
+
+    for (size_t i = 0; i < texts.count; i++) {
+        topic_destroy(&list_get(topics, i));
+        string_destroy(&list_get(texts, i));
+        string_destroy(&list_get(lines, i));
+        string_destroy(&list_get(registrations, i));
+    }
+    list_destroy_safely(&topics);
+    list_destroy_safely(&texts);
+    list_destroy_safely(&lines);
+    list_destroy_safely(&registrations);
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc == 2 && strcmp(argv[1], "-csv") == 0) {
+        csv = true;
+    } else if (argc != 1) {
+        eprintfln("usage: %s [-csv]", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (csv) {
+        printfln("name,variant,ns_per_op,allocations_per_op,speedup");
+    } else {
+        printfln("Strings use %s", simd_level_names[simd_level()]);
+    }
+    size_t const lengths[] = { 16, 64, 256, 4096 };
+    for (size_t i = 0; i < ArrayCount(lengths); i++) {
+        bench_strings(lengths[i]);
+        if (!csv) printfln();
+    }
+    size_t const depths[] = { 2, 4, 8 };
+    for (size_t i = 0; i < ArrayCount(depths); i++) {
+        bench_topics(depths[i]);
+        if (!csv) printfln();
+    }
+    return 0;
+}
@@ -14,6 +14,7 @@ typedef struct {
 static String commands_txt;
 static Metric_list metric_list;
 static Metric_list used_metrics;
+static Connection_Pool broker_connections = CONNECTION_POOL_INITIALIZER;
 
 #define COMMANDS_FILENAME "commands.txt"
 
@@ -22,7 +23,6 @@ void usage(char **argv);
 void prelude(int argc, char** argv);
 void print_metric_list(FILE *out, Metric_list const metrics);
 int find_command_index(const char *name);
-int connect_to_broker(const char *host, const char *port);
 bool send_message(const char *host, const char *port, String_Builder const message);
 
 int main(int argc, char **argv)
@@ -117,9 +117,9 @@ int main(int argc, char **argv)
             }
             String output = run(metric);
             String_Builder message = {};
-            string_builder_appendf(&message, "%s/" PRI_String "|" PRI_String "\n",
-                    publisher_name, fmt_String(metric.command_name), fmt_String(output));
-            list_append(&message, '\0');
+            // The timestamp lets the broker measure the latency from here.
+            string_builder_appendf(&message, "%s/" PRI_String "|" PRI_String "|%llu\n",
+                    publisher_name, fmt_String(metric.command_name), fmt_String(output), (unsigned long long)time_unix_ns());
             try_again:
             if (!send_message(host, port.data, message)) goto try_again;
             string_destroy(&output);
@@ -270,57 +270,17 @@ String run(Metric const metric)
     return (String){}; // unreachable
 }
 
-int connect_to_broker(const char *host, const char *port)
-{
-    struct addrinfo hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-    };
-    struct addrinfo *res = NULL;
-
-    int status = getaddrinfo(host, port, &hints, &res);
-    if (status != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-        return -1;
-    }
-
-    int broker_fd = -1;
-
-    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
-        broker_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (broker_fd < 0) continue;
-
-        if (connect(broker_fd, p->ai_addr, p->ai_addrlen) == 0) {
-            break; // success!
-        }
-
-        close(broker_fd);
-        broker_fd = -1;
-    }
-
-    freeaddrinfo(res);
-
-    if (broker_fd < 0) {
-    } else {
-        printf("Connected to broker at %s:%s\n", host, port);
-    }
-
-    return broker_fd;
-}
-
 bool send_message(const char *host, const char *port, String_Builder const message)
 {
-    int fd = connect_to_broker(host, port);
-    if (fd < 0) {
-        printfln("Could not connect to %s:%s, retrying...", host, port);
-        sleep(1);
-        return false;
-    }
+    Endpoint* broker = connection_pool_get(&broker_connections, host, port);
 
     printf("Sending: " PRI_String, fmt_String_Builder(message));
-    send(fd, message.data, message.count, 0);
+    if (!endpoint_send(broker, String_from_builder(message))) {
+        printfln("Could not send to %s:%s, retrying...", host, port);
+        endpoint_wait_for_retry(broker);
+        return false;
+    }
 
-    close(fd);
     sleep(1); // send every second
     return true;
 }
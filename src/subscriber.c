@@ -3,36 +3,431 @@
 typedef struct {
     const char *subscriber_name;
     const char *topic;
+    const char *filter; // Sent to the broker with the registration, NULL for none.
+    bool typed;
+    Connection_Pool broker_connections;
 } State;
 
-static State ctx = {};
+static State ctx = {
+    .broker_connections = CONNECTION_POOL_INITIALIZER,
+};
 
-int connect_to_broker(const char *host, int port) {
-    int broker_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (broker_fd < 0) {
-        perror("ERROR: broker socket");
-        return -1;
+// Rules
+// ------------------------------------------------------------------------------------------------------- //
+
+// Rules come from the -rules file, one per line with "//" comments, and -threshold <x> is the same as the rule
+// "# value > x":
+//     <topic pattern> <subject> <op> <number> [<number>] [for <n> of <m>]
+// For example "+/cpu-usage value > 90 for 3 of 5" fires when 3 of the last 5 samples of a cpu were above 90.
+// The subjects count, min, max, mean, p50, p90 and p99 are tested against the aggregates of the windows of the
+// topic when they close, see Windows below, so "+/cpu-usage p90 > 80" needs a -window for +/cpu-usage.
+//
+// The rules that apply to a topic are looked up once, the first time the topic shows up, and kept next to the
+// state they need for that topic. Afterwards a message costs a hash lookup and the matching rules.
+
+#define RULE_MAX_WINDOW 64
+
+typedef struct {
+    String source; // Owned.
+    Topic pattern;
+    Condition condition;
+    uint8_t needed; // The n in "for <n> of <m>".
+    uint8_t window; // The m, 1 when the rule has no "for".
+} Rule;
+
+typedef struct {
+    Rule* data;
+    size_t count, capacity;
+} Rule_list;
+
+// Evaluation state of one rule for one topic.
+typedef struct {
+    uint32_t rule;
+    bool has_last;
+    double last_value;
+    uint64_t last_ms;
+    uint64_t history; // Bit i is set when the condition held i samples ago.
+} Rule_State;
+
+typedef struct {
+    Rule_State* data;
+    size_t count, capacity;
+} Rule_State_list;
+
+typedef struct {
+    String topic; // Owned.
+    size_t first_state;
+    size_t state_count;
+    size_t first_window;
+    size_t window_count;
+} Rule_Series;
+
+typedef struct {
+    Rule_Series* data;
+    size_t count, capacity;
+} Rule_Series_list;
+
+typedef struct {
+    String source; // Owned.
+    Topic pattern;
+    uint64_t length_ms;
+    uint64_t slide_ms;
+    uint32_t pane_count; // length / slide, 1 for tumbling windows.
+    uint64_t next_close_ms;
+} Window_Spec;
+
+typedef struct {
+    Window_Spec* data;
+    size_t count, capacity;
+} Window_Spec_list;
+
+// A window of one topic.
+typedef struct {
+    uint32_t spec;
+    uint32_t series;
+    size_t first_pane; // The panes are a ring of pane_count aggregates, one per slide.
+    uint32_t current;
+    uint64_t pane_start_ms;
+} Window_State;
+
+typedef struct {
+    Window_State* data;
+    size_t count, capacity;
+} Window_State_list;
+
+typedef struct {
+    Rule_list rules;
+    Rule_Series_list series;
+    Hash_Index series_index;
+    Rule_State_list states;
+    Window_Spec_list windows;
+    Window_State_list window_states;
+    Aggregate_list panes;
+} Rule_Engine;
+
+// Only used from the receive loop.
+static Rule_Engine engine = {};
+
+bool add_rule(String const line)
+{
+    String const source = string_trim(line);
+    String_list words = string_split_words(source);
+    Rule rule = { .needed = 1, .window = 1 };
+
+    if (words.count == 0 || string_find_char(source, '\'') >= 0) goto had_error;
+
+    size_t const taken = parse_condition(words, 1, &rule.condition);
+    if (taken == 0) goto had_error;
+
+    size_t const rest = 1 + taken;
+    if (rest != words.count) {
+        double needed, window;
+        if (rest + 4 != words.count ||
+            !string_equals(list_get(words, rest), str8("for")) ||
+            !string_to_double(list_get(words, rest + 1), &needed) ||
+            !string_equals(list_get(words, rest + 2), str8("of")) ||
+            !string_to_double(list_get(words, rest + 3), &window) ||
+            needed < 1 || needed > window || window > RULE_MAX_WINDOW) {
+            goto had_error;
+        }
+        rule.needed = needed;
+        rule.window = window;
     }
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    rule.pattern = parse_topic(list_get(words, 0));
+    if (!is_topic_valid(rule.pattern)) goto had_error;
+    rule.source = string_clone(source);
+    list_append(&engine.rules, rule);
+    list_destroy_safely(&words);
+    return true;
 
-    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
-        perror("ERROR: broker inet_pton");
-        close(broker_fd);
-        return -1;
+had_error:
+    eprintfln("ERROR: Invalid rule \"%.*s\"", fmt_String(source));
+    eprintfln("       Expected: <topic pattern> <subject> <op> <number> [<number>] [for <n> of <m>]");
+    list_destroy_safely(&words);
+    return false;
+}
+
+bool load_rules(const char* path)
+{
+    String text;
+    if (!fs_read_entire_file(path, &text)) {
+        return false;
     }
+    String_list lines = string_split(text, '\n');
+    bool ok = true;
+    for (size_t i = 0; i < lines.count && ok; i++) {
+        String const line = string_trim(list_get(lines, i));
+        // "#" is a valid topic pattern, so comments start with "//".
+        if (line.length == 0 || (line.length >= 2 && line.data[0] == '/' && line.data[1] == '/')) continue;
+        ok = add_rule(line);
+    }
+    list_destroy_safely(&lines);
+    // The rules keep their own copies.
+    string_destroy(&text);
+    return ok;
+}
 
-    if (connect(broker_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("ERROR: broker connect");
-        close(broker_fd);
-        return -1;
+Rule_Series* rule_series_get(String const topic)
+{
+    uint64_t const hash = hash_string(topic);
+    size_t probe = 0;
+    for (uint32_t i; (i = hash_index_next(&engine.series_index, hash, &probe)) != HASH_INDEX_EMPTY;) {
+        if (string_equals(list_get(engine.series, i).topic, topic)) {
+            return &list_get(engine.series, i);
+        }
+    }
+
+    // First time we see this topic.
+    Topic parsed = parse_topic(topic);
+    if (!is_topic_valid(parsed)) {
+        return NULL;
+    }
+    Rule_Series series = {
+        .topic = string_clone(topic),
+        .first_state = engine.states.count,
+        .first_window = engine.window_states.count,
+    };
+    for (size_t i = 0; i < engine.rules.count; i++) {
+        if (topics_match(list_get(engine.rules, i).pattern, parsed)) {
+            list_append(&engine.states, ((Rule_State){ .rule = i }));
+            series.state_count++;
+        }
+    }
+    uint64_t const now = time_now_ms();
+    for (size_t i = 0; i < engine.windows.count; i++) {
+        Window_Spec const spec = list_get(engine.windows, i);
+        if (!topics_match(spec.pattern, parsed)) continue;
+        list_append(&engine.window_states, ((Window_State){
+            .spec = i,
+            .series = engine.series.count,
+            .first_pane = engine.panes.count,
+            .pane_start_ms = now - now % spec.slide_ms,
+        }));
+        for (size_t j = 0; j < spec.pane_count; j++) {
+            list_append(&engine.panes, (Aggregate){});
+        }
+        series.window_count++;
+    }
+    topic_destroy(&parsed);
+
+    list_append(&engine.series, series);
+    hash_index_insert(&engine.series_index, hash, engine.series.count - 1);
+    return &list_get_last(engine.series);
+}
+
+void alert_submit(String const topic, size_t const rule, String const message);
+
+void rule_state_update(Rule_State* state, String const topic, bool const holds, String const message)
+{
+    Rule const* rule = &list_get(engine.rules, state->rule);
+    state->history = (state->history << 1) | holds;
+    uint64_t const window_mask = rule->window == RULE_MAX_WINDOW ? UINT64_MAX : (1ull << rule->window) - 1;
+    if (__builtin_popcountll(state->history & window_mask) >= rule->needed) {
+        alert_submit(topic, state->rule, message);
+    }
+}
+
+void evaluate_rules(Rule_Series const* series, double const number, uint64_t const timestamp_ms, String const message)
+{
+    for (size_t i = 0; i < series->state_count; i++) {
+        Rule_State* state = &list_get(engine.states, series->first_state + i);
+        Condition const* condition = &list_get(engine.rules, state->rule).condition;
+        if (is_aggregate_subject(condition->subject)) continue;
+
+        bool holds;
+        if (condition->subject == SUBJECT_RATE) {
+            // Samples of the same millisecond have no rate between them, the rate is taken from the first one.
+            if (state->has_last && timestamp_ms <= state->last_ms) continue;
+            holds = state->has_last &&
+                condition_holds(condition, (number - state->last_value) * 1000.0 / (timestamp_ms - state->last_ms));
+        } else {
+            holds = condition_holds(condition, number);
+        }
+        state->has_last = true;
+        state->last_value = number;
+        state->last_ms = timestamp_ms;
+        rule_state_update(state, series->topic, holds, message);
+    }
+}
+
+void evaluate_aggregate_rules(Rule_Series const* series, Aggregate const* aggregate, String const message)
+{
+    for (size_t i = 0; i < series->state_count; i++) {
+        Rule_State* state = &list_get(engine.states, series->first_state + i);
+        Condition const* condition = &list_get(engine.rules, state->rule).condition;
+        double x;
+        if (!aggregate_get(aggregate, condition->subject, &x)) continue;
+        rule_state_update(state, series->topic, condition_holds(condition, x), message);
+    }
+}
+
+// Windows
+// ------------------------------------------------------------------------------------------------------- //
+
+// -window <topic pattern> <length>[/<slide>] keeps the count, min, max, mean and quantiles of the numbers of
+// every matching topic over the last <length> seconds, and emits them every <slide> seconds, which is <length>
+// when there's no slide (a tumbling window). Windows go by arrival time and are aligned to multiples of the
+// slide. A sliding window is a ring of length/slide panes that only get merged when the window closes, so a
+// message costs adding its number to the current pane.
+
+#define WINDOW_MAX_PANES 60
+
+bool add_window(String const pattern, String const length)
+{
+    Window_Spec spec = {};
+    ssize_t const slash = string_find_char(length, '/');
+    String const total = slash < 0 ? length : (String){ .data = length.data, .length = slash };
+    String const slide = slash < 0 ? length : (String){ .data = length.data + slash + 1, .length = length.length - slash - 1 };
+    double total_seconds, slide_seconds;
+    if (!string_to_double(total, &total_seconds) || !string_to_double(slide, &slide_seconds)) goto had_error;
+
+    spec.length_ms = total_seconds * 1000;
+    spec.slide_ms = slide_seconds * 1000;
+    if (spec.slide_ms == 0 || spec.length_ms % spec.slide_ms != 0 || spec.length_ms / spec.slide_ms > WINDOW_MAX_PANES) {
+        goto had_error;
+    }
+    spec.pane_count = spec.length_ms / spec.slide_ms;
+
+    spec.pattern = parse_topic(pattern);
+    if (!is_topic_valid(spec.pattern)) goto had_error;
+
+    String_Builder source = {};
+    string_builder_appendf(&source, PRI_String " " PRI_String, fmt_String(pattern), fmt_String(length));
+    spec.source = String_from_builder(source);
+    uint64_t const now = time_now_ms();
+    spec.next_close_ms = now - now % spec.slide_ms + spec.slide_ms;
+    list_append(&engine.windows, spec);
+    return true;
+
+had_error:
+    eprintfln("ERROR: Invalid window \"" PRI_String " " PRI_String "\"", fmt_String(pattern), fmt_String(length));
+    eprintfln("       Expected: <topic pattern> <seconds>[/<slide seconds>], with at most %d slides per window", WINDOW_MAX_PANES);
+    return false;
+}
+
+// Emits the aggregates of the window that ends with the current pane.
+void window_close(Window_State const* state)
+{
+    Window_Spec const* spec = &list_get(engine.windows, state->spec);
+    Aggregate aggregate = {};
+    for (size_t i = 0; i < spec->pane_count; i++) {
+        aggregate_merge(&aggregate, &list_get(engine.panes, state->first_pane + i));
+    }
+    if (aggregate.count == 0) {
+        aggregate_destroy(&aggregate);
+        return;
+    }
+
+    Rule_Series const* series = &list_get(engine.series, state->series);
+    String_Builder text = {};
+    string_builder_appendf(&text, "(topic: " PRI_String ", last %gs): count %llu, min %g, max %g, mean %g, p50 %g, p90 %g, p99 %g",
+            fmt_String(series->topic), spec->length_ms / 1000.0, (unsigned long long)aggregate.count,
+            aggregate.min, aggregate.max, aggregate.sum / aggregate.count, aggregate_quantile(&aggregate, 0.50),
+            aggregate_quantile(&aggregate, 0.90), aggregate_quantile(&aggregate, 0.99));
+    printfln("Window " PRI_String, fmt_String_Builder(text));
+    evaluate_aggregate_rules(series, &aggregate, String_from_builder(text));
+    list_destroy_safely(&text);
+    aggregate_destroy(&aggregate);
+}
+
+// Closes every window that ended before `now`.
+void window_advance(Window_State* state, uint64_t const now)
+{
+    Window_Spec const* spec = &list_get(engine.windows, state->spec);
+    uint64_t const pane_start = now - now % spec->slide_ms;
+    for (uint32_t closed = 0; state->pane_start_ms < pane_start; closed++) {
+        if (closed == spec->pane_count) {
+            // Every pane is empty by now, there's nothing to emit for the rest of the idle time.
+            state->pane_start_ms = pane_start;
+            break;
+        }
+        window_close(state);
+        state->pane_start_ms += spec->slide_ms;
+        state->current = (state->current + 1) % spec->pane_count;
+        aggregate_reset(&list_get(engine.panes, state->first_pane + state->current));
+    }
+}
+
+void window_add(Rule_Series const* series, double const number, uint64_t const now)
+{
+    for (size_t i = 0; i < series->window_count; i++) {
+        Window_State* state = &list_get(engine.window_states, series->first_window + i);
+        window_advance(state, now);
+        aggregate_add(&list_get(engine.panes, state->first_pane + state->current), number);
+    }
+}
+
+// Closes the windows of topics that stopped getting messages. Returns when it should be called again, or
+// UINT64_MAX when there are no windows.
+uint64_t windows_tick(uint64_t const now)
+{
+    uint64_t next_close_ms = UINT64_MAX;
+    for (size_t i = 0; i < engine.windows.count; i++) {
+        Window_Spec* spec = &list_get(engine.windows, i);
+        if (spec->next_close_ms <= now) {
+            for (size_t j = 0; j < engine.window_states.count; j++) {
+                Window_State* state = &list_get(engine.window_states, j);
+                if (state->spec == i) window_advance(state, now);
+            }
+            spec->next_close_ms = now - now % spec->slide_ms + spec->slide_ms;
+        }
+        next_close_ms = Min(next_close_ms, spec->next_close_ms);
     }
+    return next_close_ms;
+}
 
-    return broker_fd;
+// Every number of every topic goes through here, with the time of the message in milliseconds: when it was
+// published for typed messages, when it arrived for text ones.
+void handle_number(String const topic, double const number, uint64_t const timestamp_ms, String const message)
+{
+    Rule_Series const* series = rule_series_get(topic);
+    if (series == NULL) return;
+    evaluate_rules(series, number, timestamp_ms, message);
+    window_add(series, number, time_now_ms());
 }
 
+// Alerts
+// ------------------------------------------------------------------------------------------------------- //
+
+// Running ./message.sh takes a while, so the receive loop only records the breach and a separate thread sends
+// the notifications. Each rule of each topic is notified at most once per interval, the breaches that happen in
+// between are coalesced into the next notification.
+
+#define ALERT_QUEUE_CAPACITY 64
+#define ALERT_DEFAULT_INTERVAL_SECONDS 60
+
+typedef struct {
+    String topic;          // Owned.
+    size_t rule;
+    String message;        // Owned, the latest message that exceeded the threshold.
+    size_t breaches;       // Since the last notification.
+    uint64_t last_sent_ms; // 0 when it was never notified.
+    bool queued;
+} Alert_Topic;
+
+typedef struct {
+    Alert_Topic* data;
+    size_t count, capacity;
+} Alert_Topic_list;
+
+typedef struct {
+    Alert_Topic_list topics;
+    Hash_Index topics_index;            // By the hash of the topic, the rules of a topic share it.
+    size_t queue[ALERT_QUEUE_CAPACITY]; // Indexes into `topics`, in the order they breached.
+    size_t queued;
+    size_t dropped;
+    uint64_t interval_ms;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} Alert_Dispatcher;
+
+static Alert_Dispatcher alerts = {
+    .interval_ms = ALERT_DEFAULT_INTERVAL_SECONDS * 1000,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
 int listen_to_broker(const char *host, int port) {
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
@@ -74,35 +469,378 @@ void usage(const char **argv)
     eprintfln("\nflags:");
     eprintfln("    -persistent: Makes the session persistent. It is NOT persistent by default.");
     eprintfln("    -threshold <arg>: Enables sending whatsapp notifications when a message exceeds <arg> (which is an int).");
+    eprintfln("    -rules <file>: Sends notifications for the rules in <file>, one per line:");
+    eprintfln("                   <topic pattern> <subject> <op> <number> [<number>] [for <n> of <m>]");
+    eprintfln("                   <subject> is value, rate (per second) or the aggregate of a window: count min max mean p50 p90 p99.");
+    eprintfln("                   <op> is one of > >= < <= == != between outside.");
+    eprintfln("    -window <topic pattern> <seconds>[/<slide seconds>]: Prints the aggregates of the matching topics over");
+    eprintfln("                   the last <seconds>, every <slide seconds> (<seconds> by default). Can be repeated.");
+    eprintfln("                   Each matching topic keeps a sketch per slide: 8 bytes per 2%% step between its lowest and");
+    eprintfln("                   highest value, at most %d KiB.", SKETCH_MAX_BUCKETS * (int)sizeof(Sketch_Bucket) / 1024);
+    eprintfln("    -typed: Receive binary typed values from the broker instead of text.");
+    eprintfln("    -filter \"value <op> <number> [<number>]\": Makes the broker send only the messages whose value passes.");
+    eprintfln("    -query-port <port>: Answers queries for the latest value of the topics matching a pattern on <port>.");
+    eprintfln("    -alert-interval <seconds>: Minimum time between two notifications of the same topic. %d by default.", ALERT_DEFAULT_INTERVAL_SECONDS);
     eprintfln();
     exit(EXIT_FAILURE);
 }
 
-void send_threshold_twilio_message(const String message, double threshold)
+void send_alert_message(const String message, Rule const* rule, size_t breaches)
 {
-    printfln("Sending notification that the message " PRI_String " exceeds the threshold of %g%%'",
-            fmt_String(message), threshold);
+    printfln("Sending notification that the message " PRI_String " broke the rule \"" PRI_String "\" (%zu times)",
+            fmt_String(message), fmt_String(rule->source), breaches);
     char command[1<<10];
-    snprintf(command, sizeof command, "./message.sh 'In %s the message " PRI_String " exceeds the threshold of %g%%'",
-            ctx.subscriber_name, fmt_String(message), threshold);
+    snprintf(command, sizeof command, "./message.sh 'In %s the message " PRI_String " broke the rule \"" PRI_String "\" (%zu times)'",
+            ctx.subscriber_name, fmt_String(message), fmt_String(rule->source), breaches);
     system(command);
 }
 
-void notify_if_exceeds(const String message, double threshold)
+// Never blocks on the notification itself.
+void alert_submit(String const topic, size_t const rule, String const message)
 {
-    const String value_prefix = str8("value: \"");
-    ssize_t value_index = string_find_substr(message, value_prefix);
-    if (value_index < 0) {
-        eprintfln("ERROR: Message does not have value.");
-        return;
+    pthread_mutex_lock(&alerts.mutex);
+
+    uint64_t const hash = hash_string(topic);
+    size_t probe = 0;
+    uint32_t index;
+    while ((index = hash_index_next(&alerts.topics_index, hash, &probe)) != HASH_INDEX_EMPTY) {
+        Alert_Topic const* it = &list_get(alerts.topics, index);
+        if (it->rule == rule && string_equals(it->topic, topic)) break;
     }
-    String value = {
-        .data = message.data + value_index + value_prefix.length,
-        .length = message.length - value_index - value_prefix.length,
-    };
-    const double message_threshold = strtod(value.data, NULL);
-    if (message_threshold > threshold) {
-        send_threshold_twilio_message(message, threshold);
+    if (index == HASH_INDEX_EMPTY) {
+        list_append(&alerts.topics, ((Alert_Topic){ .topic = string_clone(topic), .rule = rule }));
+        index = alerts.topics.count - 1;
+        hash_index_insert(&alerts.topics_index, hash, index);
+    }
+    Alert_Topic* alert = &list_get(alerts.topics, index);
+
+    alert->breaches++;
+    if (!is_string_null(alert->message)) {
+        string_destroy(&alert->message);
+    }
+    alert->message = string_clone(message);
+
+    if (!alert->queued) {
+        if (alerts.queued < ALERT_QUEUE_CAPACITY) {
+            alerts.queue[alerts.queued++] = index;
+            alert->queued = true;
+            pthread_cond_signal(&alerts.changed);
+        } else {
+            // The breach is still counted and goes out with the next notification of this topic.
+            alerts.dropped++;
+        }
+    }
+
+    pthread_mutex_unlock(&alerts.mutex);
+}
+
+void* alert_dispatcher(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&alerts.mutex);
+    for (;;) {
+        while (alerts.queued == 0) {
+            pthread_cond_wait(&alerts.changed, &alerts.mutex);
+        }
+
+        // The queued topic whose interval ends first.
+        uint64_t const now = time_now_ms();
+        size_t next = 0;
+        uint64_t next_due = UINT64_MAX;
+        for (size_t i = 0; i < alerts.queued; i++) {
+            Alert_Topic const alert = list_get(alerts.topics, alerts.queue[i]);
+            uint64_t due = alert.last_sent_ms == 0 ? 0 : alert.last_sent_ms + alerts.interval_ms;
+            if (due < next_due) {
+                next = i;
+                next_due = due;
+            }
+        }
+        if (next_due > now) {
+            struct timespec deadline = timespec_after_ms(next_due - now);
+            pthread_cond_timedwait(&alerts.changed, &alerts.mutex, &deadline);
+            continue;
+        }
+
+        Alert_Topic* alert = &list_get(alerts.topics, alerts.queue[next]);
+        memmove(&alerts.queue[next], &alerts.queue[next + 1], (alerts.queued - next - 1) * sizeof(alerts.queue[0]));
+        alerts.queued--;
+        alert->queued = false;
+        alert->last_sent_ms = now;
+        String message = alert->message;
+        alert->message = (String){};
+        size_t const breaches = alert->breaches;
+        alert->breaches = 0;
+        Rule const* rule = &list_get(engine.rules, alert->rule);
+        pthread_mutex_unlock(&alerts.mutex);
+
+        send_alert_message(message, rule, breaches);
+        string_destroy(&message);
+
+        pthread_mutex_lock(&alerts.mutex);
+    }
+    return NULL;
+}
+
+// Last Values
+// ------------------------------------------------------------------------------------------------------- //
+
+// With -query-port the subscriber remembers the latest value of every topic and answers pattern queries about
+// them without asking the broker. The values live in fixed size slots of a slab, so updating a known topic
+// copies the value into its slot without allocating. Only values longer than a slot get their own copy.
+//
+// Query protocol: the client sends a topic pattern per line and gets back one line per matching topic in the
+// same format as the deliveries, followed by an empty line.
+
+#define LAST_VALUE_SLOT_SIZE     96
+#define LAST_VALUE_INITIAL_SLOTS 1024
+
+typedef struct {
+    Topic topic; // Owned.
+    uint32_t length;
+    String overflow; // Owned, the value when it doesn't fit in its slot.
+} Last_Value;
+
+typedef struct {
+    Last_Value* data;
+    size_t count, capacity;
+} Last_Value_list;
+
+typedef struct {
+    bool enabled;
+    Last_Value_list entries;
+    Hash_Index index;
+    char* slab; // LAST_VALUE_SLOT_SIZE bytes per entry.
+    size_t slab_slots;
+} Last_Value_Cache;
+
+// Only used from the receive loop.
+static Last_Value_Cache last_values = {};
+
+String last_value_get(size_t const index)
+{
+    Last_Value const* entry = &list_get(last_values.entries, index);
+    if (!is_string_null(entry->overflow)) {
+        return entry->overflow;
+    }
+    return (String){ .data = last_values.slab + index * LAST_VALUE_SLOT_SIZE, .length = entry->length };
+}
+
+void last_value_set(String const topic, String const value)
+{
+    uint64_t const hash = hash_string(topic);
+    size_t probe = 0;
+    uint32_t index;
+    while ((index = hash_index_next(&last_values.index, hash, &probe)) != HASH_INDEX_EMPTY) {
+        if (string_equals(list_get(last_values.entries, index).topic.original, topic)) break;
+    }
+
+    if (index == HASH_INDEX_EMPTY) {
+        Topic parsed = parse_topic(topic);
+        if (!is_topic_valid(parsed)) return;
+        if (last_values.entries.count == last_values.slab_slots) {
+            last_values.slab_slots = last_values.slab_slots == 0 ? LAST_VALUE_INITIAL_SLOTS : last_values.slab_slots * 2;
+            last_values.slab = realloc(last_values.slab, last_values.slab_slots * LAST_VALUE_SLOT_SIZE);
+            assert(last_values.slab != NULL);
+        }
+        list_append(&last_values.entries, ((Last_Value){ .topic = parsed }));
+        index = last_values.entries.count - 1;
+        hash_index_insert(&last_values.index, hash, index);
+    }
+
+    Last_Value* entry = &list_get(last_values.entries, index);
+    if (!is_string_null(entry->overflow)) {
+        string_destroy(&entry->overflow);
+    }
+    if (value.length <= LAST_VALUE_SLOT_SIZE) {
+        memcpy(last_values.slab + index * LAST_VALUE_SLOT_SIZE, value.data, value.length);
+    } else {
+        entry->overflow = string_clone(value);
+    }
+    entry->length = value.length;
+}
+
+// Answers a single query line.
+void answer_query(int const fd, String const line)
+{
+    String_Builder answer = {};
+    Topic pattern = parse_topic(string_trim(line));
+    if (is_topic_valid(pattern)) {
+        for (size_t i = 0; i < last_values.entries.count; i++) {
+            Last_Value const* entry = &list_get(last_values.entries, i);
+            if (!topics_match(pattern, entry->topic)) continue;
+            String const value = last_value_get(i);
+            string_builder_appendf(&answer, "(topic: " PRI_Topic ", value: \"" PRI_String "\")\n",
+                    fmt_Topic(entry->topic), fmt_String(value));
+        }
+        topic_destroy(&pattern);
+    }
+    string_builder_appendf(&answer, "\n");
+    send_all(fd, String_from_builder(answer));
+    list_destroy_safely(&answer);
+}
+
+// Typed values come with the number already parsed.
+void handle_typed_message(Typed_Message const* message)
+{
+    String_Builder value = {};
+    metric_value_append_text(&value, &message->value);
+    String_Builder text = {};
+    string_builder_appendf(&text, "(topic: " PRI_String ", value: \"" PRI_String "\")",
+            fmt_String(message->topic), fmt_String_Builder(value));
+    printfln("Received message: " PRI_String, fmt_String_Builder(text));
+    if (last_values.enabled) {
+        last_value_set(message->topic, String_from_builder(value));
+    }
+
+    double number;
+    if ((engine.rules.count > 0 || engine.windows.count > 0) && metric_value_number(&message->value, &number)) {
+        handle_number(message->topic, number, message->timestamp, String_from_builder(text));
+    }
+
+    list_destroy_safely(&value);
+    list_destroy_safely(&text);
+}
+
+void handle_text_message(String const message)
+{
+    printfln("Received message: %.*s", fmt_String(message));
+
+    if (engine.rules.count > 0 || engine.windows.count > 0 || last_values.enabled) {
+        String topic, value;
+        if (!parse_delivery_line(message, &topic, &value)) {
+            eprintfln("ERROR: Message does not have value.");
+            return;
+        }
+        if (last_values.enabled) {
+            last_value_set(topic, value);
+        }
+        if (engine.rules.count == 0 && engine.windows.count == 0) return;
+        Metric_Value const typed = metric_value_parse(value);
+        double number;
+        if (metric_value_number(&typed, &number)) {
+            handle_number(topic, number, time_now_ms(), message);
+        }
+    }
+}
+
+#define RECEIVE_CHUNK_SIZE (64 * 1024)
+
+// The broker keeps its connection open and streams messages through it: text lines, or frames when typed.
+// Query clients use the same struct for their connections.
+typedef struct {
+    int fd;
+    String_Builder pending; // Start of a message whose bytes haven't all arrived yet.
+} Broker_Connection;
+
+typedef struct {
+    Broker_Connection* data;
+    size_t count, capacity;
+} Broker_Connection_list;
+
+typedef struct {
+    struct pollfd* data;
+    size_t count, capacity;
+} Pollfd_list;
+
+// Handles every complete message at the start of `pending` and returns how many bytes they took.
+size_t handle_messages(String const pending)
+{
+    size_t consumed = 0;
+    for (;;) {
+        String const rest = { .data = pending.data + consumed, .length = pending.length - consumed };
+        if (ctx.typed) {
+            String record;
+            size_t frame_size;
+            if (!frame_parse(rest, &record, &frame_size)) break;
+            if (!record_for_each_message(record, handle_typed_message)) {
+                eprintfln("ERROR: Received a malformed record of %zu bytes", record.length);
+            }
+            consumed += frame_size;
+        } else {
+            ssize_t newline = string_find_char(rest, '\n');
+            if (newline < 0) break;
+            if (newline > 0) {
+                handle_text_message((String){ .data = rest.data, .length = newline });
+            }
+            consumed += newline + 1;
+        }
+    }
+    return consumed;
+}
+
+// Returns false once the broker closed the connection.
+bool receive_messages(Broker_Connection* connection)
+{
+    String_Builder* pending = &connection->pending;
+    string_builder_grow_if_needed(pending, RECEIVE_CHUNK_SIZE);
+    ssize_t bytes_read = recv(connection->fd, pending->data + pending->count, pending->capacity - pending->count, 0);
+    if (bytes_read <= 0) {
+        if (bytes_read < 0) {
+            perror("ERROR: broker connection recv");
+        }
+        return false;
+    }
+    pending->count += bytes_read;
+
+    size_t const consumed = handle_messages(String_from_builder(*pending));
+    memmove(pending->data, pending->data + consumed, pending->count - consumed);
+    pending->count -= consumed;
+    return true;
+}
+
+// Returns false once the client closed the connection.
+bool receive_queries(Broker_Connection* connection)
+{
+    String_Builder* pending = &connection->pending;
+    string_builder_grow_if_needed(pending, BUFFER_SIZE);
+    ssize_t bytes_read = recv(connection->fd, pending->data + pending->count, pending->capacity - pending->count, 0);
+    if (bytes_read <= 0) {
+        return false;
+    }
+    pending->count += bytes_read;
+
+    size_t consumed = 0;
+    for (;;) {
+        String const rest = { .data = pending->data + consumed, .length = pending->count - consumed };
+        ssize_t newline = string_find_char(rest, '\n');
+        if (newline < 0) break;
+        answer_query(connection->fd, (String){ .data = rest.data, .length = newline });
+        consumed += newline + 1;
+    }
+    memmove(pending->data, pending->data + consumed, pending->count - consumed);
+    pending->count -= consumed;
+    // Nobody sends patterns this long.
+    return pending->count < BUFFER_SIZE;
+}
+
+// Closes the connections whose entries in `pollfds` (starting at `first_pollfd`) have events and `receive`
+// returns false for.
+void poll_connections(Broker_Connection_list* connections, Pollfd_list const pollfds, size_t const first_pollfd,
+        bool (*receive)(Broker_Connection*))
+{
+    // Walking backwards so closed connections can be swapped with the last one.
+    for (size_t i = connections->count; i > 0; i--) {
+        Broker_Connection* connection = &list_get(*connections, i - 1);
+        if (list_get(pollfds, first_pollfd + i - 1).revents == 0) continue;
+        if (!receive(connection)) {
+            close(connection->fd);
+            list_destroy_safely(&connection->pending);
+            *connection = list_get_last(*connections);
+            connections->count--;
+        }
+    }
+}
+
+void accept_connection(int const listen_fd, Broker_Connection_list* connections)
+{
+    struct sockaddr_in client;
+    socklen_t len = sizeof(client);
+    int fd = accept(listen_fd, (struct sockaddr *)&client, &len);
+    if (fd < 0) {
+        perror("ERROR: listener accept");
+    } else {
+        list_append(connections, ((Broker_Connection){ .fd = fd }));
     }
 }
 
@@ -116,33 +854,92 @@ int main(int argc, const char** argv)
 
     ctx.subscriber_name = argv[1];
     ctx.topic = argv[2];
-    int broker_port = atoi(argv[3]);
+    const char *broker_port = argv[3];
     const char *broker_host = LOCALHOST;
     const char *listen_host = LOCALHOST;
     int listen_port = atoi(argv[4]);
+    int query_port = -1;
 
 
     bool persistent = false;
-    bool uses_threshold = false;
-    double threshold = 0.0;
 
     for (const char **flag = &argv[5]; *flag != NULL; flag++) {
         if (strcmp(*flag, "-persistent") == 0) {
             persistent = true;
         } else if (strcmp(*flag, "-threshold") == 0) {
-            uses_threshold = true;
             flag++;
             if (*flag == NULL) {
                 eprintfln("ERROR: Must supply an argument to specify the threshold.\n");
                 usage(argv);
             }
-            threshold = strtod(*flag, NULL);
+            char rule[128];
+            snprintf(rule, sizeof(rule), "# value > %g", strtod(*flag, NULL));
+            add_rule(String_from_cstr(rule));
+        } else if (strcmp(*flag, "-rules") == 0) {
+            flag++;
+            if (*flag == NULL) {
+                eprintfln("ERROR: Must supply the path of the rules file.\n");
+                usage(argv);
+            }
+            if (!load_rules(*flag)) {
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(*flag, "-window") == 0) {
+            if (flag[1] == NULL || flag[2] == NULL) {
+                eprintfln("ERROR: Must supply the topic pattern and the length of the window.\n");
+                usage(argv);
+            }
+            if (!add_window(String_from_cstr(flag[1]), String_from_cstr(flag[2]))) {
+                exit(EXIT_FAILURE);
+            }
+            flag += 2;
+        } else if (strcmp(*flag, "-query-port") == 0) {
+            flag++;
+            if (*flag == NULL) {
+                eprintfln("ERROR: Must supply the port to answer queries on.\n");
+                usage(argv);
+            }
+            query_port = atoi(*flag);
+            last_values.enabled = true;
+        } else if (strcmp(*flag, "-typed") == 0) {
+            ctx.typed = true;
+        } else if (strcmp(*flag, "-filter") == 0) {
+            flag++;
+            if (*flag == NULL) {
+                eprintfln("ERROR: Must supply the condition to filter by.\n");
+                usage(argv);
+            }
+            // The broker would drop a registration with a bad filter without telling us.
+            Condition condition;
+            String_list words = string_split_words(String_from_cstr(*flag));
+            bool const valid = parse_condition(words, 0, &condition) == words.count && words.count > 0 &&
+                               condition.subject == SUBJECT_VALUE;
+            list_destroy_safely(&words);
+            if (!valid) {
+                eprintfln("ERROR: The filter must be \"value <op> <number> [<number>]\", not \"%s\".\n", *flag);
+                usage(argv);
+            }
+            ctx.filter = *flag;
+        } else if (strcmp(*flag, "-alert-interval") == 0) {
+            flag++;
+            if (*flag == NULL) {
+                eprintfln("ERROR: Must supply an argument to specify the alert interval.\n");
+                usage(argv);
+            }
+            alerts.interval_ms = (uint64_t)(strtod(*flag, NULL) * 1000);
         } else {
             eprintfln("ERROR: Unrecognized flag \"%s\".\n", *flag);
             usage(argv);
         }
     }
 
+    for (size_t i = 0; i < engine.rules.count && engine.windows.count == 0; i++) {
+        Rule const rule = list_get(engine.rules, i);
+        if (is_aggregate_subject(rule.condition.subject)) {
+            eprintfln("WARNING: The rule \"" PRI_String "\" needs a -window to be evaluated", fmt_String(rule.source));
+        }
+    }
+
     Topic parsed_topic = parse_topic(String_from_cstr(ctx.topic));
     if (!is_topic_valid(parsed_topic)) {
         exit(EXIT_FAILURE);
@@ -151,13 +948,38 @@ int main(int argc, const char** argv)
     printf("Subscriber starting...\n");
     printf(" - Name: %s\n", ctx.subscriber_name);
     printf(" - Topic: %s\n", ctx.topic);
-    printf(" - Broker: %s:%d\n", broker_host, broker_port);
+    printf(" - Broker: %s:%s\n", broker_host, broker_port);
     printf(" - Listening on %s:%d\n", listen_host, listen_port);
     printf(" - Persistent: %s\n", cstr_from_bool(persistent));
-    if (uses_threshold) {
-        printf(" - Threshold: %g\n", threshold);
+    printf(" - Typed: %s\n", cstr_from_bool(ctx.typed));
+    if (ctx.filter != NULL) {
+        printf(" - Filter: %s\n", ctx.filter);
+    }
+    if (last_values.enabled) {
+        printf(" - Answering queries on %s:%d\n", listen_host, query_port);
+    }
+    if (engine.rules.count > 0) {
+        printf(" - Rules:\n");
+        for (size_t i = 0; i < engine.rules.count; i++) {
+            printf("    " PRI_String "\n", fmt_String(list_get(engine.rules, i).source));
+        }
+        printf(" - Alert interval: %gs\n", alerts.interval_ms / 1000.0);
     } else {
-        printf(" - Threshold: Not existent\n");
+        printf(" - Rules: Not existent\n");
+    }
+    if (engine.windows.count > 0) {
+        printf(" - Windows:\n");
+        for (size_t i = 0; i < engine.windows.count; i++) {
+            printf("    " PRI_String "\n", fmt_String(list_get(engine.windows, i).source));
+        }
+    }
+
+    if (engine.rules.count > 0) {
+        pthread_t alert_thread;
+        if (pthread_create(&alert_thread, NULL, alert_dispatcher, NULL) != 0) {
+            eprintfln("ERROR: Failed to create the alert dispatcher thread");
+            exit(EXIT_FAILURE);
+        }
     }
 
     int listen_fd = listen_to_broker(listen_host, listen_port);
@@ -166,45 +988,63 @@ int main(int argc, const char** argv)
         exit(EXIT_FAILURE);
     }
 
-    /* Sending the registration message to the Broker */ {
-        int broker_fd = connect_to_broker(broker_host, broker_port);
-        if (broker_fd < 0) {
-            eprintfln("Could not connect to broker at %s:%d.", broker_host, broker_port);
-            close(listen_fd);
-            return 1;
+    int query_fd = -1;
+    if (last_values.enabled) {
+        query_fd = listen_to_broker(listen_host, query_port);
+        if (query_fd < 0) {
+            eprintfln("Failed to start the query listener.");
+            exit(EXIT_FAILURE);
         }
+    }
 
+    /* Sending the registration message to the Broker */ {
         char registration_message[256];
-        snprintf(registration_message, sizeof(registration_message), "%s|%s:%d|%s\n",
-                ctx.topic, listen_host, listen_port, persistent ? "p" : "-");
+        snprintf(registration_message, sizeof(registration_message), "%s|%s:%d|%s|name=%s%s%s%s\n",
+                ctx.topic, listen_host, listen_port, persistent ? "p" : "-", ctx.subscriber_name, ctx.typed ? "|typed" : "",
+                ctx.filter != NULL ? "|filter=" : "", ctx.filter != NULL ? ctx.filter : "");
 
         printf("Sending registration: %s\n", registration_message);
-        send(broker_fd, registration_message, strlen(registration_message), 0);
-        close(broker_fd);
+        Endpoint* broker = connection_pool_get(&ctx.broker_connections, broker_host, broker_port);
+        while (!endpoint_send(broker, String_from_cstr(registration_message))) {
+            eprintfln("Could not reach broker at %s:%s, retrying...", broker_host, broker_port);
+            endpoint_wait_for_retry(broker);
+        }
+        connection_pool_release(&ctx.broker_connections, broker_host, broker_port);
     }
 
+    Broker_Connection_list connections = {};
+    Broker_Connection_list query_connections = {};
+    Pollfd_list pollfds = {};
+
     while (true) {
-        struct sockaddr_in client;
-        socklen_t len = sizeof(client);
+        // The listeners first, then the broker connections and then the query connections.
+        pollfds.count = 0;
+        list_append(&pollfds, ((struct pollfd){ .fd = listen_fd, .events = POLLIN }));
+        list_append(&pollfds, ((struct pollfd){ .fd = query_fd, .events = POLLIN }));
+        for (size_t i = 0; i < connections.count; i++) {
+            list_append(&pollfds, ((struct pollfd){ .fd = list_get(connections, i).fd, .events = POLLIN }));
+        }
+        for (size_t i = 0; i < query_connections.count; i++) {
+            list_append(&pollfds, ((struct pollfd){ .fd = list_get(query_connections, i).fd, .events = POLLIN }));
+        }
 
-        int connection = accept(listen_fd, (struct sockaddr *)&client, &len);
-        if (connection < 0) {
-            perror("ERROR: listener accept");
+        uint64_t const now = time_now_ms();
+        uint64_t const next_close_ms = windows_tick(now);
+        int const timeout = next_close_ms == UINT64_MAX ? -1 : (int)(next_close_ms - now);
+        if (poll(pollfds.data, pollfds.count, timeout) < 0) {
+            if (errno != EINTR) perror("ERROR: poll");
             continue;
         }
 
-        char buffer[BUFFER_SIZE];
-        ssize_t bytes_read = recv(connection, buffer, sizeof(buffer), 0);
-        if (bytes_read > 0) {
-            const String message = { .data = buffer, .length = bytes_read };
-            printfln("Received message: %.*s", fmt_String(message));
+        poll_connections(&query_connections, pollfds, 2 + connections.count, receive_queries);
+        poll_connections(&connections, pollfds, 2, receive_messages);
 
-            if (uses_threshold) {
-                notify_if_exceeds(message, threshold);
-            }
+        if (list_get(pollfds, 0).revents & POLLIN) {
+            accept_connection(listen_fd, &connections);
+        }
+        if (list_get(pollfds, 1).revents & POLLIN) {
+            accept_connection(query_fd, &query_connections);
         }
-
-        close(connection);
     }
 
     close(listen_fd);
@@ -12,6 +12,126 @@
 
 #define cstr_topics_match(a, b) topics_match(parse_topic(str8(a)), parse_topic(str8(b)))
 
+bool cstr_condition_holds(const char* text, double x)
+{
+    Condition condition;
+    String_list words = string_split_words(String_from_cstr(text));
+    size_t const taken = parse_condition(words, 0, &condition);
+    bool const holds = taken == words.count && condition_holds(&condition, x);
+    list_destroy_safely(&words);
+    return holds;
+}
+
+// Whether parsing in place gives the same topic levels as splitting the topic with parse_topic() does.
+bool levels_match_parse_topic(const char* text)
+{
+    Publisher_Message message = parse_publisher_message(String_from_cstr(text));
+    if (!is_publisher_message_valid(message)) return false;
+    Topic topic = parse_topic(message.topic.original);
+    bool same = topic.levels.count == message.topic.levels.count &&
+                topic.multilevel_wildcard_index == message.topic.multilevel_wildcard_index;
+    for (size_t i = 0; same && i < topic.levels.count; i++) {
+        same = string_equals(topic_get_level(topic, i), topic_get_level(message.topic, i));
+    }
+    topic_destroy(&topic);
+    publisher_message_destroy(&message);
+    return same;
+}
+
+// Round trips a series and returns whether every point came back the same.
+bool series_round_trips(int64_t const* timestamps, double const* values, size_t count)
+{
+    Series_Encoder encoder = {};
+    for (size_t i = 0; i < count; i++) {
+        series_append(&encoder, timestamps[i], values[i]);
+    }
+
+    Series_Decoder decoder = series_decoder_make(String_from_builder(encoder.bits.bytes), encoder.count);
+    bool same = true;
+    size_t decoded = 0;
+    int64_t timestamp;
+    double value;
+    while (series_next(&decoder, &timestamp, &value)) {
+        same = same && timestamp == timestamps[decoded] && value == values[decoded];
+        decoded++;
+    }
+    series_destroy(&encoder);
+    return same && decoded == count;
+}
+
+void check_minus_seven(Typed_Message const* message)
+{
+    assert_eq(message->value.fields[0].kind, FIELD_I64);
+    assert_eq(message->value.fields[0].i64, -7);
+    assert_eq(message->timestamp, 1700000000123);
+}
+
+// Compares the vectorized string functions with their scalar versions over random strings of a small alphabet,
+// so matches show up everywhere including around the 16 and 32 byte boundaries.
+bool strings_agree_with_scalar(void)
+{
+    char haystack[200], needle[8];
+    srand(42);
+    for (int round = 0; round < 20000; round++) {
+        String const str = { .data = haystack, .length = rand() % sizeof(haystack) };
+        String const sub = { .data = needle, .length = rand() % sizeof(needle) };
+        for (size_t i = 0; i < str.length; i++) haystack[i] = "ab|/"[rand() % 4];
+        for (size_t i = 0; i < sub.length; i++) needle[i] = "ab|/"[rand() % 4];
+        char const c = "ab|/x"[rand() % 5];
+        String const prefix = { .data = haystack, .length = Min(str.length, sub.length) };
+
+        if (string_find_char(str, c) != string_find_char_scalar(str, c)) return false;
+        if (string_find_substr(str, sub) != string_find_substr_scalar(str, sub)) return false;
+        if (string_equals(prefix, sub) != string_equals_scalar(prefix, sub)) return false;
+        if (!string_equals(str, str)) return false;
+#ifdef STRING_SIMD
+        if (string_find_char_sse2(str, c) != string_find_char_scalar(str, c)) return false;
+        if (string_find_substr_sse2(str, sub) != string_find_substr_scalar(str, sub)) return false;
+        if (string_equals_sse2(prefix, sub) != string_equals_scalar(prefix, sub)) return false;
+#endif
+
+        String_list parts = string_split(str, c);
+        String_list expected = string_split_scalar(str, c);
+        bool same = parts.count == expected.count;
+        for (size_t i = 0; same && i < parts.count; i++) {
+            same = list_get(parts, i).data == list_get(expected, i).data && list_get(parts, i).length == list_get(expected, i).length;
+        }
+        list_destroy_safely(&parts);
+        list_destroy_safely(&expected);
+        if (!same) return false;
+    }
+    return true;
+}
+
+// Whether a log record formats the same as printf() with the same arguments.
+bool log_record_formats_like_printf(const char* fmt, ...)
+{
+    char expected[LOG_RECORD_MAX];
+    char record[LOG_RECORD_MAX];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(expected, sizeof(expected), fmt, args);
+    va_end(args);
+    va_start(args, fmt);
+    size_t const size = log_encode_arguments(record, 0, fmt, args);
+    va_end(args);
+
+    String_Builder formatted = {};
+    log_format_record(&formatted, fmt, record, size);
+    bool const same = string_equals(String_from_builder(formatted), String_from_cstr(expected));
+    if (!same) {
+        eprintfln("ERROR: \"%.*s\" instead of \"%s\"", fmt_String_Builder(formatted), expected);
+    }
+    list_destroy(&formatted);
+    return same;
+}
+
+// Only the timestamp matters for the log tests.
+void log_message_with_number(Message_Log* log, int const number)
+{
+    message_log_append(log, (Publisher_Message){ .timestamp = number });
+}
+
 int main() {
     assert_eq(cstr_topics_match("a", "b"), false);
     assert_eq(cstr_topics_match("#", "b"), true);
@@ -24,6 +144,312 @@ int main() {
     assert_eq(cstr_topics_match("+/b", "a/b/c"), false);
     assert_eq(cstr_topics_match("#", "a/b/c"), true);
     assert_eq(cstr_topics_match("a/b/c/#", "a/#"), true);
+    assert_eq(cstr_topics_match("+/+/cpu-usage", "h1/x/cpu-usage"), true);
+    assert_eq(cstr_topics_match("+/+/cpu-usage", "h1/x/mem-usage"), false);
+    assert_eq(cstr_topics_match("a/b/#", "a/b"), true);
+    assert_eq(cstr_topics_match("a/b/#", "a"), false);
+    assert_eq(cstr_topics_match("a/b", "a/b/"), false);
+    assert_eq(cstr_topics_match("#", "$SYS/broker/messages/in"), false);
+    assert_eq(cstr_topics_match("+/broker/#", "$SYS/broker/messages/in"), false);
+    assert_eq(cstr_topics_match("$SYS/#", "$SYS/broker/messages/in"), true);
+    assert_eq(cstr_topics_match("$SYS/+/messages/in", "$SYS/broker/messages/in"), true);
+    printfln();
+
+    printfln("INFO: Strings use %s", simd_level_names[simd_level()]);
+    assert_eq(strings_agree_with_scalar(), true);
+    printfln();
+
+    Metric_Value memory = metric_value_parse(str8("42.1% (3400 MB / 8000 MB )"));
+    double number = 0.0;
+    assert_eq(metric_value_number(&memory, &number), true);
+    assert_eq(number, 42.1);
+    assert_eq(string_equals(metric_value_get(&memory, str8("unit"))->tag, str8("%")), true);
+    assert_eq(string_equals(metric_value_get(&memory, str8("detail"))->tag, str8("(3400 MB / 8000 MB )")), true);
+    Metric_Value count = metric_value_parse(str8(" 7\n"));
+    assert_eq(count.count, 1);
+    assert_eq(count.fields[0].kind, FIELD_I64);
+    assert_eq(count.fields[0].i64, 7);
+    Metric_Value text = metric_value_parse(str8("<nothing>"));
+    assert_eq(metric_value_number(&text, &number), false);
+    printfln();
+
+    int64_t const timestamps[] = { 1700000000, 1700000001, 1700000002, 1700000004, 1700000100, 1700000100, 1600000000 };
+    double const values[] = { 12.5, 12.5, 13.0, -0.25, 1e300, 0.0, 12.5 };
+    assert_eq(series_round_trips(timestamps, values, ArrayCount(timestamps)), true);
+    assert_eq(series_round_trips(timestamps, values, 1), true);
+
+    Series_Encoder steady = {};
+    for (int i = 0; i < 1000; i++) {
+        series_append(&steady, 1700000000 + i, 42.5);
+    }
+    // 16 bytes for the first point, 10 bits for the first delta and two bits for each of the rest.
+    assert_eq(steady.bits.bytes.count, 16 + (10 + 998 * 2 + 7) / 8);
+    series_destroy(&steady);
+    printfln();
+
+    assert_eq(cstr_condition_holds("value > 80", 80.5), true);
+    assert_eq(cstr_condition_holds("value > 80", 80), false);
+    assert_eq(cstr_condition_holds("value <= -1e3", -1000), true);
+    assert_eq(cstr_condition_holds("value between 90 70", 75), true);
+    assert_eq(cstr_condition_holds("value outside 70 90", 75), false);
+    assert_eq(cstr_condition_holds("value between 70", 75), false);
+    assert_eq(cstr_condition_holds("value ~ 70", 75), false);
+    printfln();
+
+    String topic, value;
+    assert_eq(parse_delivery_line(str8("(topic: a/b, value: \"42.1% (3 / 8)\")"), &topic, &value), true);
+    assert_eq(string_equals(topic, str8("a/b")), true);
+    assert_eq(string_equals(value, str8("42.1% (3 / 8)")), true);
+    assert_eq(parse_delivery_line(str8("(topic: a/b)"), &topic, &value), false);
+    printfln();
+
+    Subscriber_Message* filtered = parse_subscriber_message(str8("+/cpu|localhost:1|-|filter=value > 80"));
+    Publisher_Message hot = parse_publisher_message(str8("h1/cpu|93.5%"));
+    Publisher_Message cold = parse_publisher_message(str8("h1/cpu|12%"));
+    Publisher_Message words = parse_publisher_message(str8("h1/cpu|<nothing>"));
+    assert_eq(subscriber_accepts(filtered, &hot), true);
+    assert_eq(subscriber_accepts(filtered, &cold), false);
+    assert_eq(subscriber_accepts(filtered, &words), false);
+    assert_eq(parse_subscriber_message(str8("+/cpu|localhost:1|-|filter=rate > 80")) == NULL, true);
+    assert_eq(parse_subscriber_message(str8("+/cpu|localhost:1|-|filter=value > 80 90")) == NULL, true);
+    publisher_message_destroy(&hot);
+    publisher_message_destroy(&cold);
+    publisher_message_destroy(&words);
+    subscriber_message_destroy(filtered);
+    free(filtered);
+    printfln();
+
+    Publisher_Message integer = parse_publisher_message(str8("a/b|-7|1700000000123456789"));
+    String_Builder frame = {};
+    record_append_message(&frame, &integer);
+    String record;
+    size_t frame_size;
+    assert_eq(frame_parse(String_from_builder(frame), &record, &frame_size), true);
+    assert_eq(record_for_each_message(record, check_minus_seven), true);
+    list_destroy_safely(&frame);
+    printfln();
+
+    assert_eq(levels_match_parse_topic("a/b/c|1"), true);
+    assert_eq(levels_match_parse_topic("a//b/|1"), true);
+    assert_eq(levels_match_parse_topic("/a/+/#|1"), true);
+    assert_eq(levels_match_parse_topic("a/#/b|1"), false);
+    assert_eq(levels_match_parse_topic("a|b|c"), false);
+    assert_eq(levels_match_parse_topic("a|"), false);
+    assert_eq(levels_match_parse_topic("|1"), false);
+    Publisher_Message everything = parse_publisher_message(str8("#|1"));
+    assert_eq(everything.topic.multilevel_wildcard_index, 0);
+    assert_eq(topics_match(everything.topic, parse_topic(str8("a/b"))), true);
+    publisher_message_destroy(&everything);
+    Publisher_Message stamped = parse_publisher_message(str8("a/b|7|1700000000123456789"));
+    assert_eq(string_equals(stamped.value, str8("7")), true);
+    assert_eq(stamped.published_ns, 1700000000123456789ull);
+    publisher_message_destroy(&stamped);
+    assert_eq(levels_match_parse_topic("a|7|17x"), false);
+    Publisher_Message trailing = parse_publisher_message(str8("a|1|"));
+    assert_eq(string_equals(trailing.value, str8("1|")), true);
+    publisher_message_destroy(&trailing);
+    printfln();
+
+    // Lines that straddle reads, and one that doesn't fit in the buffer.
+    int pipe_fds[2];
+    assert_eq(pipe(pipe_fds), 0);
+    Receive_Buffer buffer = receive_buffer_create(16);
+    String line;
+    assert_eq(write(pipe_fds[1], "a/b|1\na/b|2", 11), 11);
+    assert_eq(receive_buffer_read(&buffer, pipe_fds[0]), 11);
+    assert_eq(receive_buffer_next_line(&buffer, &line), true);
+    assert_eq(string_equals(line, str8("a/b|1")), true);
+    assert_eq(receive_buffer_next_line(&buffer, &line), false);
+    assert_eq(write(pipe_fds[1], "2\nthis/one/is|too long\nc|3\n", 28), 28);
+    size_t lines = 0;
+    while (lines < 2 && receive_buffer_read(&buffer, pipe_fds[0]) > 0) {
+        while (receive_buffer_next_line(&buffer, &line)) {
+            assert_eq(string_equals(line, lines == 0 ? str8("a/b|22") : str8("c|3")), true);
+            lines++;
+        }
+    }
+    assert_eq(lines, 2);
+    receive_buffer_destroy(&buffer);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    printfln();
+
+    Message_Log log = {};
+    for (int i = 0; i < 3 * LOG_SEGMENT_SIZE; i++) {
+        log_message_with_number(&log, i);
+    }
+    Publisher_Message read[10];
+    uint64_t next_offset;
+    assert_eq(message_log_read(&log, LOG_SEGMENT_SIZE - 5, read, ArrayCount(read), &next_offset), 10);
+    assert_eq(read[9].timestamp, LOG_SEGMENT_SIZE + 4);
+    message_log_trim(&log, LOG_SEGMENT_SIZE + 1);
+    assert_eq(log.segments.count, 2);
+    message_log_release(&log, LOG_SEGMENT_SIZE - 1);
+    assert_eq(log.trimmed.count, 1);
+    message_log_release(&log, LOG_SEGMENT_SIZE);
+    assert_eq(log.trimmed.count, 0);
+    assert_eq(message_log_get(&log, LOG_SEGMENT_SIZE) == NULL, true);
+    assert_eq(message_log_get(&log, LOG_SEGMENT_SIZE + 1)->timestamp, LOG_SEGMENT_SIZE + 1);
+    assert_eq(message_log_read(&log, 3 * LOG_SEGMENT_SIZE - 2, read, ArrayCount(read), &next_offset), 2);
+    message_log_trim(&log, 10 * LOG_SEGMENT_SIZE);
+    assert_eq(log.base_offset, 3 * LOG_SEGMENT_SIZE);
+    assert_eq(message_log_append(&log, (Publisher_Message){}), 3 * LOG_SEGMENT_SIZE);
+    assert_eq(message_log_get(&log, 3 * LOG_SEGMENT_SIZE) != NULL, true);
+    printfln();
+
+    // Two series alternate on compacted topics, a third isn't compacted.
+    Message_Log compacted_log = {};
+    Log_Compactor compactor = {};
+    list_append(&compactor.patterns, parse_topic(str8("state/+")));
+    char const* compacted_lines[] = { "state/a|1", "state/b|2", "event|3" };
+    for (int i = 0; i < 2 * LOG_SEGMENT_SIZE + 3; i++) {
+        message_log_append(&compacted_log, parse_publisher_message(String_from_cstr(compacted_lines[i % 3])));
+    }
+    log_compactor_scan(&compactor, &compacted_log, SIZE_MAX);
+    assert_eq(log_compactor_compact(&compactor, &compacted_log, SIZE_MAX), 2 * LOG_SEGMENT_SIZE - 2 * LOG_SEGMENT_SIZE / 3);
+    assert_eq(message_log_get(&compacted_log, 0) == NULL, true);
+    assert_eq(message_log_get(&compacted_log, 2)->topic.original.length, 5);
+    Publisher_Message compacted_read[4];
+    assert_eq(message_log_read(&compacted_log, 0, compacted_read, ArrayCount(compacted_read), &next_offset), 4);
+    assert_eq(next_offset, 14);
+    log_compactor_release(&compactor, &compacted_log, compacted_log.next_offset);
+    assert_eq(compactor.dropped.count, 0);
+    printfln();
+
+    unsigned int seconds;
+    assert_eq(parse_duration(str8("90s"), &seconds) && seconds == 90, true);
+    assert_eq(parse_duration(str8("1.5h"), &seconds) && seconds == 5400, true);
+    assert_eq(parse_duration(str8("30"), &seconds), false);
+    Rollup_Tier_list tiers = {};
+    Rollup_Tier tier;
+    assert_eq(parse_rollup_tier(str8("10s:1h"), &tier) && tier.interval == 10 && tier.retention == 3600, true);
+    list_append(&tiers, tier);
+    assert_eq(parse_rollup_tier(str8("1m:1d"), &tier), true);
+    list_append(&tiers, tier);
+    for (int t = 0; t < 120; t++) {
+        rollup_tiers_add(&tiers, 0, str8("cpu"), t, 1, t, t, t);
+    }
+    rollup_tiers_close(&tiers, 120);
+    assert_eq(list_get(tiers, 0).log.next_offset, 12);
+    assert_eq(list_get(tiers, 1).log.next_offset, 2);
+    Publisher_Message const* rollup = message_log_get(&list_get(tiers, 1).log, 0);
+    assert_eq(string_equals(rollup->value, str8("29.5 (min 0, max 59, count 60)")), true);
+    assert_eq(metric_value_get(&rollup->typed, str8("count"))->i64, 60);
+    assert_eq(rollup_tiers_trim(&tiers, 3611), 2);
+    Rollup_Tier_list second_tiers = {};
+    assert_eq(parse_rollup_tier(str8("1s:1m"), &tier), true);
+    list_append(&second_tiers, tier);
+    for (int t = 0; t <= 2 * LOG_SEGMENT_SIZE; t++) {
+        rollup_tiers_add(&second_tiers, 0, str8("cpu"), t, 1, t, t, t);
+    }
+    assert_eq(rollup_tiers_trim(&second_tiers, 2 * LOG_SEGMENT_SIZE + 60), 2 * LOG_SEGMENT_SIZE);
+    assert_eq(list_get(second_tiers, 0).log.segments.count == 0 && list_get(second_tiers, 0).log.trimmed.count == 0, true);
+    printfln();
+
+    Range_Query query;
+    assert_eq(parse_range_query(str8("disk/+|-1h|now|0"), 10000, &query) && query.from == 6400 && query.to == 10000, true);
+    assert_eq(parse_range_query(str8("disk/+|100|200|5|1m"), 0, &query) && query.resolution == 60 && query.limit == 5, true);
+    assert_eq(parse_range_query(str8("disk/+|yesterday|now|0"), 0, &query), false);
+    // A segment of disk messages a second apart, then one of cpu messages.
+    Message_Log range_log = {};
+    for (int i = 0; i < 2 * LOG_SEGMENT_SIZE; i++) {
+        Publisher_Message message = parse_publisher_message(String_from_cstr(i < LOG_SEGMENT_SIZE ? "disk/a|50" : "cpu/a|10"));
+        message.timestamp = i;
+        message_log_append(&range_log, message);
+    }
+    message_log_trim(&range_log, 10);
+    assert_eq(parse_range_query(str8("disk/+|5|19|0"), 0, &query), true);
+    Segment_Range_list ranges = {};
+    message_log_ranges(&range_log, query.from, query.to, &ranges);
+    assert_eq(ranges.count == 1 && list_get(ranges, 0).start == 10, true);
+    Publisher_Message_list results = {};
+    segment_range_scan(list_get(ranges, 0), &query, &results);
+    assert_eq(results.count, 10);
+    printfln();
+
+    Aggregate aggregate = {};
+    for (int i = 1000; i >= 1; i--) {
+        aggregate_add(&aggregate, i);
+    }
+    double result;
+    assert_eq(aggregate_get(&aggregate, SUBJECT_COUNT, &result) && result == 1000, true);
+    assert_eq(aggregate_get(&aggregate, SUBJECT_MEAN, &result) && result == 500.5, true);
+    assert_eq(aggregate_get(&aggregate, SUBJECT_VALUE, &result), false);
+    assert_eq(fabs(aggregate_quantile(&aggregate, 0.99) - 990) < 990 * 0.02, true);
+    assert_eq(fabs(aggregate_quantile(&aggregate, 0.50) - 500) < 500 * 0.02, true);
+    // Across 40 powers of two the lowest buckets get merged, the high quantiles keep their accuracy.
+    Aggregate wide = {};
+    double x = 1, p90 = 0;
+    for (int i = 0; i < 1000; i++, x *= 1.03) {
+        aggregate_add(&wide, x);
+        if (i == 899) p90 = x;
+    }
+    assert_eq(wide.sketch.buckets.count, SKETCH_MAX_BUCKETS);
+    assert_eq(fabs(aggregate_quantile(&wide, 0.90) - p90) < p90 * 0.02, true);
+    aggregate_merge(&wide, &aggregate);
+    assert_eq(wide.sketch.buckets.count, SKETCH_MAX_BUCKETS);
+    assert_eq(wide.sketch.total, 2000);
+    // Numbers close to each other only take a few buckets.
+    Aggregate narrow = {};
+    for (int i = 0; i < 1000; i++) {
+        aggregate_add(&narrow, 100 + i % 5);
+    }
+    assert_eq(narrow.sketch.buckets.count <= 5, true);
+    aggregate_reset(&narrow);
+    assert_eq(narrow.count == 0 && narrow.sketch.total == 0 && narrow.sketch.buckets.capacity > 0, true);
+    Aggregate negative = {};
+    aggregate_add(&negative, -5);
+    aggregate_add(&negative, -1);
+    aggregate_add(&negative, 0);
+    aggregate_add(&negative, -0.0);
+    assert_eq(aggregate_quantile(&negative, 0), -5);
+    assert_eq(fabs(aggregate_quantile(&negative, 0.5) + 1) < 0.02, true);
+    Aggregate zero = {};
+    aggregate_add(&zero, -0.0);
+    aggregate_add(&zero, 1);
+    aggregate_add(&zero, 2);
+    assert_eq(aggregate_quantile(&zero, 0) < 0.02, true);
+    assert_eq(fabs(aggregate_quantile(&zero, 0.5) - 1) < 0.02, true);
+    aggregate_merge(&negative, &aggregate);
+    assert_eq(negative.min, -5);
+    assert_eq(negative.count, 1004);
+    aggregate_destroy(&aggregate);
+    aggregate_destroy(&wide);
+    aggregate_destroy(&narrow);
+    aggregate_destroy(&negative);
+    aggregate_destroy(&zero);
+    assert_eq(cstr_condition_holds("p99 > 80", 80.5), true);
+    printfln();
+
+    static Histogram latency, other_latency;
+    for (uint64_t i = 1; i <= 100000; i++) {
+        histogram_record(i % 2 ? &latency : &other_latency, i * 1000);
+    }
+    histogram_merge(&latency, &other_latency);
+    assert_eq(latency.total, 100000);
+    assert_eq(fabs(histogram_percentile(&latency, 50) / 50e6 - 1) < 0.02, true);
+    assert_eq(fabs(histogram_percentile(&latency, 99.9) / 99.9e6 - 1) < 0.02, true);
+    assert_eq(histogram_percentile(&latency, 100) <= latency.max, true);
+    assert_eq(histogram_bucket(UINT64_MAX) < HISTOGRAM_BUCKET_COUNT, true);
+    printfln();
+
+    assert_eq(log_record_formats_like_printf("Publisher connected to port %d.", 8080), true);
+    assert_eq(log_record_formats_like_printf("%-6s|%.*s|%5.2f%%|%zu %llu %x %c", "ab", 3, "abcdef", 3.14159, (size_t)7, 1ull << 40, 255u, 'z'), true);
+    assert_eq(log_record_formats_like_printf("%ld %hhd %+d %08.3f %10.*s.", -5l, (signed char)-3, 4, -2.5, 2, "xyz"), true);
+    printfln();
+
+    Hash_Index index = {};
+    for (uint32_t i = 0; i < 1000; i++) {
+        hash_index_insert(&index, i % 10, i);
+    }
+    size_t probe = 0;
+    size_t found = 0;
+    for (uint32_t i; (i = hash_index_next(&index, 7, &probe)) != HASH_INDEX_EMPTY;) {
+        found += i % 10 == 7;
+    }
+    assert_eq(found, 100);
+    probe = 0;
+    assert_eq(hash_index_next(&index, 10, &probe), HASH_INDEX_EMPTY);
     printfln();
 
     return 0;